@@ -0,0 +1,26 @@
+/**
+*	@file benchmark.h
+*	@brief Micro benchmarks of the firmware hot paths (AES, MQTT packet construction, reply parsing).
+*
+*	The results are printed through the debug UART as a JSON array, one object per benchmark:
+*	{"name":"aes128_encrypt","clock_hz":8000000,"iterations":1000,"ns_per_op":123456,"bytes_per_op":16}
+*	bytes_per_op is the number of bytes processed by one call of the benchmarked function.
+*	clock_hz is the system clock during the benchmark, every benchmark is run at each clock setting.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdint.h>
+
+/* Uncomment to run the benchmark suite once after sim_init(), before the main loop starts */
+//#define BENCHMARK_MODE 1
+
+/**
+ * @brief runs all the benchmarks and prints the results through the debug UART.
+ * The debug UART must be initialized before calling this function.
+ */
+void run_benchmarks(void);
+
+#endif
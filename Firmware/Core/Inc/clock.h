@@ -0,0 +1,56 @@
+/**
+*	@file clock.h
+*	@brief Clock manager: switches the system clock between a low power setting, the 8 MHz HSE and a 48 MHz PLL burst.
+*
+*	The firmware runs from the HSE at 8 MHz by default. CPU heavy sections (AES, batch encoding, parsing) can run
+*	between clock_burst_begin() and clock_burst_end() at 48 MHz. Starting the PLL takes a few hundred us, so a burst
+*	only pays off for work that takes milliseconds at 8 MHz. Long blocking waits for the module can run in
+*	CLOCK_MODE_LOW.
+*
+*	On every switch, SysTick is re-derived by the HAL, the baud rate registers of the UARTs clocked by PCLK are
+*	re-derived from the new clock, and the profiler timer prescaler is updated. USART1 is clocked by the HSI and is
+*	not affected.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+typedef enum {
+	CLOCK_MODE_LOW,   /* HSE / 2 = 4 MHz */
+	CLOCK_MODE_HSE,   /* HSE = 8 MHz, set by SystemClock_Config() */
+	CLOCK_MODE_BURST, /* HSE x 6 = 48 MHz through the PLL, 1 flash wait state */
+	CLOCK_MODE_COUNT
+} clock_mode_typedef;
+
+/**
+ * @brief switches the system clock. Waits for the end of the transmissions on the UARTs clocked by PCLK first.
+ * @param mode is the new clock setting.
+ * @return SUCCESS if the clock was switched, FAIL otherwise (the previous setting is kept).
+ */
+uint8_t clock_set(clock_mode_typedef mode);
+
+/**
+ * @return the current clock setting.
+ */
+clock_mode_typedef clock_get(void);
+
+/**
+ * @brief switches to CLOCK_MODE_BURST. Calls can be nested, the clock goes back to the previous setting at the
+ * matching clock_burst_end().
+ */
+void clock_burst_begin(void);
+
+/**
+ * @brief ends a section started with clock_burst_begin().
+ */
+void clock_burst_end(void);
+
+/**
+ * @brief restores the clock setting after a wake-up from STOP mode, which restarts the MCU on the HSI.
+ */
+void clock_restore(void);
+
+#endif
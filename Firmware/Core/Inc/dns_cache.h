@@ -0,0 +1,65 @@
+/**
+*	@file dns_cache.h
+*	@brief Cache of the address of the server, resolved with AT+CDNSGIP.
+*
+*	A server given by name would otherwise be resolved by the module at every AT+CIPSTART. The uplink resolves the name
+*	once with AT+CDNSGIP and opens the next connections to the cached address until DNS_CACHE_TTL expires, or until
+*	a connection to it fails. AT+CDNSGIP does not report the TTL of the record: DNS_CACHE_TTL is set to the TTL of
+*	the record of the server. Every server of the endpoint list has its own entry, so that a failover to another
+*	server and back does not resolve the name again.
+*
+*	The entries are kept in the .noinit RAM section, which the startup code does not clear, see STM32F051R8TX_FLASH.ld.
+*	dns_cache_save() stores the TTL left before a system reset of the recovery ladder, so that the names are not
+*	resolved again after the reset. An entry not saved, after a watchdog reset for instance, is dropped at boot: the
+*	time spent before the reset is not known.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <stdint.h>
+#include "network_functions.h"
+#include "endpoint.h"
+
+#define DNS_CACHE_TTL 3600000 /* ms an address is used before the name is resolved again */
+#define DNS_CACHE_ENTRIES ENDPOINT_MAX /* one name per server */
+
+/**
+ * @brief restores the entries saved before the reset. Called once at boot.
+ */
+void dns_cache_init(void);
+
+/**
+ * @param host is the name or the address of the server.
+ * @return TRUE if host is an IPv4 address in dotted decimal, which needs no resolution.
+ */
+uint8_t dns_is_address(const char * host);
+
+/**
+ * @param host is the name of the server.
+ * @return the cached address of the server, NULL if there is none or it expired.
+ */
+const char * dns_cache_lookup(const char * host);
+
+/**
+ * @brief caches the address of the server for DNS_CACHE_TTL. A new name replaces the entry resolved first when the
+ * cache is full.
+ * @param host is the name of the server.
+ * @param ip_address is its address, as parsed by get_dns_address().
+ */
+void dns_cache_store(const char * host, const char * ip_address);
+
+/**
+ * @brief drops the cached address of the server, if it has one: the name is resolved again before the next
+ * connection to it.
+ * @param host is the name or the address of the server.
+ */
+void dns_cache_invalidate(const char * host);
+
+/**
+ * @brief keeps the entries and their TTL left across the next system reset.
+ */
+void dns_cache_save(void);
+
+#endif
@@ -0,0 +1,74 @@
+/**
+*	@file endpoint.h
+*	@brief Servers the uplink connects to, with failover and health scores.
+*
+*	The servers are given in order of preference. Every server has a rolling success rate of its connections and a
+*	rolling connect latency, from AT+CIPSTART to CONNECT OK. A new connection goes to the current server while it is
+*	healthy, so that the session does not move between servers. Otherwise it goes to the server with the best score:
+*	the success rate, less ENDPOINT_LATENCY_PENALTY per second of connect latency.
+*
+*	A connection that cannot be opened (CONNECT FAIL or no URC) fails over to the next best server right away, without
+*	climbing the recovery ladder. The ladder only climbs once every server failed, see recovery.h: a single dead
+*	server no longer ends in a system reset.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <stdint.h>
+
+#define ENDPOINT_MAX 4 /* servers in the list */
+#define ENDPOINT_RATE_ONE 1000 /* success rate of a server whose connections all succeed */
+#define ENDPOINT_RATE_WEIGHT 8 /* a connection weighs 1/ENDPOINT_RATE_WEIGHT in the rolling success rate */
+#define ENDPOINT_LATENCY_WEIGHT 4 /* a connection weighs 1/ENDPOINT_LATENCY_WEIGHT in the rolling latency */
+#define ENDPOINT_LATENCY_PENALTY 20 /* score lost per second of connect latency, in ENDPOINT_RATE_ONE units */
+#define ENDPOINT_HEALTHY_RATE 750 /* success rate from which the current server is kept */
+
+typedef struct {
+	const char * host; /* IP address or name */
+	const char * port;
+} endpoint_typedef;
+
+/**
+ * @brief sets the list of servers. Untried servers have a full success rate, the first one is used first.
+ * @param list is the list of servers, in order of preference. It must stay valid.
+ * @param count is the number of servers, at most ENDPOINT_MAX.
+ */
+void endpoint_init(const endpoint_typedef * list, uint8_t count);
+
+/**
+ * @brief chooses the server of the next connection: the current one if it is healthy, the best score otherwise.
+ * The servers that failed since the last successful connection are skipped.
+ * @return the server.
+ */
+const endpoint_typedef * endpoint_select(void);
+
+/**
+ * @return the server chosen by the last endpoint_select().
+ */
+const endpoint_typedef * endpoint_current(void);
+
+/**
+ * @brief records a connection opened to the current server.
+ * @param latency is the time from AT+CIPSTART to CONNECT OK, in ms.
+ */
+void endpoint_report_success(uint32_t latency);
+
+/**
+ * @brief records a connection to the current server that could not be opened or was refused by the server.
+ */
+void endpoint_report_failure(void);
+
+/**
+ * @return TRUE if a server that did not fail since the last successful connection is left to try, FALSE once every
+ * server failed: the next endpoint_select() starts a new round over all of them.
+ */
+uint8_t endpoint_failover(void);
+
+/**
+ * @brief sends the success rate and latency of every server to the debug port.
+ */
+void endpoint_report(void);
+
+#endif
@@ -0,0 +1,105 @@
+/**
+*	@file flash_log.h
+*	@brief Store-and-forward log of the fixes in the internal flash, for the periods without network.
+*
+*	The fixes that do not fit the RAM queue of the uplink are appended to a circular log kept in the last
+*	FLASH_LOG_PAGES pages of the internal flash, which the linker script leaves out of the program. Every record has
+*	a sequence number and a CRC: at boot the log is scanned to find the newest record, and a record cut by a reset
+*	is skipped. The log is only appended to, and a page is erased when the log comes back to it, so that every page
+*	is erased as often as the others.
+*
+*	Once the link is back, the uplink drains the log, oldest first, into batches. The records are read in place from
+*	the flash, so the RAM footprint does not depend on the size of the backlog. A record read into a batch stays
+*	pending until the server acknowledged the batch: the batch keeps the range of its records, which are marked as
+*	uploaded with flash_log_release() at its PUBACK. A reset while the batch is in flight uploads them again.
+*	When the log is full, the oldest page is erased and its records are lost, in flight or not.
+*
+*	A page erase stalls the CPU for 20 to 40 ms, long enough to overrun USART1. flash_log_prepare() lets the caller
+*	erase the next page ahead, at a time the module is not expected to send anything.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef FLASH_LOG_H
+#define FLASH_LOG_H
+
+#include <stdint.h>
+#include "sim808.h"
+#include "position.h"
+
+#define FLASH_LOG_START 0x0800C000 /* the last 16 KB of the 64 KB flash, see STM32F051R8TX_FLASH.ld */
+#define FLASH_LOG_PAGES 16
+#define FLASH_LOG_PAGE_SIZE 1024
+#define FLASH_LOG_RECORD_LENGTH 32
+#define FLASH_LOG_RECORDS_PER_PAGE (FLASH_LOG_PAGE_SIZE/FLASH_LOG_RECORD_LENGTH)
+#define FLASH_LOG_RECORDS (FLASH_LOG_PAGES*FLASH_LOG_RECORDS_PER_PAGE)
+
+/* Records read into a batch, see flash_log_take() */
+typedef struct {
+	uint16_t first;    /* index of the first record */
+	uint16_t span;     /* records from first, skipped ones included, 0 if none */
+	uint32_t sequence; /* sequence number of the first record: a record erased and written again is not released */
+} flash_log_range_typedef;
+
+/**
+ * @brief scans the log for the newest record and the oldest record not yet uploaded. Called once at boot.
+ */
+void flash_log_init(void);
+
+/**
+ * @brief appends a fix to the log. Blocks for a page erase when the log enters a page not erased ahead, ~40 ms.
+ * @param position is the fix, stored with POSITION_FLAG_STORED.
+ * @return SUCCESS if the record was written, FAIL otherwise.
+ */
+uint8_t flash_log_append(const position_typedef * position);
+
+/**
+ * @return TRUE if the next flash_log_append() erases a page.
+ */
+uint8_t flash_log_erase_pending(void);
+
+/**
+ * @brief erases the page the next flash_log_append() enters, if it needs one. Its records are lost as they would be
+ * by the append.
+ */
+void flash_log_prepare(void);
+
+/**
+ * @return the oldest fix not yet read into a batch, read in place in the flash, NULL if there is none.
+ */
+const position_typedef * flash_log_peek(void);
+
+/**
+ * @brief adds the fix returned by flash_log_peek() to a range, the next flash_log_peek() returns the next fix.
+ * @param range is the range of the batch, with a span of 0 before its first fix.
+ */
+void flash_log_take(flash_log_range_typedef * range);
+
+/**
+ * @brief the batch of the range was acknowledged: its fixes are marked as uploaded.
+ * @param range is the range of the batch.
+ */
+void flash_log_release(const flash_log_range_typedef * range);
+
+/**
+ * @brief the batch of the range was not sent: its fixes are read again by the next flash_log_peek().
+ * Only the last range taken can be given back.
+ * @param range is the range of the batch.
+ */
+void flash_log_rewind(const flash_log_range_typedef * range);
+
+/**
+ * @return the number of fixes in the log not yet uploaded, in flight included.
+ */
+uint16_t flash_log_count(void);
+
+/**
+ * @return the number of fixes in the log not yet read into a batch.
+ */
+uint16_t flash_log_unread(void);
+
+/**
+ * @return the number of fixes lost since boot, erased when the log was full or not written.
+ */
+uint32_t flash_log_dropped(void);
+
+#endif
@@ -0,0 +1,74 @@
+/**
+*	@file gprs.h
+*	@brief Non-blocking GPRS bring-up: the checks of enable_gprs() as a resumable state machine.
+*
+*	Every stage sends one AT command with send_AT_cmd_async() and returns to the caller until the reply is received.
+*	A stage that fails sends its corrective command when there is one (AT+CFUN=1, AT+CREG=1, AT+CGATT=1, ...) and
+*	is retried after an exponential backoff with jitter. Each stage has its own failure count, so a slow network
+*	registration does not make the later stages wait longer. The state is exposed so that the uplink keeps
+*	queuing fixes while GPRS is not up instead of blocking.
+*
+*	The PIN is only sent when AT+CPIN? replies SIM PIN, and at most once per boot: a SIM that asks for its PUK, that
+*	replies ERROR to the PIN or still asks for it GPRS_PIN_SETTLE after stops the bring-up in GPRS_STATE_LOCKED
+*	instead of using up its attempts.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef GPRS_H
+#define GPRS_H
+
+#include <stdint.h>
+
+#define GPRS_POLL_PERIOD 10 /* ms between two checks of a pending reply */
+#define GPRS_BACKOFF_BASE 1000 /* ms, backoff after the first failure of a stage */
+#define GPRS_BACKOFF_MAX 60000 /* ms, upper bound of the backoff */
+#define GPRS_ACTIVATE_TIMEOUT 10000 /* ms to wait for the reply to AT+CIICR */
+#define GPRS_PIN_SETTLE 10000 /* ms AT+CPIN? may still reply SIM PIN after the PIN was sent */
+
+typedef enum {
+	GPRS_STATE_DOWN,         /* bring-up not started */
+	GPRS_STATE_PHONE,        /* AT+CFUN? */
+	GPRS_STATE_SIM,          /* AT+CSMINS? */
+	GPRS_STATE_PIN,          /* AT+CPIN? */
+	GPRS_STATE_SIGNAL,       /* AT+CSQ */
+	GPRS_STATE_REGISTRATION, /* AT+CREG? */
+	GPRS_STATE_ATTACH,       /* AT+CGATT? */
+	GPRS_STATE_DATA_MODE,    /* AT+CIPHEAD=1, received TCP data is prefixed with +IPD,<length>:, or AT+CIPMODE=1 in TRANSPARENT_MODE */
+	GPRS_STATE_QUICK_SEND,   /* AT+CIPQSEND=1, a write completes on DATA ACCEPT instead of SEND OK */
+	GPRS_STATE_PDP,          /* AT+CIPSTATUS, selects the next PDP stage */
+	GPRS_STATE_DEFINE,       /* AT+CSTT="APN","","" */
+	GPRS_STATE_ACTIVATE,     /* AT+CIICR */
+	GPRS_STATE_GET_IP,       /* AT+CIFSR */
+	GPRS_STATE_UP,           /* GPRS is ready for TCP connections */
+	GPRS_STATE_LOCKED,       /* the SIM needs the PUK or rejected the PIN, the bring-up is stopped until reboot */
+	GPRS_STATE_COUNT
+} gprs_state_typedef;
+
+/**
+ * @brief starts the bring-up from the first stage. Also used when the uplink finds GPRS down or after a recovery step.
+ */
+void gprs_restart(void);
+
+/**
+ * @brief runs the current stage: sends its command or checks its reply. Never blocks.
+ * The caller must own the AT port while gprs_at_pending() is TRUE.
+ * @return the delay in ms before the next call.
+ */
+uint32_t gprs_step(void);
+
+/**
+ * @return TRUE while a command of the bring-up waits for its reply.
+ */
+uint8_t gprs_at_pending(void);
+
+/**
+ * @return the current stage.
+ */
+gprs_state_typedef gprs_get_state(void);
+
+/**
+ * @return the name of a stage, for debug messages.
+ */
+const char * gprs_state_name(gprs_state_typedef state);
+
+#endif
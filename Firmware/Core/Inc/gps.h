@@ -8,6 +8,7 @@
 #define GPS_H
 
 #include "sim808.h"
+#include "position.h"
 
 
 
@@ -21,11 +22,21 @@ uint8_t enable_gps();
 
 /**
 * @brief checks if the module has a GPS fix, if yes, it querries the GPS module for the current position. 
-* The format of the output is longitude,latitude Example: 3937.656010,1406.059400
-* @param coordinates is an array that will store the GPS position.
+* @param position receives the fix, see parse_gps_location().
 * @return 1 if the GPS position is calculated correctly, 0 if the module doesn't have a fix or an error occurs.
 */
-uint8_t get_gps_location(char* position);
+uint8_t get_gps_location(position_typedef * position);
+
+
+
+/**
+* @brief decodes the reply of the module to AT+CGPSINF=0: position, altitude, UTC time, satellites, speed and course.
+* The flags are cleared.
+* @param cmd_reply is the reply of the module, RX_BUFFER_LENGTH bytes.
+* @param position receives the fix.
+* @return SUCCESS if the reply holds a position, FAIL otherwise.
+*/
+uint8_t parse_gps_location(const char * cmd_reply, position_typedef * position);
 
 
 
@@ -0,0 +1,174 @@
+/**
+*	@file mqtt.h
+*	@brief MQTT QoS 1 delivery: in-flight window of unacknowledged PUBLISH packets and PUBACK tracking, and decoder
+*	of the packets received from the server.
+*
+*	A PUBLISH is only delivered when the server acknowledges its packet identifier with a PUBACK, DATA ACCEPT from the
+*	module only means that the module took the bytes. Up to MQTT_INFLIGHT_WINDOW packets wait for their PUBACK at
+*	the same time, so the uplink keeps sending while earlier packets are in flight instead of waiting one network
+*	round trip per message. A packet without PUBACK after MQTT_RETRY_TIMEOUT is sent again with the DUP flag.
+*	When the connection is lost, every packet in flight is sent again on the next connection.
+*
+*	The packets are kept in the window until acknowledged: the window is the retransmission buffer.
+*
+*	The packets received from the server (CONNACK, PUBACK, PINGRESP, PUBLISH) are decoded incrementally from the
+*	TCP data received by the module, see peek_tcp_data(): a packet may be split over several reads and a read may hold
+*	several packets. Only the headers are kept by the decoder, the payload of a PUBLISH is handed to the downlink
+*	handler in place. A QoS 1 PUBLISH from the server is acknowledged with the next packets sent.
+*
+*	With MQTTSN_MODE the same window holds MQTT-SN PUBLISH messages to the predefined topic MQTTSN_TOPIC_ID, and the
+*	decoder reads MQTT-SN messages. With MQTTSN_QOS below 1 nothing is acknowledged: a PUBLISH is delivered once sent.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef MQTT_H
+#define MQTT_H
+
+#include <stdint.h>
+#include "network_functions.h"
+#include "flash_log.h"
+#include "position.h"
+
+#define MQTT_INFLIGHT_WINDOW 4 /* PUBLISH packets waiting for their PUBACK at the same time */
+#define MQTT_INFLIGHT_PACKET_LENGTH 200 /* largest PUBLISH kept for retransmission, a batch is up to POSITION_BATCH_LENGTH bytes */
+#define MQTT_PUBLISH_HEADER_MAX_LENGTH (1+2+2+MQTT_TOPIC_MAX_LENGTH+2) /* 2 bytes of remaining length, longest topic, packet identifier */
+
+/* A batch that does not fit the window would be rebuilt the same way forever */
+#if MQTT_PUBLISH_HEADER_MAX_LENGTH+POSITION_BATCH_LENGTH > MQTT_INFLIGHT_PACKET_LENGTH
+#error "a full batch with the longest topic must fit MQTT_INFLIGHT_PACKET_LENGTH"
+#endif
+#define MQTT_RETRY_TIMEOUT 10000 /* ms without PUBACK before a PUBLISH is sent again with the DUP flag */
+#define MQTT_MAX_RETRIES 3 /* retransmissions without PUBACK after which the connection is considered broken */
+#define MQTT_RX_TOPIC_LENGTH 32 /* longest topic of a PUBLISH received from the server, longer ones are skipped */
+#define MQTT_PUBACK_QUEUE_LENGTH 4 /* PUBACKs to be sent for QoS 1 PUBLISH packets received from the server */
+
+/* Packet types, upper 4 bits of the fixed header */
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_PINGRESP 13
+
+/* Delivery counters, see mqtt_get_stats() */
+typedef struct {
+	uint32_t acked;          /* PUBLISH packets acknowledged by the server */
+	uint32_t items;          /* items (fixes) in the acknowledged packets */
+	uint32_t retransmitted;  /* PUBLISH packets sent again with the DUP flag */
+	uint32_t latency_total;  /* ms from the oldest item of each acknowledged packet to its PUBACK */
+	uint32_t latency_max;    /* ms */
+	uint32_t pingresps;      /* PINGRESP packets received */
+	uint32_t downlinks;      /* PUBLISH packets received from the server */
+	uint32_t rx_skipped;     /* packets received that were not decoded: unknown type, malformed or topic too long */
+	uint32_t rx_unsupported; /* QoS 2 PUBLISH packets received, not acknowledged: only QoS 0 and 1 are supported */
+} mqtt_stats_typedef;
+
+/**
+ * Receives the payload of a PUBLISH from the server, in place. A payload split over several reads comes in several
+ * calls: offset is the position of data in the payload, and offset+length equals total on the last call.
+ * The data is only valid during the call. With MQTTSN_MODE, the topic is the 2 bytes topic identifier, big-endian.
+ */
+typedef void (*mqtt_downlink_handler_typedef)(const char * topic, uint16_t topic_length, const uint8_t * data, uint16_t length, uint32_t offset, uint32_t total);
+
+/**
+ * @return the number of free places in the in-flight window.
+ */
+uint8_t mqtt_window_free(void);
+
+/**
+ * @brief builds a QoS 1 PUBLISH with a new packet identifier and keeps it in the window until its PUBACK.
+ * The packet is sent by the next mqtt_window_append().
+ * @param topic is the template of the MQTT topic, see MQTT_TOPIC_TEMPLATE(). Not used with MQTTSN_MODE.
+ * @param payload is the message to be sent.
+ * @param payload_length is the length of the payload in bytes.
+ * @param items is the number of items (fixes) in the payload, for the statistics.
+ * @param created_at is the HAL_GetTick() time of the oldest item, for the latency statistics.
+ * @param stored is the range of the flash log records in the payload, released with flash_log_release() once the
+ * packet is delivered. A span of 0 if none.
+ * @return SUCCESS if the packet was added, FAIL if the window is full or the packet too long.
+ */
+uint8_t mqtt_window_add(const mqtt_topic_template_typedef * topic, const uint8_t * payload, uint16_t payload_length, uint8_t items, uint32_t created_at, const flash_log_range_typedef * stored);
+
+/**
+ * @brief gives the payload of a packet of the window not yet delivered, to save its items before a reset.
+ * @param index is the place in the window, 0 to MQTT_INFLIGHT_WINDOW-1.
+ * @param length receives the length of the payload in bytes.
+ * @return the payload, NULL if the place is free.
+ */
+const uint8_t * mqtt_window_payload(uint8_t index, uint16_t * length);
+
+/**
+ * @brief appends the PUBACKs of the PUBLISH packets received from the server, then the packets to be sent (new
+ * ones, PUBACK timeouts and packets of a lost connection) as long as they fit in the TX buffer.
+ * mqtt_window_sent() or mqtt_window_unsent() must follow.
+ * @param tx is the TX buffer.
+ * @return the number of PUBLISH packets appended.
+ */
+uint8_t mqtt_window_append(tx_buffer_typedef * tx);
+
+/**
+ * @brief records that the packets of the last mqtt_window_append() were sent (DATA ACCEPT): their PUBACK timeout starts.
+ */
+void mqtt_window_sent(void);
+
+/**
+ * @brief the packets of the last mqtt_window_append() were not sent, they are appended again next time.
+ */
+void mqtt_window_unsent(void);
+
+/**
+ * @brief the connection was lost: every packet in flight is sent again, with the DUP flag, on the next connection.
+ */
+void mqtt_window_resend_all(void);
+
+/**
+ * @return TRUE if packets are waiting to be sent or sent again, PUBACKs to the server included.
+ */
+uint8_t mqtt_window_pending(void);
+
+/**
+ * @return TRUE if a packet was sent more than MQTT_MAX_RETRIES times without PUBACK.
+ */
+uint8_t mqtt_window_stalled(void);
+
+/**
+ * @return the time in ms until the next PUBACK timeout, 0xFFFFFFFF if no packet waits for its PUBACK.
+ */
+uint32_t mqtt_window_next_timeout(void);
+
+/**
+ * @brief decodes the TCP data received from the server and processes the packets. Never blocks.
+ */
+void mqtt_poll_rx(void);
+
+/**
+ * @brief the connection was lost or a new one is opened: a packet partly received is dropped.
+ */
+void mqtt_rx_reset(void);
+
+/**
+ * @return the return code of a CONNACK that refused the connection since the last call, 0 if none.
+ */
+uint8_t mqtt_connack_refused(void);
+
+/**
+ * @return TRUE if a CONNACK accepted the connection since the last call.
+ */
+uint8_t mqtt_connack_accepted(void);
+
+/**
+ * @return TRUE if a PINGRESP was received since the last call.
+ */
+uint8_t mqtt_pingresp_received(void);
+
+/**
+ * @brief sets the function receiving the PUBLISH packets from the server.
+ * @param handler is the function, NULL to drop the packets.
+ */
+void mqtt_set_downlink_handler(mqtt_downlink_handler_typedef handler);
+
+/**
+ * @brief copies the delivery counters and clears them.
+ * @param stats receives the counters since the previous call.
+ */
+void mqtt_get_stats(mqtt_stats_typedef * stats);
+
+#endif
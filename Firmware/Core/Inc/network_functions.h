@@ -22,6 +22,17 @@
 #define ERR_PDP_ACTIVATE 55
 #define ERR_GET_IP 56
 
+/* TCP/GPRS status, see get_tcp_status() */
+#define TCP_STATUS_READY 0 /* GPRS is up and no TCP connection is open */
+#define TCP_STATUS_GPRS_DOWN 1 /* GPRS must be enabled before opening a TCP connection */
+#define TCP_STATUS_CONNECTED 2 /* a TCP connection is open or being opened */
+#define TCP_STATUS_UNKNOWN 3 /* returned by link_state_get() when AT+CIPSTATUS must be sent */
+
+#define LINK_STATE_MAX_AGE 60000 /* ms after which the cached link state is considered stale */
+#define CIPSTATUS_SETTLE 100 /* ms to wait for the STATE line, which the module sends after the OK of AT+CIPSTATUS */
+#define DNS_TIMEOUT 15000 /* ms to wait for the +CDNSGIP URC, which the module sends once the name is resolved */
+#define DNS_ADDRESS_LENGTH 16 /* IPv4 address in dotted decimal, with the terminating NUL */
+
 /* MQTT error code*/
 #define ERR_MQTT_EMPTY_PARAM 100
 
@@ -30,9 +41,130 @@
 #define APN_LENGTH 2 /* Length of the APN string */
 #define SIM_PIN ""
 
+/* TX coalescing: the packets of a message are sent with a single AT+CIPSEND */
+#define TCP_MAX_SEND_LENGTH 1460 /* most bytes accepted by one AT+CIPSEND, as replied to AT+CIPSEND? */
+#define TX_BUFFER_LENGTH 256 /* bytes coalesced in one send, at most TCP_MAX_SEND_LENGTH, bounded by the RAM */
+
+#if TX_BUFFER_LENGTH > TCP_MAX_SEND_LENGTH
+#error "TX_BUFFER_LENGTH must not exceed TCP_MAX_SEND_LENGTH"
+#endif
+
+/* Transparent mode (AT+CIPMODE=1): once the connection is open, the UART is a byte pipe to the server and the uplink
+ * writes its packets without AT+CIPSEND, its prompt and DATA ACCEPT. The module is taken back to command mode with the
+ * +++ escape sequence, surrounded by ESCAPE_GUARD_TIME of silence, and back to data mode with ATO. The GPS queries
+ * share the UART, so the uplink leaves data mode after every message.
+ * The blocking publish_mqtt_msg() only works in the default, non-transparent mode.
+ */
+//#define TRANSPARENT_MODE 1
+#define ESCAPE_GUARD_TIME 1000 /* ms without data before and after +++ */
+
+/* Quick send (AT+CIPQSEND=1): a write completes on DATA ACCEPT, as soon as the module took the data, instead of
+ * SEND OK, once the server acknowledged it at the TCP level. The bytes still unacknowledged are read with AT+CIPACK,
+ * every TCP_ACK_CHECK_PERIOD instead of at every write, so that several writes are in flight in one network round trip.
+ */
+#define TCP_ACK_CHECK_PERIOD 10000 /* ms between two AT+CIPACK while bytes are unacknowledged */
+#define TCP_ACK_FAST_PERIOD 1000 /* ms between two AT+CIPACK while the writes wait for TCP_MAX_UNACKED */
+#define TCP_MAX_UNACKED 1024 /* unacknowledged bytes from which the writes wait */
+#define TCP_ACK_TIMEOUT 30000 /* ms without acknowledged bytes, while some are unacknowledged, after which the connection is broken */
+
+/* MQTT-SN over UDP (MQTTSN_MODE): the uplink opens a UDP socket (AT+CIPSTART="UDP") to an MQTT-SN gateway, see
+ * Server/mqttsn_gateway.py, which forwards the messages to the MQTT broker. Opening the socket costs no handshake with
+ * the server, and a PUBLISH names its topic with a predefined 2 bytes identifier instead of the topic name.
+ * MQTTSN_QOS selects the delivery: -1 publishes without CONNECT and without acknowledgement, 0 opens a session with
+ * CONNECT but the PUBLISH packets are not acknowledged, 1 waits for the PUBACK of every PUBLISH, see mqtt.h.
+ * A datagram carries a single MQTT-SN message, so the uplink sends one packet per AT+CIPSEND. UDP has no acknowledgement
+ * to read with AT+CIPACK. The port given to tasks_run() is the one of the gateway.
+ */
+//#define MQTTSN_MODE 1
+#ifndef MQTTSN_QOS
+#define MQTTSN_QOS 1 /* -1, 0 or 1, may be given on the compiler command line */
+#endif
+#define MQTTSN_TOPIC_ID 1 /* predefined topic identifier of MQTT_TOPIC, known to the gateway */
+
+#if defined(MQTTSN_MODE) && defined(TRANSPARENT_MODE)
+#error "MQTTSN_MODE sends one datagram per AT+CIPSEND, it cannot be used with TRANSPARENT_MODE"
+#endif
+
+/* MQTT-SN message types */
+#define MQTTSN_CONNECT 0x04
+#define MQTTSN_CONNACK 0x05
+#define MQTTSN_PUBLISH 0x0C
+#define MQTTSN_PUBACK 0x0D
+#define MQTTSN_PINGREQ 0x16
+#define MQTTSN_PINGRESP 0x17
+#define MQTTSN_CONNECT_HEADER_LENGTH 6 /* length, type, flags, protocol identifier and duration of a CONNECT */
+#define MQTTSN_PUBLISH_HEADER_LENGTH 7 /* length, type, flags, topic identifier and message identifier of a PUBLISH */
+#define MQTTSN_MAX_LENGTH 255 /* longest message with a one byte length field, the only one built here */
+#define MQTTSN_FLAG_DUP 0x80
+#define MQTTSN_FLAG_QOS_MASK 0x60
+#define MQTTSN_FLAG_CLEAN_SESSION 0x04
+#define MQTTSN_FLAG_TOPIC_PREDEFINED 0x01
+
 /* MQTT packet variable definitions*/
-#define MAX_LENGTH_MQTT_PACKET 128
+#define MAX_LENGTH_MQTT_PACKET TCP_MAX_SEND_LENGTH /* a packet is sent with one AT+CIPSEND */
 #define MQTT_KEEP_ALIVE 15
+#define MQTT_CLIENT_ID_MAX_LENGTH 23 /* longest client ID that every server must accept */
+#define MQTT_TOPIC_MAX_LENGTH 16 /* longest topic of a PUBLISH template */
+#define MQTT_CONNECT_HEADER_LENGTH 14 /* fixed header, variable header and client ID length of a CONNECT */
+
+typedef struct {
+	uint8_t data[TX_BUFFER_LENGTH];
+	uint16_t length;
+} tx_buffer_typedef;
+
+/* Packet headers that do not change during the life of the device, built at compile time so that they are kept in
+ * flash and copied as they are: the CONNECT packet of a client ID, and the topic of the PUBLISH packets.
+ * Only bytes, so that the structures have no padding and are sent as they are laid out.
+ */
+typedef struct {
+	uint8_t header[MQTT_CONNECT_HEADER_LENGTH];
+	char client_id[MQTT_CLIENT_ID_MAX_LENGTH];
+} mqtt_connect_template_typedef;
+
+typedef struct {
+	uint8_t length[2];
+	char name[MQTT_TOPIC_MAX_LENGTH];
+} mqtt_topic_template_typedef;
+
+/* Compile-time check usable inside an initializer: evaluates to 0, does not compile when condition is false */
+#define TEMPLATE_CHECK(condition,message) (0*sizeof(struct {_Static_assert(condition,message); uint8_t unused;}))
+
+/* A client ID of the template is at most MQTT_CLIENT_ID_MAX_LENGTH characters, a longer one would be cut silently */
+#define CLIENT_ID_CHECK(client_id) TEMPLATE_CHECK(sizeof(client_id)-1 <= MQTT_CLIENT_ID_MAX_LENGTH,"client ID too long")
+
+/* Initializer of a mqtt_connect_template_typedef: protocol level 4, clean session, keep alive MQTT_KEEP_ALIVE.
+ * client_id must be a string literal of at most MQTT_CLIENT_ID_MAX_LENGTH characters. The remaining length is
+ * encoded in a single byte, which holds up to 127.
+ */
+#define MQTT_CONNECT_TEMPLATE(client_id) { \
+	{0x10, 12+sizeof(client_id)-1+CLIENT_ID_CHECK(client_id) \
+	+TEMPLATE_CHECK(12+sizeof(client_id)-1 < 128,"CONNECT remaining length does not fit one byte"), \
+	0x00, 0x04, 0x4d, 0x51, 0x54, 0x54, 0x04, 0x02, \
+	(uint8_t)(MQTT_KEEP_ALIVE>>8), (uint8_t)MQTT_KEEP_ALIVE, 0x00, sizeof(client_id)-1}, client_id }
+
+/* Initializer of a mqtt_topic_template_typedef, topic must be a string literal of at most MQTT_TOPIC_MAX_LENGTH characters */
+#define MQTT_TOPIC_TEMPLATE(topic) { \
+	{(uint8_t)((sizeof(topic)-1)>>8), \
+	(uint8_t)(sizeof(topic)-1+TEMPLATE_CHECK(sizeof(topic)-1 <= MQTT_TOPIC_MAX_LENGTH,"topic too long"))}, topic }
+
+/* Length of the CONNECT packet of a template: fixed header byte, remaining length byte and the remaining bytes */
+#define MQTT_CONNECT_TEMPLATE_LENGTH(connect) (2+(connect)->header[1])
+
+/* CONNECT message of MQTT-SN, built at compile time like the MQTT one */
+typedef struct {
+	uint8_t header[MQTTSN_CONNECT_HEADER_LENGTH];
+	char client_id[MQTT_CLIENT_ID_MAX_LENGTH];
+} mqttsn_connect_template_typedef;
+
+/* Initializer of a mqttsn_connect_template_typedef: clean session, duration MQTT_KEEP_ALIVE.
+ * client_id must be a string literal of at most MQTT_CLIENT_ID_MAX_LENGTH characters.
+ */
+#define MQTTSN_CONNECT_TEMPLATE(client_id) { \
+	{MQTTSN_CONNECT_HEADER_LENGTH+sizeof(client_id)-1+CLIENT_ID_CHECK(client_id), MQTTSN_CONNECT, MQTTSN_FLAG_CLEAN_SESSION, 0x01, \
+	(uint8_t)(MQTT_KEEP_ALIVE>>8), (uint8_t)MQTT_KEEP_ALIVE}, client_id }
+
+/* Length of the CONNECT message of a template, the first byte */
+#define MQTTSN_CONNECT_TEMPLATE_LENGTH(connect) ((connect)->header[0])
 
 /**
  * @brief enables the GPRS connection. 
@@ -58,6 +190,49 @@ uint8_t disable_gprs();
 
 
 
+/**
+ * @brief classifies the reply of the module to AT+CIPSTATUS.
+ * @param cmd_reply is the reply of the module, RX_BUFFER_LENGTH bytes.
+ * @return TCP_STATUS_GPRS_DOWN, TCP_STATUS_CONNECTED or TCP_STATUS_READY.
+ */
+uint8_t get_tcp_status(const char * cmd_reply);
+
+/**
+ * @brief parses the reply of the module to AT+CIPACK: "+CIPACK: <sent>,<acknowledged>,<unacknowledged>".
+ * @param cmd_reply is the reply of the module, RX_BUFFER_LENGTH bytes.
+ * @param acked receives the number of bytes acknowledged by the server since the connection was opened.
+ * @param unacked receives the number of bytes sent and not yet acknowledged.
+ * @return SUCCESS if the reply was parsed, FAIL otherwise (no connection, ERROR).
+ */
+uint8_t get_tcp_ack(const char * cmd_reply, uint32_t * acked, uint32_t * unacked);
+
+/**
+ * @brief parses the reply of the module to AT+CDNSGIP: "+CDNSGIP: 1,"<name>","<address>"[,"<address>"]".
+ * @param cmd_reply is the reply of the module, RX_BUFFER_LENGTH bytes.
+ * @param ip_address receives the first address, DNS_ADDRESS_LENGTH bytes.
+ * @return SUCCESS if an address was parsed, FAIL otherwise (+CDNSGIP: 0,<error>, ERROR).
+ */
+uint8_t get_dns_address(const char * cmd_reply, char * ip_address);
+
+/**
+ * @brief returns the cached link state, which is updated from command results and URCs.
+ * A CLOSED URC turns a connected link into TCP_STATUS_READY, a +PDP: DEACT URC turns any state into TCP_STATUS_GPRS_DOWN.
+ * @return TCP_STATUS_GPRS_DOWN, TCP_STATUS_CONNECTED, TCP_STATUS_READY, or TCP_STATUS_UNKNOWN if the cache was
+ * invalidated or not updated for LINK_STATE_MAX_AGE ms.
+ */
+uint8_t link_state_get(void);
+
+/**
+ * @brief updates the cached link state after a command whose result tells the state.
+ * @param tcp_status is TCP_STATUS_GPRS_DOWN, TCP_STATUS_CONNECTED or TCP_STATUS_READY.
+ */
+void link_state_set(uint8_t tcp_status);
+
+/**
+ * @brief marks the cached link state as unknown after an unexpected reply, the next user sends AT+CIPSTATUS.
+ */
+void link_state_invalidate(void);
+
 /**
  * @brief opens a new TCP connection. 
  * if the function is called when there is already an open TCP connection then it closes it and opens a new connection. 
@@ -73,7 +248,40 @@ uint8_t open_tcp_connection(char * ip_address, char * tcp_port);
  * @param data_length is the length of the byte array to be sent.
  * @return SUCCESS if the data was successfully sent, FAIL otherwise.
  */
-uint8_t send_tcp_data(uint8_t * data, uint8_t data_length);
+uint8_t send_tcp_data(uint8_t * data, uint16_t data_length);
+
+/**
+ * @brief empties a TX buffer.
+ * @param tx is the TX buffer.
+ */
+void tx_buffer_clear(tx_buffer_typedef * tx);
+
+/**
+ * @brief appends a packet to a TX buffer, the whole buffer is then sent with one AT+CIPSEND.
+ * @param tx is the TX buffer.
+ * @param packet is the packet to append.
+ * @param packet_length is the length of the packet in bytes.
+ * @return SUCCESS if the packet was appended, FAIL if it does not fit: the buffer must be sent first.
+ */
+uint8_t tx_buffer_append(tx_buffer_typedef * tx, const uint8_t * packet, uint16_t packet_length);
+
+/**
+ * @brief appends the CONNECT packet of a template to a TX buffer, see MQTT_CONNECT_TEMPLATE().
+ * @return SUCCESS if the packet was appended, FAIL if it does not fit.
+ */
+uint8_t tx_buffer_append_connect(tx_buffer_typedef * tx, const mqtt_connect_template_typedef * connect);
+
+/**
+ * @brief appends the MQTT-SN CONNECT message of a template to a TX buffer, see MQTTSN_CONNECT_TEMPLATE().
+ * @return SUCCESS if the message was appended, FAIL if it does not fit.
+ */
+uint8_t tx_buffer_append_mqttsn_connect(tx_buffer_typedef * tx, const mqttsn_connect_template_typedef * connect);
+
+/**
+ * @brief builds an MQTT PUBLISH packet at the end of a TX buffer, see build_mqtt_publish_packet().
+ * @return SUCCESS if the packet was appended, FAIL if it does not fit.
+ */
+uint8_t tx_buffer_append_publish(tx_buffer_typedef * tx, char * topic, uint16_t packet_id, const uint8_t * payload, uint16_t payload_length);
 
 /**
  * @brief closes an open TCP connection. 
@@ -83,13 +291,87 @@ uint8_t close_tcp_connection();
 
 
 /**
- * @brief publishes a message to an MQTT topic with QoS 1 by default.
+ * @brief computes the length of an MQTT packet from its remaining length: fixed header byte, remaining length
+ * encoded on 1 to 4 bytes of 7 bits, then the remaining bytes.
+ * @param remaining_length is the length of the variable header and the payload.
+ * @return the total length of the packet in bytes.
+ */
+uint32_t mqtt_packet_length(uint32_t remaining_length);
+
+/**
+ * @brief computes the length of the MQTT PUBLISH packet built by build_mqtt_publish_packet().
+ * @param topic is the MQTT topic name.
+ * @param packet_id is 0 for QoS 0, the packet identifier for QoS 1.
+ * @param payload_length is the length of the payload in bytes.
+ * @return the total length of the packet in bytes.
+ */
+uint32_t mqtt_publish_packet_length(const char * topic, uint16_t packet_id, uint16_t payload_length);
+
+/**
+ * @brief computes the length of the MQTT PUBLISH packet built by build_mqtt_publish_template().
+ * @param topic is the topic template.
+ * @param packet_id is 0 for QoS 0, the packet identifier for QoS 1.
+ * @param payload_length is the length of the payload in bytes.
+ * @return the total length of the packet in bytes.
+ */
+uint32_t mqtt_publish_template_length(const mqtt_topic_template_typedef * topic, uint16_t packet_id, uint16_t payload_length);
+
+/**
+ * @brief builds an MQTT CONNECT packet (protocol level 4, clean session, keep alive MQTT_KEEP_ALIVE).
+ * @param connect_packet is the buffer where the packet is written.
+ * @param size is the size of the buffer in bytes, nothing is written past it.
+ * @param client_id is the MQTT client ID.
+ * @return the total length of the packet in bytes, 0 if it does not fit size or MAX_LENGTH_MQTT_PACKET.
+ */
+uint16_t build_mqtt_connect_packet(uint8_t * connect_packet, uint16_t size, char * client_id);
+
+/**
+ * @brief builds an MQTT PUBLISH packet. The remaining length is variable-length encoded.
+ * @param publish_packet is the buffer where the packet is written.
+ * @param size is the size of the buffer in bytes, nothing is written past it.
+ * @param topic is the MQTT topic name.
+ * @param packet_id is 0 for a QoS 0 packet, otherwise the packet identifier of a QoS 1 packet, see mqtt.h.
+ * @param payload is the message to be sent, text or binary.
+ * @param payload_length is the length of the payload in bytes.
+ * @return the total length of the packet in bytes, 0 if it does not fit size or MAX_LENGTH_MQTT_PACKET.
+ */
+uint16_t build_mqtt_publish_packet(uint8_t * publish_packet, uint16_t size, char * topic, uint16_t packet_id, const uint8_t * payload, uint16_t payload_length);
+
+/**
+ * @brief builds an MQTT PUBLISH packet from a topic template, see MQTT_TOPIC_TEMPLATE(). Same packet as
+ * build_mqtt_publish_packet(), but the topic is copied with its length as it is: only the fixed header, the packet
+ * identifier and the payload are written.
+ * @param publish_packet is the buffer where the packet is written.
+ * @param size is the size of the buffer in bytes, nothing is written past it.
+ * @param topic is the topic template.
+ * @param packet_id is 0 for a QoS 0 packet, otherwise the packet identifier of a QoS 1 packet, see mqtt.h.
+ * @param payload is the message to be sent, text or binary.
+ * @param payload_length is the length of the payload in bytes.
+ * @return the total length of the packet in bytes, 0 if it does not fit size or MAX_LENGTH_MQTT_PACKET.
+ */
+uint16_t build_mqtt_publish_template(uint8_t * publish_packet, uint16_t size, const mqtt_topic_template_typedef * topic, uint16_t packet_id, const uint8_t * payload, uint16_t payload_length);
+
+/**
+ * @brief builds an MQTT-SN PUBLISH message to a predefined topic, with the QoS MQTTSN_QOS.
+ * @param publish_packet is the buffer where the message is written.
+ * @param size is the size of the buffer in bytes, nothing is written past it.
+ * @param topic_id is the predefined topic identifier.
+ * @param msg_id is the message identifier of a QoS 1 message, see mqtt.h, written as 0 for QoS 0 and -1.
+ * @param payload is the message to be sent, text or binary.
+ * @param payload_length is the length of the payload in bytes.
+ * @return the total length of the message in bytes, 0 if it does not fit size or MQTTSN_MAX_LENGTH.
+ */
+uint16_t build_mqttsn_publish_packet(uint8_t * publish_packet, uint16_t size, uint16_t topic_id, uint16_t msg_id, const uint8_t * payload, uint16_t payload_length);
+
+
+/**
+ * @brief publishes a message to an MQTT topic with QoS 0, blocking. The uplink task publishes with QoS 1, see mqtt.h.
  * @param ip_address is the MQTT server IP address or DNS hostname.
  * @param tcp_port is the MQTT server port 
  * @param client_id is the MQTT client ID.
  * @param topic is the MQTT topic name.
  * @param message is the message to be sent.
- * @return SUCCESS if the message is successfully delivered, 0 otherwise.
+ * @return SUCCESS if the module sent the message, 0 otherwise. Delivery to the server is not confirmed with QoS 0.
  */
 uint8_t publish_mqtt_msg(char * ip_address, char * tcp_port, char * topic, char * client_id, char * message);
 
@@ -0,0 +1,89 @@
+/**
+*	@file position.h
+*	@brief GPS fix and its packed binary encoding, the payload of the PUBLISH packets.
+*
+*	A batch payload starts with the format version, POSITION_FORMAT_VERSION, followed by the fixes in the order they
+*	were taken. The first fix is a fixed POSITION_RECORD_LENGTH bytes record, little-endian:
+*
+*	| bytes | field      | unit                                   |
+*	|-------|------------|----------------------------------------|
+*	| 4     | time       | s since 2000-01-01 00:00:00 UTC, 0 if not known |
+*	| 4     | latitude   | 1e-7 degree, signed                    |
+*	| 4     | longitude  | 1e-7 degree, signed                    |
+*	| 2     | altitude   | m, signed                              |
+*	| 2     | speed      | cm/s                                   |
+*	| 2     | course     | 0.01 degree                            |
+*	| 1     | satellites |                                        |
+*	| 1     | flags      | POSITION_FLAG_xxx                      |
+*
+*	Every next fix is the difference with the previous one, field by field in the same order, each difference
+*	zigzag-encoded (0, -1, 1, -2, ... give 0, 1, 2, 3, ...) then written as a varint: 7 bits per byte, least
+*	significant first, bit 7 set when another byte follows. Consecutive fixes are close, so most differences take one
+*	or two bytes. The decoder of the server, Server/position_record.py, follows the same layout.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef POSITION_H
+#define POSITION_H
+
+#include <stdint.h>
+
+#define POSITION_FORMAT_VERSION 1
+#define POSITION_RECORD_LENGTH 20    /* first fix of a batch */
+#define POSITION_DELTA_MAX_LENGTH 28 /* next fixes, worst case: 3 varints of 5 bytes, 3 of 3 bytes and 2 of 2 bytes */
+#define POSITION_BATCH_LENGTH 177    /* bytes of a batch payload, with the PUBLISH header it fits MQTT_INFLIGHT_PACKET_LENGTH */
+
+/* Flags of a fix */
+#define POSITION_FLAG_3D 0x01      /* 3D fix, the altitude is valid */
+#define POSITION_FLAG_REGAINED 0x02 /* first fix after the GPS lost its fix */
+#define POSITION_FLAG_STORED 0x04  /* the fix went through the store-and-forward log, see flash_log.h */
+
+typedef struct {
+	uint32_t time;       /* s since 2000-01-01 00:00:00 UTC, 0 if not known */
+	int32_t latitude;    /* 1e-7 degree, north positive */
+	int32_t longitude;   /* 1e-7 degree, east positive */
+	int16_t altitude;    /* m */
+	uint16_t speed;      /* cm/s */
+	uint16_t course;     /* 0.01 degree */
+	uint8_t satellites;
+	uint8_t flags;       /* POSITION_FLAG_xxx */
+} position_typedef;
+
+/* Batch payload being encoded */
+typedef struct {
+	uint8_t data[POSITION_BATCH_LENGTH];
+	uint16_t length;
+	uint8_t count;
+	position_typedef previous; /* last fix added, the next one is encoded as its difference */
+} position_batch_typedef;
+
+/**
+ * @brief empties the batch and writes the format version.
+ * @param batch is the batch.
+ */
+void position_batch_clear(position_batch_typedef * batch);
+
+/**
+ * @brief encodes a fix at the end of the batch.
+ * @param batch is the batch.
+ * @param position is the fix.
+ * @return SUCCESS if the fix was added, FAIL if it does not fit: the batch is unchanged.
+ */
+uint8_t position_batch_add(position_batch_typedef * batch, const position_typedef * position);
+
+/**
+ * @brief decodes the next fix of a batch payload, the reverse of position_batch_add().
+ * @param data is the payload, starting with the format version.
+ * @param length is the length of the payload in bytes.
+ * @param offset is the position of the next fix in data, 1 for the first one. It is moved past the fix.
+ * @param position is the previous fix, replaced by the decoded one. Not read for the first fix.
+ * @return SUCCESS if a fix was decoded, FAIL at the end of the payload or if it is malformed.
+ */
+uint8_t position_batch_next(const uint8_t * data, uint16_t length, uint16_t * offset, position_typedef * position);
+
+/**
+ * @return the seconds from 2000-01-01 00:00:00 UTC to the given UTC date, 0 if the date is before 2000.
+ */
+uint32_t position_utc_seconds(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second);
+
+#endif
@@ -0,0 +1,58 @@
+/**
+*	@file power.h
+*	@brief Idle manager: STOP mode between scheduled tasks, woken up by the RTC alarm or by USART1 activity.
+*
+*	The board has no 32.768 kHz crystal (PC14 is the STATUS pin of the SIM808), so the RTC runs from the LSI.
+*	The LSI frequency varies a lot between parts, it is measured against the HSE at init and the measured value is
+*	used to convert RTC ticks to ms. SysTick does not run in STOP mode: the time spent in STOP is read from the RTC
+*	and added to the HAL tick on wake-up, so HAL_GetTick() and all the task timers stay correct.
+*
+*	The average current is estimated from the time spent in run, sleep and STOP modes and the typical supply currents
+*	below. They only cover the MCU, the SIM808 has its own supply.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdint.h>
+
+#define STOP_MIN_SLEEP_MS 20 /* below this, the core only sleeps (WFI): entering STOP and restarting the HSE costs a few ms, so the 10 ms AT polls of the tasks stay in sleep mode */
+#define POWER_REPORT_PERIOD 60000 /* ms between two power reports */
+
+/* Typical MCU supply currents in uA at 3.3 V, 8 MHz HSE, used for the average current estimate */
+#define IDD_RUN_UA 4000
+#define IDD_SLEEP_UA 1500
+#define IDD_STOP_UA 10
+
+/* RTC prescalers: LSI (~40 kHz) / (9+1) / (3999+1) = ~1 Hz, sub-second resolution = 1/4000 s */
+#define RTC_PREDIV_A 9
+#define RTC_PREDIV_S 3999
+
+/**
+ * @brief starts the LSI and the RTC, measures the LSI frequency, and configures the RTC alarm and USART1 as
+ * wake-up sources from STOP mode. USART1 must be initialized before calling this function.
+ * @return SUCCESS if STOP mode can be used, FAIL otherwise (power_idle() then only uses sleep mode).
+ */
+uint8_t power_init(void);
+
+/**
+ * @brief puts the MCU in the lowest power mode allowed for sleep_ms: STOP mode woken up by the RTC alarm after sleep_ms
+ * (or earlier by USART1 activity), or sleep mode until the next interrupt for short delays.
+ * The system clock is restored with clock_restore() after STOP.
+ * @param sleep_ms is the time until the next scheduled task.
+ */
+void power_idle(uint32_t sleep_ms);
+
+/**
+ * @brief prints the time spent in each mode, the wake-up latency and the estimated average current
+ * since the last report through the debug UART, then starts a new measurement window.
+ */
+void power_report(void);
+
+/**
+ * @brief clears the RTC alarm flag and its EXTI line. Is called from RTC_IRQHandler().
+ */
+void power_rtc_alarm_callback(void);
+
+#endif
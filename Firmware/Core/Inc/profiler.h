@@ -0,0 +1,83 @@
+/**
+*	@file profiler.h
+*	@brief On-target profiler: named zones timed with a free running 1 MHz timer.
+*
+*	The Cortex-M0 has no DWT cycle counter, so TIM2 (32 bits) is used as a free running microsecond counter.
+*	Code is instrumented with PROFILE_BEGIN(zone) and PROFILE_END(zone). For every zone the profiler accumulates
+*	the number of calls, the total and the maximum time in microseconds.
+*	Sending the character PROFILER_DUMP_CMD on the debug UART prints the table of all zones.
+*
+*	When PROFILER_MODE is not defined, the macros expand to nothing and the profiler costs no time and no memory.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+
+/* Uncomment to enable the profiler */
+//#define PROFILER_MODE 1
+
+#define PROFILER_TIM TIM2
+#define PROFILER_TIM_CLK_ENABLE() __HAL_RCC_TIM2_CLK_ENABLE()
+#define PROFILER_DUMP_CMD 'p' /* character to send on the debug UART to request a dump */
+
+/**
+ * @brief list of the profiled zones. Add new zones before PROFILE_ZONE_COUNT and their name in profiler.c
+ */
+typedef enum {
+	PROFILE_ZONE_AES,
+	PROFILE_ZONE_GPS_PARSE,
+	PROFILE_ZONE_GPS_QUERY,
+	PROFILE_ZONE_AT_CMD,
+	PROFILE_ZONE_MQTT_PUBLISH,
+	PROFILE_ZONE_UART_ISR,
+	PROFILE_ZONE_COUNT
+} profile_zone_typedef;
+
+
+/**
+ * @brief starts the profiler timer at 1 MHz and enables the dump command on the debug UART.
+ * Must be called after the debug UART is initialized and again after every change of the system clock.
+ */
+void profiler_init(void);
+
+/**
+ * @brief marks the start of a zone.
+ * @param zone is the zone being entered.
+ */
+void profiler_begin(profile_zone_typedef zone);
+
+/**
+ * @brief marks the end of a zone and accumulates the time spent since profiler_begin().
+ * @param zone is the zone being exited.
+ */
+void profiler_end(profile_zone_typedef zone);
+
+/**
+ * @brief prints calls, total, average and maximum time of every zone through the debug UART.
+ */
+void profiler_dump(void);
+
+/**
+ * @brief is called by HAL_UART_RxCpltCallback() when a byte is received on the debug UART.
+ * Requests a dump when the byte is PROFILER_DUMP_CMD and enables the receive interrupt again.
+ */
+void profiler_debug_rx_callback(void);
+
+/**
+ * @brief prints the zones table if a dump was requested through the debug UART. To be called from the main loop.
+ */
+void profiler_poll(void);
+
+
+#ifdef PROFILER_MODE
+#define PROFILE_BEGIN(zone) profiler_begin(zone)
+#define PROFILE_END(zone) profiler_end(zone)
+#else
+#define PROFILE_BEGIN(zone)
+#define PROFILE_END(zone)
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+/**
+*	@file recovery.h
+*	@brief Recovery ladder for transmit failures, backed by the independent watchdog.
+*
+*	A failed publish is classified by the uplink task (broken socket, network down, module not answering).
+*	The recovery step is the cheapest one that can fix that class of failure, and it climbs with the number of
+*	consecutive failures: reopen the TCP socket, then AT+CIPSHUT and PDP re-activation, then a radio reset with
+*	AT+CFUN, then a power cycle of the module. The MCU is only reset when all of them failed.
+*	A successful publish brings the ladder back to the first step.
+*
+*	The independent watchdog resets the MCU when the scheduler stops running the health task, or when a blocking
+*	step hangs. The blocking AT functions refresh it after every command, which all have a bounded timeout. The power
+*	on and off sequences of the module, up to ~20 s in a power cycle, refresh it at every pulse and every wait: the
+*	longest time without a refresh is a pulse and its STATUS pin wait, 1.2 s + STATUS_PIN_TIMEOUT, far below the
+*	~21 s of the watchdog with the fastest LSI.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include "sim808.h"
+
+/* Failure classes */
+#define FAILURE_SOCKET 1  /* CONNECT FAIL, no CIPSEND prompt, no DATA ACCEPT or no TCP acknowledgement: the TCP connection is broken */
+#define FAILURE_NETWORK 2 /* AT+CIPSTART is refused: the PDP context is broken */
+#define FAILURE_MODULE 3  /* no reply to an AT command */
+
+/* Recovery steps, in increasing cost */
+#define RECOVERY_SOCKET 1       /* close the TCP connection, the next publish opens a new one */
+#define RECOVERY_PDP 2          /* AT+CIPSHUT then GPRS bring-up */
+#define RECOVERY_RADIO 3        /* AT+CFUN=0, AT+CFUN=1 then GPRS bring-up */
+#define RECOVERY_POWER_CYCLE 4  /* sim_power_off(), sim_init(), enable_gps() then GPRS bring-up */
+#define RECOVERY_SYSTEM_RESET 5 /* system_reset() */
+
+/* Consecutive failures from which each step is used, whatever the failure class */
+#define RECOVERY_PDP_FAILURES 3
+#define RECOVERY_RADIO_FAILURES 5
+#define RECOVERY_POWER_CYCLE_FAILURES 7
+#define RECOVERY_SYSTEM_RESET_FAILURES 11 /* same bound as the former "more than 10 failed publishes" */
+
+/* Watchdog: LSI (~40 kHz) / 256 / 4096 = ~26 s, ~21 s with the fastest LSI (50 kHz) */
+#define WATCHDOG_PRESCALER 6 /* IWDG_PR value for a division by 256 */
+#define WATCHDOG_RELOAD 4095
+
+/**
+ * @brief records a failed publish.
+ * @param failure is the class of the failure, FAILURE_xxx.
+ * @return the recovery step to run, RECOVERY_xxx.
+ */
+uint8_t recovery_report_failure(uint8_t failure);
+
+/**
+ * @brief records a successful publish: the next failure starts again from the first step.
+ */
+void recovery_report_success(void);
+
+/**
+ * @brief runs a recovery step. Blocks until the step is finished, up to tens of seconds for a power cycle.
+ * The caller must own the AT port. A failed step is escalated immediately, up to system_reset().
+ * The GPRS bring-up is restarted after the step and runs in the background, see gprs.h.
+ * @param sim is the definition of the sim808 hardware
+ * @param step is the step returned by recovery_report_failure().
+ * @return SUCCESS if the step was carried out, FAIL otherwise.
+ */
+uint8_t recovery_run(SIM808_typedef * sim, uint8_t step);
+
+/**
+ * @brief starts the independent watchdog and reports a previous watchdog reset on the debug UART.
+ * The watchdog cannot be stopped once started.
+ */
+void watchdog_start(void);
+
+/**
+ * @brief reloads the watchdog counter.
+ */
+void watchdog_refresh(void);
+
+#endif
@@ -0,0 +1,53 @@
+/**
+*	@file scheduler.h
+*	@brief Cooperative scheduler: tasks woken by timers and events, no RTOS and no heap.
+*
+*	A task is a function that does a short piece of work and returns the number of ms after which it wants to run
+*	again. A task also runs earlier when one of the events it waits for is posted (for example from an interrupt).
+*	Tasks never block: long operations such as AT command exchanges are written as state machines that return
+*	to the scheduler while they wait for the module.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+/* Events, one bit each */
+#define EVENT_AT_RX     (1UL<<0) /* a line or a prompt was received from the SIM808 module */
+#define EVENT_FIX_READY (1UL<<1) /* a new GPS position is available */
+#define EVENT_LOG_TX    (1UL<<2) /* a debug message was queued or the debug UART finished a transmission */
+#define EVENT_LINK_UP   (1UL<<3) /* GPRS is up */
+
+#define TASK_RUN_NOW 0 /* return value of a task that wants to run again at the next scheduler pass */
+
+/**
+ * @brief describes a task of the cooperative scheduler.
+ */
+typedef struct {
+	const char * name;
+	uint32_t (*run)(void); /* does a bounded amount of work and returns the delay in ms before the next run */
+	uint32_t events;       /* the task also runs when one of these events is posted */
+	uint32_t wake_at;      /* tick at which the task runs next, managed by the scheduler */
+	uint32_t max_run_ms;   /* longest run of the task so far, managed by the scheduler */
+} task_typedef;
+
+
+/**
+ * @brief runs the tasks forever. A task runs when its delay has elapsed or when one of its events is posted.
+ * When no task is due, idle is called with the time until the earliest task wake-up.
+ * @param tasks is the array of tasks, in priority order.
+ * @param task_count is the number of tasks.
+ * @param idle puts the MCU in a low power mode for at most sleep_ms, returning earlier when an interrupt posts an event.
+ * If NULL, the core sleeps until the next interrupt.
+ */
+void scheduler_run(task_typedef * tasks, uint8_t task_count, void (*idle)(uint32_t sleep_ms));
+
+/**
+ * @brief posts events. Can be called from interrupts.
+ * @param events is a mask of EVENT_xxx.
+ */
+void scheduler_post_event(uint32_t events);
+
+#endif
@@ -32,6 +32,22 @@
 #define DEBUG_UART huart1
 #define TCP_CONNECT_TIMEOUT 5 /* value in second */
 #define GPS_COORDINATES_LENGTH 23 
+#define AT_PROBE_PERIOD 100 /* ms to wait for the OK of an AT probe during boot */
+#define WARM_BOOT_PROBES 3 /* AT probes sent to a module that is already on before power cycling it */
+#define STATUS_PIN_TIMEOUT 2000 /* ms to wait for the STATUS pin after a pulse on the power pin */
+#define BOOT_READY_TIMEOUT 8000 /* ms from the end of the power on pulses until the module must answer AT */
+#define LOG_BUFFER_LENGTH 512 /* size of the debug log queue used by the scheduler tasks */
+#define TCP_RX_FIFO_LENGTH 64 /* TCP data received from the server and not yet read, see read_tcp_data() */
+
+/* Return value of poll_AT_reply() while the reply is not yet received */
+#define AT_PENDING 2
+
+/* Unsolicited result codes latched by the asynchronous AT functions, see check_AT_urc() */
+#define URC_CONNECT_OK 0x01
+#define URC_CONNECT_FAIL 0x02
+#define URC_CLOSED 0x04
+#define URC_PDP_DEACT 0x08
+#define URC_CONNECT 0x10 /* connection opened in transparent mode, the module is in data mode */
 
 
 
@@ -61,6 +77,7 @@ typedef struct {
  /**
  * @brief it initialises the SIM808_typedef struct members and powers on the module.
  * initializes the UARTs and the GPIOs used to power on, reset and check the status of the module.
+ * A module that is already on and answers AT is used without a power cycle.
  * Which UART peripheral is used for what is specified in the parameter SIM808_typedef members: AT_uart and debug_uart.
  * @param sim is the definition of the sim808 hardware
  * @return SUCCESS if module is ready for use, FAIL otherwise
@@ -97,7 +114,7 @@ uint8_t send_AT_cmd(const char * cmd, const char * expected_reply, uint8_t save_
  * @param cmd contains the command 
  * @param rx_wait waiting time before exit. To make sure the reply is received.
  */
-uint8_t send_serial_data(uint8_t * data, uint8_t length, char * cmd_reply, uint32_t rx_wait);
+uint8_t send_serial_data(uint8_t * data, uint16_t length, char * cmd_reply, uint32_t rx_wait);
 
  /**
  * @brief sends a debug message through the debug UART
@@ -106,6 +123,109 @@ uint8_t send_serial_data(uint8_t * data, uint8_t length, char * cmd_reply, uint3
 void send_debug(const char * debug_msg);
 
 
-void  send_raw_debug(uint8_t * debug_dump,uint8_t length);
+void  send_raw_debug(uint8_t * debug_dump,uint16_t length);
+
+ /**
+ * @brief from now on, send_debug() queues the messages instead of waiting for the debug UART.
+ * The queue is sent in the background by debug_log_flush(). Messages that do not fit in the queue are dropped.
+ */
+void debug_log_start_async(void);
+
+ /**
+ * @brief starts sending the queued debug messages with an interrupt driven transfer. Returns immediately.
+ * @return TRUE if data is being sent, FALSE if the queue is empty.
+ */
+uint8_t debug_log_flush(void);
+
+ /**
+ * @return TRUE while queued debug messages are waiting or being sent, the debug UART must then keep its clock.
+ */
+uint8_t debug_log_busy(void);
+
+ /**
+ * @return the number of debug messages dropped because the log queue was full.
+ */
+uint32_t debug_log_dropped(void);
+
+ /**
+ * @brief sends an AT command without waiting for the reply. The reply is then checked with poll_AT_reply().
+ * @param cmd is the AT command to be sent
+ */
+void send_AT_cmd_async(const char * cmd);
+
+ /**
+ * @brief sends raw serial data without waiting for the reply. The reply is then checked with poll_AT_reply().
+ * @param data is the byte array to be sent
+ * @param length is the length of the byte array
+ */
+void send_serial_data_async(uint8_t * data, uint16_t length);
+
+/**
+ * @brief checks if the reply to the last asynchronous command or data has been received. Never waits.
+ * When the function returns SUCCESS or FAIL, the receive buffer is cleared as in send_AT_cmd().
+ * @param expected_reply is used to determine if the outcome is SUCCESS or FAIL.
+ * @param save_reply if set to 1, then the reply from the module gets copied into cmd_reply.
+ * @param cmd_reply is an array of RX_BUFFER_LENGTH bytes where the module reply is copied.
+ * @param rx_timeout is the time in ms, counted from the sending of the command, after which the command fails.
+ * @returns AT_PENDING while waiting, SUCCESS if the expected reply is received, FAIL on timeout.
+ */
+uint8_t poll_AT_reply(const char * expected_reply, uint8_t save_reply, char * cmd_reply, uint32_t rx_timeout);
+
+/**
+ * @brief checks if the > prompt of AT+CIPSEND has been received, like poll_AT_reply(">",0,NULL,rx_timeout).
+ * Only a '>' that starts a line and is not in the data of a +IPD block is taken for the prompt.
+ * @param rx_timeout is the time in ms, counted from the sending of the command, after which the command fails.
+ * @returns AT_PENDING while waiting, SUCCESS if the prompt is received, FAIL on timeout.
+ */
+uint8_t poll_AT_prompt(uint32_t rx_timeout);
+
+/**
+ * @brief checks if unsolicited result codes were received since the last call, even while another command was running.
+ * The URCs are latched by send_AT_cmd_async() and poll_AT_reply() before they clear the receive buffer.
+ * @param urc is a mask of URC_xxx.
+ * @return the URCs of the mask that were received. They are cleared and reported only once.
+ */
+uint8_t check_AT_urc(uint8_t urc);
+
+/**
+ * @brief takes the URCs and the TCP data out of the receive buffer and clears it, like the end of a command.
+ * Only called while no command is pending, so that data received between commands is not left in the buffer.
+ */
+void flush_AT_rx(void);
+
+/**
+ * @brief reads TCP data received from the server. The module must prefix it with "+IPD,<length>:" (AT+CIPHEAD=1),
+ * it is taken out of the receive buffer when the buffer is cleared at the end of a command or by flush_AT_rx().
+ * @param data is where the bytes are copied.
+ * @param size is the most bytes to copy.
+ * @return the number of bytes copied, 0 if nothing was received.
+ */
+uint16_t read_tcp_data(uint8_t * data, uint16_t size);
+
+/**
+ * @brief gives the oldest received TCP bytes in place, without copying them. The bytes are only taken by
+ * release_tcp_data(), a second call gives the bytes that follow when the FIFO wraps around.
+ * @param data receives the address of the first byte.
+ * @return the number of contiguous bytes at data, 0 if nothing was received.
+ */
+uint16_t peek_tcp_data(const uint8_t ** data);
+
+/**
+ * @brief takes bytes given by peek_tcp_data() out of the FIFO.
+ * @param length is the number of bytes processed.
+ */
+void release_tcp_data(uint16_t length);
+
+/**
+ * @return the number of received TCP bytes dropped because they were not read in time.
+ */
+uint32_t tcp_data_dropped(void);
+
+/**
+ * @brief selects how the received bytes are read in transparent mode (AT+CIPMODE=1). In data mode every byte received
+ * is TCP data for read_tcp_data(), in command mode only the "+IPD" blocks are.
+ * @param data_mode is TRUE once the module replied CONNECT, FALSE before the +++ escape sequence is sent.
+ */
+void set_AT_data_mode(uint8_t data_mode);
 uint8_t is_subarray_present(const uint8_t *array, size_t array_len, const uint8_t *subarray, size_t subarray_len);
 #endif
@@ -0,0 +1,40 @@
+/**
+*	@file tasks.h
+*	@brief Application tasks run by the cooperative scheduler: GPS polling, network uplink, logging and health monitoring.
+*
+*	@author Mohamed Boubaker
+*/
+#ifndef TASKS_H
+#define TASKS_H
+
+#include "sim808.h"
+#include "endpoint.h"
+
+#define GPS_SAMPLE_PERIOD 2000 /* ms between two GPS queries, replaces the HAL_Delay(2000) of the old main loop */
+#define HEALTH_PERIOD 1000 /* ms between two health checks */
+#define GPRS_UP_PERIOD 1000 /* ms between two runs of the GPRS task while GPRS is up */
+#define LOG_PERIOD 1000 /* ms between two runs of the log task without EVENT_LOG_TX, only polls the profiler dump command */
+#define MAX_TASK_RUN_MS 20 /* a task run longer than this is reported by the health task */
+#define FIX_QUEUE_LENGTH 12 /* fixes waiting to be published, the oldest goes to the flash log when the queue is full */
+#define BATCH_MAX_FIXES 8 /* fixes per PUBLISH, fewer when they do not fit POSITION_BATCH_LENGTH */
+#define BATCH_MAX_AGE 10000 /* ms, a batch is published when its oldest fix is this old */
+#define FLASH_ERASE_MAX_WAIT GPS_SAMPLE_PERIOD /* ms the GPS task waits for a quiet module to erase a flash log page */
+
+#define UPLINK_REPORT_PERIOD 60000 /* ms between two reports of the uplink counters by the health task */
+
+#define MQTT_TOPIC "P"
+#define MQTT_CLIENT_ID "B1"
+#define MQTT_PING_MARGIN 3000 /* ms, a PINGREQ is sent this long before MQTT_KEEP_ALIVE expires */
+#define MQTT_PING_PERIOD (MQTT_KEEP_ALIVE*1000UL-MQTT_PING_MARGIN) /* ms without packet sent after which a PINGREQ is sent */
+#define MQTT_MAX_PINGS 2 /* PINGREQ packets without PINGRESP after which the session is considered lost */
+
+/**
+ * @brief starts the scheduler with the application tasks. Never returns.
+ * The module must be initialized and GPS enabled before calling this function. GPRS is brought up by the GPRS task.
+ * @param sim is the definition of the sim808 hardware
+ * @param endpoints is the list of MQTT servers, IP address or DNS hostname and port, in order of preference.
+ * @param endpoint_count is the number of servers, at most ENDPOINT_MAX.
+ */
+void tasks_run(SIM808_typedef * sim, const endpoint_typedef * endpoints, uint8_t endpoint_count);
+
+#endif
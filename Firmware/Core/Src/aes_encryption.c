@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "aes_encryption.h"
+#include "profiler.h"
 
 
 uint8_t s(uint8_t c){
@@ -170,6 +171,8 @@ void aes128_encrypt(uint8_t txt[16], uint8_t key[16]){
 
 	uint8_t i,j;
 
+	PROFILE_BEGIN(PROFILE_ZONE_AES);
+
 	/*XOR plain text with the key*/
 	for(i=0;i<16;i++)
 		txt[i]=txt[i]^key[i];
@@ -185,5 +188,7 @@ void aes128_encrypt(uint8_t txt[16], uint8_t key[16]){
 				txt[i]=txt[i]^key[i];
 
 	}
+
+	PROFILE_END(PROFILE_ZONE_AES);
 }
 
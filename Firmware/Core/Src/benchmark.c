@@ -0,0 +1,163 @@
+/**
+*	@file benchmark.c
+*	@brief Micro benchmarks of the firmware hot paths.
+*
+*	Every benchmark calls the measured function a fixed number of times and the elapsed time is read from the
+*	HAL tick (1 ms resolution). The iteration counts are chosen so that every benchmark runs for at least a few
+*	hundred ms on the 8 MHz HSE clock, which keeps the tick quantization error below 1%.
+*	The suite runs once at every clock setting of the clock manager, the iteration counts scale with the clock.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+#include <stdio.h>
+
+#include "sim808.h"
+#include "gps.h"
+#include "network_functions.h"
+#include "aes_encryption.h"
+#include "clock.h"
+#include "benchmark.h"
+
+extern UART_HandleTypeDef huart2;
+
+/* FIPS-197 Appendix B test vector */
+static const uint8_t bench_key[16]={0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c};
+static const uint8_t bench_txt[16]={0x32,0x43,0xf6,0xa8,0x88,0x5a,0x30,0x8d,0x31,0x31,0x98,0xa2,0xe0,0x37,0x07,0x34};
+
+/* Typical content of the receive buffer after AT+CGPSINF=0 */
+static const char bench_gps_reply[RX_BUFFER_LENGTH]="AT+CGPSINF=0\r\r\n+CGPSINF: 0,4927.656000,1106.059700,319.200000,20220816200132.000,0,12,1.592720,351\r\n\r\nOK\r\n";
+
+static uint8_t bench_block[16];
+static uint8_t bench_round_key[16];
+static uint8_t bench_packet[64]; /* the CONNECT and PUBLISH packets of the benchmarks */
+static position_typedef bench_position;
+static position_batch_typedef bench_batch;
+static uint8_t bench_rx_buffer[RX_BUFFER_LENGTH];
+static volatile uint8_t bench_sink;
+
+typedef struct {
+	const char * name;
+	uint32_t iterations;
+	uint32_t bytes_per_op;
+	void (*run)(void);
+} benchmark_typedef;
+
+
+/* Worst case for the search: "SEND OK" is at the very end of a full receive buffer, as in send_serial_data() */
+static void bench_is_subarray_present(void){
+	static const uint8_t send_ok[]={0x53,0x45,0x4E,0x44,0x20,0x4F,0x4B};
+	bench_sink=is_subarray_present(bench_rx_buffer,RX_BUFFER_LENGTH,send_ok,sizeof(send_ok));
+}
+
+static void bench_aes128_encrypt(void){
+	/* aes128_encrypt expands the key in place, so the key is restored before every call */
+	memcpy(bench_round_key,bench_key,16);
+	aes128_encrypt(bench_block,bench_round_key);
+}
+
+static void bench_mix_columns(void){
+	mix_columns(bench_block);
+}
+
+static void bench_expand_key(void){
+	expand_key(bench_round_key,0);
+}
+
+static void bench_mqtt_connect(void){
+	bench_sink=build_mqtt_connect_packet(bench_packet,sizeof(bench_packet),"B1");
+}
+
+static void bench_mqtt_publish(void){
+	bench_sink=build_mqtt_publish_packet(bench_packet,sizeof(bench_packet),"P",0,(const uint8_t*)"4927.656000,1106.059700",GPS_COORDINATES_LENGTH);
+}
+
+static void bench_mqtt_publish_template(void){
+	static const mqtt_topic_template_typedef topic=MQTT_TOPIC_TEMPLATE("P");
+	bench_sink=build_mqtt_publish_template(bench_packet,sizeof(bench_packet),&topic,0,(const uint8_t*)"4927.656000,1106.059700",GPS_COORDINATES_LENGTH);
+}
+
+static void bench_parse_gps_location(void){
+	bench_sink=parse_gps_location(bench_gps_reply,&bench_position);
+}
+
+/* A full batch of a moving tracker: every fix is encoded as a difference with the previous one */
+static void bench_position_batch(void){
+	position_typedef position=bench_position;
+
+	position_batch_clear(&bench_batch);
+	for(uint8_t i=0; i<8; i++){
+		position_batch_add(&bench_batch,&position);
+		position.time+=2;
+		position.latitude+=3217;
+		position.longitude-=1450;
+		position.speed+=11;
+	}
+}
+
+
+static const benchmark_typedef benchmarks[]={
+	{"is_subarray_present", 2000, RX_BUFFER_LENGTH,       bench_is_subarray_present},
+	{"aes128_encrypt",      1000, 16,                     bench_aes128_encrypt},
+	{"mix_columns",         10000, 16,                    bench_mix_columns},
+	{"expand_key",          20000, 16,                    bench_expand_key},
+	{"mqtt_connect_packet", 20000, 16,                    bench_mqtt_connect},
+	{"mqtt_publish_packet", 10000, 28,                    bench_mqtt_publish},
+	{"mqtt_publish_template", 10000, 28,                  bench_mqtt_publish_template},
+	{"parse_gps_location",  10000, 106,                   bench_parse_gps_location},
+	{"position_batch",      5000, 8*sizeof(position_typedef), bench_position_batch},
+};
+
+
+static void bench_print(const char * text){
+	HAL_UART_Transmit(&huart2,(uint8_t*)text,strlen(text),TX_TIMEOUT);
+}
+
+
+void run_benchmarks(void){
+	static const clock_mode_typedef modes[]={CLOCK_MODE_LOW,CLOCK_MODE_HSE,CLOCK_MODE_BURST};
+	char line[160];
+	uint32_t start,elapsed_ms,ns_per_op,iterations;
+	clock_mode_typedef initial_mode=clock_get();
+	uint8_t bench_count=sizeof(benchmarks)/sizeof(benchmarks[0]);
+
+	/* Fill the receive buffer with printable bytes that never match, then put SEND OK at the end */
+	memset(bench_rx_buffer,'A',RX_BUFFER_LENGTH);
+	memcpy(bench_rx_buffer+RX_BUFFER_LENGTH-7,"SEND OK",7);
+	memcpy(bench_block,bench_txt,16);
+	memcpy(bench_round_key,bench_key,16);
+
+	bench_print("[\r\n");
+	for(uint8_t m=0; m<sizeof(modes)/sizeof(modes[0]); m++){
+		if (clock_set(modes[m])==FAIL)
+			continue;
+
+		for(uint8_t b=0; b<bench_count; b++){
+
+			/* Scale the iterations with the clock to keep the same measurement time as at 8 MHz */
+			iterations=(uint32_t)(((uint64_t)benchmarks[b].iterations*SystemCoreClock)/8000000);
+
+			/* Align the start of the measurement with a tick edge */
+			start=HAL_GetTick();
+			while(HAL_GetTick()==start);
+			start=HAL_GetTick();
+
+			for(uint32_t i=0; i<iterations; i++)
+				benchmarks[b].run();
+
+			elapsed_ms=HAL_GetTick()-start;
+			ns_per_op=(uint32_t)(((uint64_t)elapsed_ms*1000000)/iterations);
+
+			sprintf(line,"{\"name\":\"%s\",\"clock_hz\":%lu,\"iterations\":%lu,\"ns_per_op\":%lu,\"bytes_per_op\":%lu}%s\r\n",
+				benchmarks[b].name,
+				(unsigned long)SystemCoreClock,
+				(unsigned long)iterations,
+				(unsigned long)ns_per_op,
+				(unsigned long)benchmarks[b].bytes_per_op,
+				(m==sizeof(modes)/sizeof(modes[0])-1 && b==bench_count-1)?"":",");
+			bench_print(line);
+		}
+	}
+	bench_print("]\r\n");
+	clock_set(initial_mode);
+}
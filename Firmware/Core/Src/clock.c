@@ -0,0 +1,129 @@
+/**
+*	@file clock.c
+*	@brief Clock manager implementation.
+*
+*	@author Mohamed Boubaker
+*/
+#include "sim808.h"
+#include "profiler.h"
+#include "clock.h"
+
+extern UART_HandleTypeDef huart1;
+extern UART_HandleTypeDef huart2;
+
+/* Time to send the whole debug log queue, 10 bits per byte */
+#define UART_IDLE_TIMEOUT (LOG_BUFFER_LENGTH*10UL*1000/BAUD_RATE+1)
+
+static clock_mode_typedef clock_mode=CLOCK_MODE_HSE;
+static clock_mode_typedef mode_before_burst=CLOCK_MODE_HSE;
+static uint8_t burst_depth=0;
+
+
+static uint8_t uart_uses_pclk(UART_HandleTypeDef * huart){
+	if (huart->Instance==USART1)
+		return (RCC->CFGR3 & RCC_CFGR3_USART1SW)==RCC_USART1CLKSOURCE_PCLK1;
+	return TRUE;
+}
+
+/* A byte being sent while the clock changes would be corrupted */
+static void uart_wait_idle(UART_HandleTypeDef * huart){
+	uint32_t start=HAL_GetTick();
+
+	while ( (huart->gState!=HAL_UART_STATE_READY || !__HAL_UART_GET_FLAG(huart,UART_FLAG_TC)) && HAL_GetTick()-start < UART_IDLE_TIMEOUT );
+}
+
+/* BRR can only be written while the UART is disabled, UART_SetConfig() computes it from the current clock */
+static void uart_rederive_baud_rate(UART_HandleTypeDef * huart){
+	__HAL_UART_DISABLE(huart);
+	UART_SetConfig(huart);
+	__HAL_UART_ENABLE(huart);
+}
+
+
+uint8_t clock_set(clock_mode_typedef mode){
+	RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+	RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+	uint32_t flash_latency=FLASH_LATENCY_0;
+
+	if (mode==clock_mode)
+		return SUCCESS;
+
+	if (uart_uses_pclk(&huart1))
+		uart_wait_idle(&huart1);
+	if (uart_uses_pclk(&huart2))
+		uart_wait_idle(&huart2);
+
+	RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK|RCC_CLOCKTYPE_SYSCLK|RCC_CLOCKTYPE_PCLK1;
+	RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_HSE;
+	RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
+	RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV1;
+
+	if (mode==CLOCK_MODE_BURST){
+		/* 8 MHz x 6 = 48 MHz, the maximum of the STM32F051 */
+		RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+		RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
+		RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
+		RCC_OscInitStruct.PLL.PLLMUL = RCC_PLL_MUL6;
+		RCC_OscInitStruct.PLL.PREDIV = RCC_PREDIV_DIV1;
+		if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+			return FAIL;
+		RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
+		flash_latency=FLASH_LATENCY_1;
+	}
+	else if (mode==CLOCK_MODE_LOW)
+		RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV2;
+
+	/* Also updates SystemCoreClock, the flash latency and SysTick */
+	if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, flash_latency) != HAL_OK)
+		return FAIL;
+
+	/* The PLL only runs during bursts */
+	if (mode!=CLOCK_MODE_BURST && (RCC->CR & RCC_CR_PLLON)){
+		RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+		RCC_OscInitStruct.PLL.PLLState = RCC_PLL_OFF;
+		HAL_RCC_OscConfig(&RCC_OscInitStruct);
+	}
+
+	if (uart_uses_pclk(&huart1))
+		uart_rederive_baud_rate(&huart1);
+	if (uart_uses_pclk(&huart2))
+		uart_rederive_baud_rate(&huart2);
+
+	#ifdef PROFILER_MODE
+	profiler_init();
+	#endif
+
+	clock_mode=mode;
+	return SUCCESS;
+}
+
+
+clock_mode_typedef clock_get(void){
+	return clock_mode;
+}
+
+
+void clock_burst_begin(void){
+	if (burst_depth++==0){
+		mode_before_burst=clock_mode;
+		clock_set(CLOCK_MODE_BURST);
+	}
+}
+
+
+void clock_burst_end(void){
+	if (burst_depth==0)
+		return;
+	if (--burst_depth==0)
+		clock_set(mode_before_burst);
+}
+
+
+void clock_restore(void){
+	clock_mode_typedef mode=clock_mode;
+
+	/* SystemClock_Config() starts the HSE again, which is CLOCK_MODE_HSE */
+	SystemClock_Config();
+	clock_mode=CLOCK_MODE_HSE;
+	clock_set(mode);
+}
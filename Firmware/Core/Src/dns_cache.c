@@ -0,0 +1,147 @@
+/**
+*	@file dns_cache.c
+*	@brief Cache of the address of the server implementation.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+
+#include "sim808.h"
+#include "dns_cache.h"
+
+#define DNS_CACHE_MAGIC 0x444E5331 /* "DNS1": the entry was saved by dns_cache_save() */
+
+typedef struct {
+	uint32_t magic;       /* DNS_CACHE_MAGIC from dns_cache_save() to the next boot, 0 otherwise */
+	uint32_t host_hash;   /* hash of the name the address belongs to */
+	uint32_t resolved_at; /* HAL_GetTick() time the TTL is counted from */
+	uint32_t ttl;         /* ms */
+	uint32_t check;       /* sum of the other fields, a saved entry is not trusted otherwise */
+	uint8_t valid;
+	char address[DNS_ADDRESS_LENGTH];
+} dns_entry_typedef;
+
+/* Not cleared by the startup code, its content is random after a power on */
+static dns_entry_typedef entries[DNS_CACHE_ENTRIES] __attribute__((section(".noinit")));
+
+
+/* FNV-1a */
+static uint32_t dns_hash(const char * host){
+	uint32_t hash=2166136261UL;
+
+	while (*host)
+		hash=(hash^(uint8_t)*host++)*16777619UL;
+	return hash;
+}
+
+static uint32_t dns_check(const dns_entry_typedef * entry){
+	const uint8_t * address=(const uint8_t *)entry->address;
+	uint32_t sum=entry->magic+entry->host_hash+entry->ttl+entry->valid;
+
+	for(uint8_t i=0; i<DNS_ADDRESS_LENGTH; i++)
+		sum=sum*31+address[i];
+	return sum;
+}
+
+static uint8_t dns_expired(const dns_entry_typedef * entry){
+	return HAL_GetTick()-entry->resolved_at >= entry->ttl;
+}
+
+/* The valid entry of the name, NULL if there is none */
+static dns_entry_typedef * dns_find(const char * host){
+	uint32_t hash=dns_hash(host);
+
+	for(uint8_t i=0; i<DNS_CACHE_ENTRIES; i++){
+		if (entries[i].valid && entries[i].host_hash==hash)
+			return &entries[i];
+	}
+	return NULL;
+}
+
+
+void dns_cache_init(void){
+	dns_entry_typedef * entry;
+	uint8_t saved;
+
+	for(uint8_t i=0; i<DNS_CACHE_ENTRIES; i++){
+		entry=&entries[i];
+		saved=entry->magic==DNS_CACHE_MAGIC && entry->check==dns_check(entry) && entry->valid==TRUE
+				&& memchr(entry->address,'\0',DNS_ADDRESS_LENGTH)!=NULL;
+		/* The TTL left is counted from the boot, the time of the reset itself is not counted */
+		entry->magic=0;
+		entry->valid=saved;
+		entry->resolved_at=HAL_GetTick();
+	}
+}
+
+
+uint8_t dns_is_address(const char * host){
+	uint8_t dots=0;
+
+	for(; *host; host++){
+		if (*host=='.')
+			dots++;
+		else if (*host<'0' || *host>'9')
+			return FALSE;
+	}
+	return dots==3;
+}
+
+
+const char * dns_cache_lookup(const char * host){
+	dns_entry_typedef * entry=dns_find(host);
+
+	if (entry==NULL)
+		return NULL;
+	if (dns_expired(entry)){
+		entry->valid=FALSE;
+		return NULL;
+	}
+	return entry->address;
+}
+
+
+void dns_cache_store(const char * host, const char * ip_address){
+	dns_entry_typedef * entry=dns_find(host);
+
+	/* A new name takes a free entry, or the one resolved first */
+	for(uint8_t i=0; i<DNS_CACHE_ENTRIES && entry==NULL; i++){
+		if (!entries[i].valid)
+			entry=&entries[i];
+	}
+	if (entry==NULL){
+		entry=&entries[0];
+		for(uint8_t i=1; i<DNS_CACHE_ENTRIES; i++){
+			if (HAL_GetTick()-entries[i].resolved_at > HAL_GetTick()-entry->resolved_at)
+				entry=&entries[i];
+		}
+	}
+	strncpy(entry->address,ip_address,DNS_ADDRESS_LENGTH-1);
+	entry->address[DNS_ADDRESS_LENGTH-1]='\0';
+	entry->host_hash=dns_hash(host);
+	entry->resolved_at=HAL_GetTick();
+	entry->ttl=DNS_CACHE_TTL;
+	entry->valid=TRUE;
+}
+
+
+void dns_cache_invalidate(const char * host){
+	dns_entry_typedef * entry=dns_find(host);
+
+	if (entry!=NULL)
+		entry->valid=FALSE;
+}
+
+
+void dns_cache_save(void){
+	dns_entry_typedef * entry;
+
+	for(uint8_t i=0; i<DNS_CACHE_ENTRIES; i++){
+		entry=&entries[i];
+		if (!entry->valid || dns_expired(entry))
+			continue;
+		entry->ttl-=HAL_GetTick()-entry->resolved_at;
+		entry->magic=DNS_CACHE_MAGIC;
+		entry->check=dns_check(entry);
+	}
+}
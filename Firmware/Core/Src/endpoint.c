@@ -0,0 +1,131 @@
+/**
+*	@file endpoint.c
+*	@brief Server list, failover and health scores implementation.
+*
+*	@author Mohamed Boubaker
+*/
+#include <stdio.h>
+
+#include "sim808.h"
+#include "endpoint.h"
+
+typedef struct {
+	uint16_t rate;    /* rolling success rate, 0 to ENDPOINT_RATE_ONE */
+	uint32_t latency; /* rolling connect latency in ms, 0 until a connection succeeded */
+	uint8_t last_ok;  /* the last connection succeeded */
+	uint32_t connects;
+	uint32_t failures;
+} endpoint_health_typedef;
+
+static const endpoint_typedef * endpoints;
+static endpoint_health_typedef health[ENDPOINT_MAX];
+static uint8_t endpoint_count=0;
+static uint8_t current=0;
+static uint8_t failed=0; /* mask of the servers that failed since the last successful connection */
+
+
+static int32_t endpoint_score(uint8_t index){
+	return (int32_t)health[index].rate-(int32_t)(health[index].latency*ENDPOINT_LATENCY_PENALTY/1000);
+}
+
+static void endpoint_update_rate(uint8_t success){
+	int32_t target=success?ENDPOINT_RATE_ONE:0;
+
+	health[current].rate+=(target-(int32_t)health[current].rate)/ENDPOINT_RATE_WEIGHT;
+}
+
+
+void endpoint_init(const endpoint_typedef * list, uint8_t count){
+	endpoints=list;
+	endpoint_count=(count > ENDPOINT_MAX)?ENDPOINT_MAX:count;
+	for(uint8_t i=0; i<endpoint_count; i++){
+		health[i].rate=ENDPOINT_RATE_ONE;
+		health[i].latency=0;
+		health[i].last_ok=TRUE;
+		health[i].connects=0;
+		health[i].failures=0;
+	}
+	current=0;
+	failed=0;
+}
+
+
+const endpoint_typedef * endpoint_select(void){
+	uint8_t best=current;
+	uint8_t found=FALSE;
+
+	/* Sticky: the session stays on a healthy server */
+	if (health[current].last_ok && health[current].rate >= ENDPOINT_HEALTHY_RATE && !(failed & (1<<current)))
+		return &endpoints[current];
+	/* Ties go to the first server of the list */
+	for(uint8_t i=0; i<endpoint_count; i++){
+		if (failed & (1<<i))
+			continue;
+		if (!found || endpoint_score(i) > endpoint_score(best)){
+			best=i;
+			found=TRUE;
+		}
+	}
+	if (!found){
+		for(uint8_t i=0; i<endpoint_count; i++){
+			if (endpoint_score(i) > endpoint_score(best))
+				best=i;
+		}
+	}
+	#ifdef DEBUG_MODE
+	if (best!=current){
+		char debug_msg[64];
+		snprintf(debug_msg,sizeof(debug_msg),"Endpoint: switch to %s:%s",endpoints[best].host,endpoints[best].port);
+		send_debug(debug_msg);
+	}
+	#endif
+	current=best;
+	return &endpoints[current];
+}
+
+
+const endpoint_typedef * endpoint_current(void){
+	return &endpoints[current];
+}
+
+
+void endpoint_report_success(uint32_t latency){
+	endpoint_update_rate(TRUE);
+	if (health[current].connects==0)
+		health[current].latency=latency;
+	else
+		health[current].latency+=((int32_t)latency-(int32_t)health[current].latency)/ENDPOINT_LATENCY_WEIGHT;
+	health[current].last_ok=TRUE;
+	health[current].connects++;
+	failed=0;
+}
+
+
+void endpoint_report_failure(void){
+	endpoint_update_rate(FALSE);
+	health[current].last_ok=FALSE;
+	health[current].failures++;
+	failed|=1<<current;
+}
+
+
+uint8_t endpoint_failover(void){
+	for(uint8_t i=0; i<endpoint_count; i++){
+		if (!(failed & (1<<i)))
+			return TRUE;
+	}
+	failed=0;
+	return FALSE;
+}
+
+
+void endpoint_report(void){
+	char debug_msg[96];
+
+	for(uint8_t i=0; i<endpoint_count; i++){
+		snprintf(debug_msg,sizeof(debug_msg),"Endpoint %s:%s%s: %u.%u %% ok, %lu ms to connect, %lu connects, %lu failures",
+				endpoints[i].host,endpoints[i].port,(i==current)?" (current)":"",health[i].rate/10,health[i].rate%10,
+				(unsigned long)health[i].latency,(unsigned long)health[i].connects,(unsigned long)health[i].failures);
+		send_debug(debug_msg);
+	}
+}
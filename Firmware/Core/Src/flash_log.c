@@ -0,0 +1,272 @@
+/**
+*	@file flash_log.c
+*	@brief Store-and-forward log implementation.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+#include <stddef.h>
+
+#include "sim808.h"
+#include "flash_log.h"
+
+#define RECORD_PENDING 0xFFFF  /* state of a record not yet uploaded, as erased */
+#define RECORD_UPLOADED 0x0000 /* written once over RECORD_PENDING, the flash can only clear bits */
+
+/* FLASH_LOG_RECORD_LENGTH bytes, half-word aligned: the flash is programmed 16 bits at a time */
+typedef struct {
+	uint32_t sequence; /* incremented for every record, orders the records of the circular log */
+	position_typedef position;
+	uint8_t reserved[4]; /* erased */
+	uint16_t crc;      /* CRC-16/CCITT of sequence, position and reserved */
+	uint16_t state;    /* RECORD_PENDING or RECORD_UPLOADED, not covered by the CRC */
+} log_record_typedef;
+
+static uint16_t log_head=0;  /* next record to write */
+static uint16_t log_tail=0;  /* oldest record that may not be uploaded yet */
+static uint16_t log_cursor=0; /* next record to read into a batch, the records from the tail are in flight */
+static uint16_t log_count=0; /* records not yet uploaded */
+static uint16_t log_unread=0; /* records not yet read into a batch */
+static uint8_t log_head_erased=FALSE; /* the page the head enters was erased ahead by flash_log_prepare() */
+static uint32_t log_sequence=0;
+static uint32_t log_dropped=0;
+
+
+static const log_record_typedef * log_record(uint16_t index){
+	return (const log_record_typedef *)(uintptr_t)(FLASH_LOG_START+(uint32_t)index*FLASH_LOG_RECORD_LENGTH);
+}
+
+static uint16_t log_crc(const log_record_typedef * record){
+	const uint8_t * data=(const uint8_t *)record;
+	uint16_t crc=0xFFFF;
+
+	for(uint8_t i=0; i<offsetof(log_record_typedef,crc); i++){
+		crc^=(uint16_t)data[i]<<8;
+		for(uint8_t bit=0; bit<8; bit++)
+			crc=(crc&0x8000)?(crc<<1)^0x1021:crc<<1;
+	}
+	return crc;
+}
+
+static uint8_t log_record_valid(const log_record_typedef * record){
+	return record->sequence!=0xFFFFFFFF && record->crc==log_crc(record);
+}
+
+static uint8_t log_record_pending(const log_record_typedef * record){
+	return log_record_valid(record) && record->state==RECORD_PENDING;
+}
+
+/* The sequence numbers of a range follow each other, a record written again after an erase is far ahead */
+static uint8_t log_record_in_range(const flash_log_range_typedef * range, const log_record_typedef * record){
+	return log_record_pending(record) && record->sequence-range->sequence < range->span;
+}
+
+static uint8_t log_record_blank(const log_record_typedef * record){
+	const uint32_t * word=(const uint32_t *)record;
+
+	for(uint8_t i=0; i<FLASH_LOG_RECORD_LENGTH/4; i++){
+		if (word[i]!=0xFFFFFFFF)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static uint8_t log_program(uint32_t address, const uint16_t * data, uint8_t count){
+	uint8_t result=SUCCESS;
+
+	HAL_FLASH_Unlock();
+	for(uint8_t i=0; i<count && result==SUCCESS; i++){
+		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD,address+2*i,data[i])!=HAL_OK)
+			result=FAIL;
+	}
+	HAL_FLASH_Lock();
+	return result;
+}
+
+/* The head enters a new page: its records, the oldest of the log when it is full, are erased */
+static uint8_t log_erase_page(uint16_t page){
+	FLASH_EraseInitTypeDef erase={0};
+	uint32_t page_error;
+	HAL_StatusTypeDef status;
+
+	while (log_unread > 0 && log_cursor/FLASH_LOG_RECORDS_PER_PAGE==page){
+		if (log_record_pending(log_record(log_cursor)))
+			log_unread--;
+		log_cursor=(log_cursor+1)%FLASH_LOG_RECORDS;
+	}
+	while (log_count > 0 && log_tail/FLASH_LOG_RECORDS_PER_PAGE==page){
+		if (log_record_pending(log_record(log_tail))){
+			log_count--;
+			log_dropped++;
+		}
+		log_tail=(log_tail+1)%FLASH_LOG_RECORDS;
+	}
+
+	erase.TypeErase=FLASH_TYPEERASE_PAGES;
+	erase.PageAddress=FLASH_LOG_START+(uint32_t)page*FLASH_LOG_PAGE_SIZE;
+	erase.NbPages=1;
+	HAL_FLASH_Unlock();
+	status=HAL_FLASHEx_Erase(&erase,&page_error);
+	HAL_FLASH_Lock();
+	return (status==HAL_OK)?SUCCESS:FAIL;
+}
+
+
+void flash_log_init(void){
+	const log_record_typedef * record;
+	uint8_t found=FALSE;
+	uint32_t newest=0;
+	uint32_t oldest_pending=0;
+	uint16_t newest_index=0;
+
+	log_count=0;
+	log_tail=0;
+	for(uint16_t i=0; i<FLASH_LOG_RECORDS; i++){
+		record=log_record(i);
+		if (!log_record_valid(record))
+			continue;
+		/* Signed differences, so that the order survives the wrap around of the sequence */
+		if (!found || (int32_t)(record->sequence-newest) > 0){
+			newest=record->sequence;
+			newest_index=i;
+		}
+		if (record->state==RECORD_PENDING){
+			if (log_count==0 || (int32_t)(record->sequence-oldest_pending) < 0){
+				oldest_pending=record->sequence;
+				log_tail=i;
+			}
+			log_count++;
+		}
+		found=TRUE;
+	}
+
+	if (!found){
+		log_head=0;
+		log_sequence=0;
+		return;
+	}
+	log_sequence=newest+1;
+	log_head=(newest_index+1)%FLASH_LOG_RECORDS;
+	/* A record cut by a reset cannot be programmed again: the next blank one, or the next page, is used */
+	while (log_head%FLASH_LOG_RECORDS_PER_PAGE!=0 && !log_record_blank(log_record(log_head)))
+		log_head=(log_head+1)%FLASH_LOG_RECORDS;
+	if (log_count==0)
+		log_tail=log_head;
+	log_cursor=log_tail;
+	log_unread=log_count;
+}
+
+
+uint8_t flash_log_append(const position_typedef * position){
+	log_record_typedef record;
+
+	if (flash_log_erase_pending() && log_erase_page(log_head/FLASH_LOG_RECORDS_PER_PAGE)==FAIL){
+		log_dropped++;
+		return FAIL;
+	}
+	log_head_erased=FALSE;
+
+	memset(&record,0xFF,sizeof(record));
+	record.sequence=log_sequence;
+	record.position=*position;
+	record.position.flags|=POSITION_FLAG_STORED;
+	record.crc=log_crc(&record);
+
+	/* The state stays erased: pending */
+	if (log_program((uint32_t)(uintptr_t)log_record(log_head),(const uint16_t *)&record,offsetof(log_record_typedef,state)/2)==FAIL){
+		log_head=(log_head+1)%FLASH_LOG_RECORDS;
+		log_dropped++;
+		return FAIL;
+	}
+	if (log_count==0)
+		log_tail=log_head;
+	if (log_unread==0)
+		log_cursor=log_head;
+	log_head=(log_head+1)%FLASH_LOG_RECORDS;
+	log_sequence++;
+	log_count++;
+	log_unread++;
+	return SUCCESS;
+}
+
+
+uint8_t flash_log_erase_pending(void){
+	return log_head%FLASH_LOG_RECORDS_PER_PAGE==0 && !log_head_erased;
+}
+
+
+void flash_log_prepare(void){
+	if (flash_log_erase_pending() && log_erase_page(log_head/FLASH_LOG_RECORDS_PER_PAGE)==SUCCESS)
+		log_head_erased=TRUE;
+}
+
+
+const position_typedef * flash_log_peek(void){
+	const log_record_typedef * record;
+
+	/* Records uploaded already or cut by a reset are skipped. The cursor equals the head when the log is full */
+	for(uint16_t i=0; i<FLASH_LOG_RECORDS && log_unread > 0; i++){
+		record=log_record(log_cursor);
+		if (log_record_pending(record))
+			return &record->position;
+		log_cursor=(log_cursor+1)%FLASH_LOG_RECORDS;
+	}
+	log_unread=0;
+	return NULL;
+}
+
+
+void flash_log_take(flash_log_range_typedef * range){
+	if (range->span==0){
+		range->first=log_cursor;
+		range->sequence=log_record(log_cursor)->sequence;
+	}
+	range->span=(log_cursor+FLASH_LOG_RECORDS-range->first)%FLASH_LOG_RECORDS+1;
+	log_cursor=(log_cursor+1)%FLASH_LOG_RECORDS;
+	log_unread--;
+}
+
+
+void flash_log_release(const flash_log_range_typedef * range){
+	static const uint16_t uploaded=RECORD_UPLOADED;
+	const log_record_typedef * record;
+
+	/* Whether the state is written or not, the record is not given again before the next boot */
+	for(uint16_t i=0; i<range->span; i++){
+		record=log_record((range->first+i)%FLASH_LOG_RECORDS);
+		if (!log_record_in_range(range,record))
+			continue;
+		log_program((uint32_t)(uintptr_t)&record->state,&uploaded,1);
+		if (log_count > 0)
+			log_count--;
+	}
+	/* The PUBACKs may come out of order: the tail stops at the oldest record still pending */
+	while (log_tail!=log_cursor && !log_record_pending(log_record(log_tail)))
+		log_tail=(log_tail+1)%FLASH_LOG_RECORDS;
+}
+
+
+void flash_log_rewind(const flash_log_range_typedef * range){
+	if (range->span==0)
+		return;
+	for(uint16_t i=0; i<range->span; i++){
+		if (log_record_in_range(range,log_record((range->first+i)%FLASH_LOG_RECORDS)))
+			log_unread++;
+	}
+	log_cursor=range->first;
+}
+
+
+uint16_t flash_log_count(void){
+	return log_count;
+}
+
+
+uint16_t flash_log_unread(void){
+	return log_unread;
+}
+
+
+uint32_t flash_log_dropped(void){
+	return log_dropped;
+}
@@ -0,0 +1,290 @@
+/**
+*	@file gprs.c
+*	@brief Non-blocking GPRS bring-up implementation.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+#include <stdio.h>
+
+#include "sim808.h"
+#include "network_functions.h"
+#include "gprs.h"
+
+/* Transparent mode can only be selected before the PDP context is activated: AT+CIPSHUT takes the module back to
+ * IP INITIAL
+ */
+#ifdef TRANSPARENT_MODE
+#define DATA_MODE_CMD "AT+CIPMODE=1\r"
+#define DATA_MODE_FIX_CMD "AT+CIPSHUT\r"
+#else
+#define DATA_MODE_CMD "AT+CIPHEAD=1\r"
+#define DATA_MODE_FIX_CMD NULL
+#endif
+
+typedef struct {
+	const char * name;
+	const char * cmd;
+	const char * expected_reply;
+	uint32_t timeout;
+	uint32_t settle;        /* ms to wait before checking the reply, for replies with a line after the expected text */
+	const char * fix_cmd;   /* corrective command sent when the stage fails, NULL if none */
+	uint32_t fix_timeout;
+} gprs_stage_typedef;
+
+/* Indexed by gprs_state_typedef */
+static const gprs_stage_typedef stages[GPRS_STATE_COUNT]={
+	{"down",         NULL,              NULL,       0,                     0,   NULL,                           0},
+	{"phone",        "AT+CFUN?\r",      "OK",       RX_TIMEOUT,            0,   "AT+CFUN=1\r",                  3*RX_TIMEOUT},
+	{"SIM",          "AT+CSMINS?\r",    "OK",       RX_TIMEOUT,            0,   NULL,                           0},
+	/* The PIN is sent by gprs_pin_status(), not as a corrective command */
+	{"PIN",          "AT+CPIN?\r",      "OK",       RX_TIMEOUT,            0,   NULL,                           0},
+	{"signal",       "AT+CSQ\r",        "OK",       RX_TIMEOUT,            0,   NULL,                           0},
+	{"registration", "AT+CREG?\r",      "OK",       RX_TIMEOUT,            0,   "AT+CREG=1\r",                  5*RX_TIMEOUT},
+	{"attach",       "AT+CGATT?\r",     "OK",       RX_TIMEOUT,            0,   "AT+CGATT=1\r",                 3*RX_TIMEOUT},
+	{"data mode",    DATA_MODE_CMD,     "OK",       RX_TIMEOUT,            0,   DATA_MODE_FIX_CMD,              5*RX_TIMEOUT},
+	{"quick send",   "AT+CIPQSEND=1\r", "OK",       RX_TIMEOUT,            0,   "AT+CIPSHUT\r",                 5*RX_TIMEOUT},
+	/* The STATE line comes after OK */
+	{"PDP status",   "AT+CIPSTATUS\r",  "STATE:",   RX_TIMEOUT,            CIPSTATUS_SETTLE, "AT+CIPSHUT\r",                 5*RX_TIMEOUT},
+	{"PDP define",   "AT+CSTT=\"" APN "\",\"\",\"\"\r", "OK", RX_TIMEOUT,   0,   NULL,                           0},
+	{"PDP activate", "AT+CIICR\r",      "OK",       GPRS_ACTIVATE_TIMEOUT, 0,   NULL,                           0},
+	/* AT+CIFSR replies the IP address without OK */
+	{"get IP",       "AT+CIFSR\r",      ".",        2*RX_TIMEOUT,          100, NULL,                           0},
+	{"up",           NULL,              NULL,       0,                     0,   NULL,                           0},
+	{"SIM locked",   NULL,              NULL,       0,                     0,   NULL,                           0},
+};
+
+static gprs_state_typedef gprs_state=GPRS_STATE_DOWN;
+static uint8_t gprs_waiting=FALSE;  /* a command was sent, its reply is pending */
+static uint8_t gprs_fixing=FALSE;   /* the pending command is the corrective command of the stage */
+static uint32_t gprs_sent_at;
+static uint8_t gprs_failures[GPRS_STATE_COUNT];
+static uint8_t gprs_pin_sent=FALSE; /* the PIN was sent since boot, it is never sent twice */
+static uint32_t gprs_pin_sent_at;   /* time the reply to the PIN was received, or timed out */
+static uint32_t gprs_random=0;
+static char gprs_rx_buffer[RX_BUFFER_LENGTH];
+
+
+static uint8_t reply_contains(const char * text){
+	return is_subarray_present((uint8_t*)gprs_rx_buffer,RX_BUFFER_LENGTH,(const uint8_t*)text,strlen(text));
+}
+
+/* xorshift32, seeded from the SysTick counter at the first call */
+static uint32_t gprs_rand(void){
+	if (gprs_random==0)
+		gprs_random=(SysTick->VAL<<16) ^ HAL_GetTick() ^ 0x9E3779B9;
+	gprs_random^=gprs_random<<13;
+	gprs_random^=gprs_random>>17;
+	gprs_random^=gprs_random<<5;
+	return gprs_random;
+}
+
+/* Exponential backoff with +-25% jitter, so that a fleet of trackers does not retry in step after a network outage */
+static uint32_t gprs_backoff(void){
+	uint8_t failures=gprs_failures[gprs_state];
+	uint32_t delay=GPRS_BACKOFF_BASE;
+
+	while (failures-- > 1 && delay < GPRS_BACKOFF_MAX)
+		delay*=2;
+	if (delay > GPRS_BACKOFF_MAX)
+		delay=GPRS_BACKOFF_MAX;
+	delay=delay-delay/4+gprs_rand()%(delay/2+1);
+
+	#ifdef DEBUG_MODE
+	char debug_msg[64];
+	sprintf(debug_msg,"GPRS: %s failed %u times, retry in %lu ms",stages[gprs_state].name,gprs_failures[gprs_state],(unsigned long)delay);
+	send_debug(debug_msg);
+	#endif
+	return delay;
+}
+
+static void gprs_send(const char * cmd){
+	send_AT_cmd_async(cmd);
+	gprs_sent_at=HAL_GetTick();
+	gprs_waiting=TRUE;
+}
+
+static uint32_t gprs_stage_retry(uint8_t use_fix){
+	if (gprs_failures[gprs_state] < 0xFF)
+		gprs_failures[gprs_state]++;
+	if (use_fix && stages[gprs_state].fix_cmd!=NULL){
+		gprs_send(stages[gprs_state].fix_cmd);
+		gprs_fixing=TRUE;
+		return GPRS_POLL_PERIOD;
+	}
+	return gprs_backoff();
+}
+
+static uint32_t gprs_next_stage(gprs_state_typedef next){
+	gprs_failures[gprs_state]=0;
+	gprs_state=next;
+	if (next==GPRS_STATE_UP){
+		link_state_set(TCP_STATUS_READY);
+		#ifdef DEBUG_MODE
+		send_debug("GPRS: up");
+		#endif
+	}
+	return 0;
+}
+
+/* A PDP stage failed: the state of the module is not the expected one, check it again after the backoff */
+static uint32_t gprs_pdp_failed(void){
+	uint32_t delay;
+
+	if (gprs_failures[gprs_state] < 0xFF)
+		gprs_failures[gprs_state]++;
+	delay=gprs_backoff();
+	gprs_state=GPRS_STATE_PDP;
+	return delay;
+}
+
+/* The bring-up stops: a wrong PIN sent again would lock the SIM, or use up the PUK attempts */
+static uint32_t gprs_sim_locked(const char * reason){
+	gprs_state=GPRS_STATE_LOCKED;
+	#ifdef DEBUG_MODE
+	char debug_msg[64];
+	sprintf(debug_msg,"GPRS: SIM locked, %s. Bring-up stopped",reason);
+	send_debug(debug_msg);
+	#else
+	(void)reason;
+	#endif
+	return GPRS_BACKOFF_BASE;
+}
+
+/* Checks the reply to AT+CPIN?, the PIN is only sent when the SIM asks for it */
+static uint32_t gprs_pin_status(void){
+	static const char pin_cmd[]="AT+CPIN=" SIM_PIN "\r";
+
+	if (reply_contains("READY"))
+		return gprs_next_stage(GPRS_STATE_SIGNAL);
+	if (reply_contains("SIM PUK"))
+		return gprs_sim_locked("PUK required");
+	if (!reply_contains("SIM PIN"))
+		return gprs_stage_retry(FALSE);
+	if (sizeof(SIM_PIN)==1)
+		return gprs_sim_locked("no PIN configured");
+	/* The SIM takes a while to check the PIN */
+	if (gprs_pin_sent)
+		return (HAL_GetTick()-gprs_pin_sent_at < GPRS_PIN_SETTLE)?GPRS_BACKOFF_BASE:gprs_sim_locked("PIN not accepted");
+	gprs_pin_sent=TRUE;
+	gprs_send(pin_cmd);
+	gprs_fixing=TRUE;
+	return GPRS_POLL_PERIOD;
+}
+
+/* Selects the next PDP stage from the reply to AT+CIPSTATUS */
+static uint32_t gprs_pdp_status(void){
+	if (reply_contains("IP INITIAL"))
+		return gprs_next_stage(GPRS_STATE_DEFINE);
+	if (reply_contains("IP START"))
+		return gprs_next_stage(GPRS_STATE_ACTIVATE);
+	if (reply_contains("IP GPRSACT"))
+		return gprs_next_stage(GPRS_STATE_GET_IP);
+	/* PDP DEACT needs AT+CIPSHUT, IP CONFIG means the activation is still in progress */
+	if (reply_contains("PDP DEACT"))
+		return gprs_stage_retry(TRUE);
+	if (reply_contains("IP CONFIG") || !reply_contains("STATE:"))
+		return gprs_stage_retry(FALSE);
+	/* IP STATUS, TCP CONNECTING, CONNECT OK, TCP CLOSED, ... */
+	return gprs_next_stage(GPRS_STATE_UP);
+}
+
+
+void gprs_restart(void){
+	link_state_set(TCP_STATUS_GPRS_DOWN);
+	/* Only a reboot unlocks the bring-up, the SIM does not change meanwhile */
+	if (gprs_state==GPRS_STATE_LOCKED)
+		return;
+	gprs_state=GPRS_STATE_PHONE;
+	gprs_fixing=FALSE;
+	memset(gprs_failures,0,sizeof(gprs_failures));
+	/* A pending reply is dropped, the next command clears the receive buffer */
+	gprs_waiting=FALSE;
+}
+
+
+uint32_t gprs_step(void){
+	uint32_t timeout;
+	uint8_t reply;
+
+	if (gprs_state==GPRS_STATE_DOWN || gprs_state==GPRS_STATE_UP || gprs_state==GPRS_STATE_LOCKED)
+		return GPRS_BACKOFF_BASE;
+
+	if (!gprs_waiting){
+		gprs_send(stages[gprs_state].cmd);
+		return GPRS_POLL_PERIOD;
+	}
+
+	if (gprs_fixing){
+		/* The PIN is checked by the next AT+CPIN?, which may still reply SIM PIN for a while after the OK. Without
+		 * reply, the PIN is checked the same way: only an ERROR says it is wrong.
+		 */
+		timeout=(gprs_state==GPRS_STATE_PIN)?RX_TIMEOUT:stages[gprs_state].fix_timeout;
+		reply=poll_AT_reply("OK",1,gprs_rx_buffer,timeout);
+		if (reply==AT_PENDING)
+			return GPRS_POLL_PERIOD;
+		gprs_waiting=FALSE;
+		gprs_fixing=FALSE;
+		if (gprs_state==GPRS_STATE_PIN){
+			gprs_pin_sent_at=HAL_GetTick();
+			return (reply==FAIL && reply_contains("ERROR"))?gprs_sim_locked("PIN rejected"):GPRS_BACKOFF_BASE;
+		}
+		return gprs_backoff();
+	}
+
+	if (HAL_GetTick()-gprs_sent_at < stages[gprs_state].settle)
+		return GPRS_POLL_PERIOD;
+	reply=poll_AT_reply(stages[gprs_state].expected_reply,1,gprs_rx_buffer,stages[gprs_state].timeout);
+	if (reply==AT_PENDING)
+		return GPRS_POLL_PERIOD;
+	gprs_waiting=FALSE;
+
+	switch(gprs_state){
+	case GPRS_STATE_PHONE:
+		return (reply && reply_contains("+CFUN: 1"))?gprs_next_stage(GPRS_STATE_SIM):gprs_stage_retry(TRUE);
+	case GPRS_STATE_SIM:
+		return (reply && reply_contains("+CSMINS: 0,1"))?gprs_next_stage(GPRS_STATE_PIN):gprs_stage_retry(TRUE);
+	case GPRS_STATE_PIN:
+		return reply?gprs_pin_status():gprs_stage_retry(FALSE);
+	case GPRS_STATE_SIGNAL:
+		/* RSSI 0 is -115 dBm or less, 99 is not detectable */
+		return (reply && !reply_contains("+CSQ: 0,") && !reply_contains("+CSQ: 99,"))?gprs_next_stage(GPRS_STATE_REGISTRATION):gprs_stage_retry(TRUE);
+	case GPRS_STATE_REGISTRATION:
+		/* Registered on the home network (1) or roaming (5) */
+		return (reply && (reply_contains(",1") || reply_contains(",5")))?gprs_next_stage(GPRS_STATE_ATTACH):gprs_stage_retry(TRUE);
+	case GPRS_STATE_ATTACH:
+		return (reply && !reply_contains("CGATT: 0"))?gprs_next_stage(GPRS_STATE_DATA_MODE):gprs_stage_retry(TRUE);
+	case GPRS_STATE_DATA_MODE:
+		return reply?gprs_next_stage(GPRS_STATE_QUICK_SEND):gprs_stage_retry(TRUE);
+	case GPRS_STATE_QUICK_SEND:
+		return reply?gprs_next_stage(GPRS_STATE_PDP):gprs_stage_retry(TRUE);
+	case GPRS_STATE_PDP:
+		return gprs_pdp_status();
+	/* A successful PDP command gives the next state: IP START, IP GPRSACT, then IP STATUS. AT+CIPSTATUS is only
+	 * sent again when a command fails.
+	 */
+	case GPRS_STATE_DEFINE:
+		return reply?gprs_next_stage(GPRS_STATE_ACTIVATE):gprs_pdp_failed();
+	case GPRS_STATE_ACTIVATE:
+		return reply?gprs_next_stage(GPRS_STATE_GET_IP):gprs_pdp_failed();
+	case GPRS_STATE_GET_IP:
+		return (reply && !reply_contains("ERROR"))?gprs_next_stage(GPRS_STATE_UP):gprs_pdp_failed();
+	default:
+		return GPRS_BACKOFF_BASE;
+	}
+}
+
+
+uint8_t gprs_at_pending(void){
+	return gprs_waiting;
+}
+
+
+gprs_state_typedef gprs_get_state(void){
+	return gprs_state;
+}
+
+
+const char * gprs_state_name(gprs_state_typedef state){
+	return (state < GPRS_STATE_COUNT)?stages[state].name:"?";
+}
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "gps.h"
+#include "profiler.h"
 
 
 
@@ -23,7 +24,110 @@ uint8_t enable_gps(){
 }
 
 
-uint8_t get_gps_location(char * coordinates){
+/* Unsigned decimal number scaled by 10^decimals, the extra decimals are truncated. Returns the start of the next
+ * field, after the comma.
+ */
+static const char * parse_field(const char * text, const char * end, uint8_t decimals, uint32_t * value){
+	uint8_t fraction=FALSE;
+
+	*value=0;
+	while (text<end && *text!=',' && *text!='\r'){
+		if (*text=='.')
+			fraction=TRUE;
+		else if (*text>='0' && *text<='9' && (!fraction || decimals > 0)){
+			*value=*value*10+(*text-'0');
+			if (fraction)
+				decimals--;
+		}
+		text++;
+	}
+	while (decimals-- > 0)
+		*value*=10;
+	if (text<end && *text==',')
+		text++;
+	return text;
+}
+
+static const char * parse_signed_field(const char * text, const char * end, uint8_t decimals, uint32_t * value, uint8_t * negative){
+	*negative=(text<end && *text=='-');
+	return parse_field(text+*negative,end,decimals,value);
+}
+
+/* ddmm.mmmmm scaled by 1e5 to 1e-7 degree: 1e-5 minute is 5/3 of 1e-7 degree */
+static int32_t parse_coordinate(uint32_t ddmm, uint8_t negative){
+	int32_t value=(ddmm/10000000)*10000000+((ddmm%10000000)*5+1)/3;
+
+	return negative?-value:value;
+}
+
+/* yyyyMMddhhmmss.sss */
+static uint32_t parse_utc(const char * text, const char * end){
+	uint8_t digit[14];
+
+	for(uint8_t i=0; i<sizeof(digit); i++){
+		if (text+i>=end || text[i]<'0' || text[i]>'9')
+			return 0;
+		digit[i]=text[i]-'0';
+	}
+	return position_utc_seconds(digit[0]*1000+digit[1]*100+digit[2]*10+digit[3],digit[4]*10+digit[5],digit[6]*10+digit[7],
+			digit[8]*10+digit[9],digit[10]*10+digit[11],digit[12]*10+digit[13]);
+}
+
+
+uint8_t parse_gps_location(const char * cmd_reply, position_typedef * position){
+
+	/* Example reply 
+	* AT+CGPSINF=0 +CGPSINF: 0,4927.656000,1106.059700,319.200000,20220816200132.000,0,12,1.592720,351
+	* The fields after the mode are latitude and longitude (ddmm.mmmmmm), altitude (m), UTC time, time to first fix (s),
+	* satellites in use, speed over ground (knots) and course (degree).
+	* The tag is searched instead of using a fixed offset because a URC may be received before the reply.
+	*/
+	static const char tag[]="+CGPSINF: 0,";
+	const char * end=cmd_reply+RX_BUFFER_LENGTH;
+	const char * text;
+	uint32_t value;
+	uint8_t negative;
+	uint16_t i;
+
+	PROFILE_BEGIN(PROFILE_ZONE_GPS_PARSE);
+	for(i=0; i<RX_BUFFER_LENGTH-(sizeof(tag)-1); i++){
+		if (cmd_reply[i]=='+' && memcmp(cmd_reply+i,tag,sizeof(tag)-1)==0)
+			break;
+	}
+	/* No tag, or an empty latitude: the module has no fix */
+	if (i >= RX_BUFFER_LENGTH-(sizeof(tag)-1) || cmd_reply[i+sizeof(tag)-1]==','){
+		PROFILE_END(PROFILE_ZONE_GPS_PARSE);
+		return FAIL;
+	}
+	text=cmd_reply+i+sizeof(tag)-1;
+
+	memset(position,0,sizeof(position_typedef));
+	text=parse_signed_field(text,end,5,&value,&negative);
+	position->latitude=parse_coordinate(value,negative);
+	text=parse_signed_field(text,end,5,&value,&negative);
+	position->longitude=parse_coordinate(value,negative);
+	text=parse_signed_field(text,end,0,&value,&negative);
+	if (value > 0x7FFF)
+		value=0x7FFF;
+	position->altitude=negative?-(int16_t)value:(int16_t)value;
+	position->time=parse_utc(text,end);
+	text=parse_field(text,end,0,&value);
+	/* Time to first fix */
+	text=parse_field(text,end,0,&value);
+	text=parse_field(text,end,0,&value);
+	position->satellites=(value > 0xFF)?0xFF:value;
+	/* 1 knot is 1852/36 cm/s, the speed is read in 1/1000 knot */
+	text=parse_field(text,end,3,&value);
+	value=(value > 2000000)?0xFFFF:value*1852/36000;
+	position->speed=(value > 0xFFFF)?0xFFFF:value;
+	parse_field(text,end,2,&value);
+	position->course=value%36000;
+	PROFILE_END(PROFILE_ZONE_GPS_PARSE);
+	return SUCCESS;
+}
+
+
+uint8_t get_gps_location(position_typedef * position){
 
 	/* 
 	 * The modules reply inculde: 
@@ -48,15 +152,9 @@ uint8_t get_gps_location(char * coordinates){
 
 		err_status=send_AT_cmd(gps_get_location_cmd,"OK",1,local_rx_buffer,RX_WAIT);
 		
-		/* Example reply 
-		* AT+CGPSINF=0 +CGPSINF: 0,4927.656000,1106.059700,319.200000,20220816200132.000,0,12,1.592720,351
-		* Actuall coordinates start at charachter 27
-		*/
-
-		/* Extract the coordinates from the cmd reply and copy only 
-		*	the coordinates into function parameter char * coordinates
-		*/
-		memcpy(coordinates,local_rx_buffer+27,GPS_COORDINATES_LENGTH);
+		if (err_status)
+			err_status=parse_gps_location(local_rx_buffer,position);
+		position->flags|=POSITION_FLAG_3D;
 		
 		return err_status;
 	}
@@ -22,6 +22,10 @@
 #include "gps.h"
 #include "network_functions.h"
 #include "aes_encryption.h"
+#include "benchmark.h"
+#include "profiler.h"
+#include "tasks.h"
+#include "power.h"
 
 
 
@@ -52,36 +56,34 @@ int main(void)
 	sim.status_pin=GPIO_PIN_14;
 	
 
-	/*initialize the SIM808 module */
-	sim_power_off(&sim);
+	/*initialize the SIM808 module, a module that is already on is not power cycled */
 	sim_init(&sim);
 
+	#ifdef PROFILER_MODE
+	profiler_init();
+	#endif
+
+	#ifdef BENCHMARK_MODE
+	run_benchmarks();
+	#endif
+
+	/* STOP mode between tasks, the scheduler falls back to sleep mode if the RTC does not start */
+	if (power_init()==FAIL)
+		send_debug("Power: STOP mode is not available");
+
 	//uint8_t key[]={0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c};
 	//uint8_t txt[]={0x32,0x43,0xf6,0xa8,0x88,0x5a,0x30,0x8d,0x31,0x31,0x98,0xa2,0xe0,0x37,0x07,0x34};
 
-	/* enable GPS/GPRS */
+	/* enable GPS, GPRS is brought up in the background by the GPRS task */
 	enable_gps();
-	enable_gprs();
 	
-	char gps_position[24]="Position_data";
-	char ip_address[]="18.195.228.39";
-	char tcp_port[] = "1883";
-	//char msg[]="STM32CubeIDE";
-	uint8_t tx_error_count=0;
+	/* MQTT servers in order of preference, see endpoint.h. A name is resolved once and cached, see dns_cache.h */
+	static const endpoint_typedef endpoints[]={
+		{"18.195.228.39","1883"},
+	};
 
-while (1)
-  {
-
-		if (get_gps_location(gps_position)){
-			HAL_GPIO_TogglePin(GPIOB,GPIO_PIN_13);
-			if (publish_mqtt_msg(ip_address,tcp_port,"P","B1",gps_position))
-				HAL_GPIO_TogglePin(GPIOB,GPIO_PIN_12);
-			else tx_error_count++;
-	}
-		if (tx_error_count>10)
-			system_reset(&sim);
-		HAL_Delay(2000);
-  }
+	/* GPS polling, uplink, logging and health monitoring run as cooperative tasks from now on */
+	tasks_run(&sim,endpoints,sizeof(endpoints)/sizeof(endpoints[0]));
 
 }
 	
@@ -99,8 +101,10 @@ void SystemClock_Config(void)
   /** Initializes the RCC Oscillators according to the specified parameters
   * in the RCC_OscInitTypeDef structure.
   */
-  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE;
+  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE|RCC_OSCILLATORTYPE_HSI;
   RCC_OscInitStruct.HSEState = RCC_HSE_ON;
+  RCC_OscInitStruct.HSIState = RCC_HSI_ON;
+  RCC_OscInitStruct.HSICalibrationValue = RCC_HSICALIBRATION_DEFAULT;
   RCC_OscInitStruct.PLL.PLLState = RCC_PLL_NONE;
   if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
   {
@@ -120,7 +124,8 @@ void SystemClock_Config(void)
     Error_Handler();
   }
   PeriphClkInit.PeriphClockSelection = RCC_PERIPHCLK_USART1;
-  PeriphClkInit.Usart1ClockSelection = RCC_USART1CLKSOURCE_PCLK1;
+  /* USART1 runs from the HSI so that it keeps receiving in STOP mode */
+  PeriphClkInit.Usart1ClockSelection = RCC_USART1CLKSOURCE_HSI;
   if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInit) != HAL_OK)
   {
     Error_Handler();
@@ -0,0 +1,612 @@
+/**
+*	@file mqtt.c
+*	@brief MQTT QoS 1 in-flight window implementation.
+*
+*	With MQTTSN_MODE the packets are MQTT-SN messages: the window, the identifiers and the retransmissions are the same,
+*	only the layout of the packets changes. A datagram carries a single message, so a send carries a single packet.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+
+#include "sim808.h"
+#include "network_functions.h"
+#include "mqtt.h"
+
+#ifdef MQTTSN_MODE
+#define MQTT_DUP_INDEX 2 /* flags of the MQTT-SN PUBLISH */
+#define MQTT_DUP_FLAG MQTTSN_FLAG_DUP
+#else
+#define MQTT_DUP_INDEX 0
+#define MQTT_DUP_FLAG 0x08
+#endif
+
+/* PUBLISH packets acknowledged by a PUBACK. The others are delivered as far as the client can tell once sent */
+#if !defined(MQTTSN_MODE) || MQTTSN_QOS==1
+#define MQTT_ACKNOWLEDGED 1
+#endif
+
+/* States of a place of the window */
+#define SLOT_FREE 0
+#define SLOT_PENDING 1 /* to be sent, or sent again */
+#define SLOT_QUEUED 2  /* in the TX buffer being sent */
+#define SLOT_SENT 3    /* waiting for the PUBACK since sent_at */
+
+typedef struct {
+	uint8_t state;
+	uint8_t retries;
+	uint8_t items;
+	uint16_t packet_id;
+	uint32_t created_at;
+	uint32_t sent_at;
+	uint16_t length;
+	uint8_t payload_offset;
+	flash_log_range_typedef stored; /* records of the flash log in the payload, released at the PUBACK */
+	uint8_t packet[MQTT_INFLIGHT_PACKET_LENGTH];
+} inflight_typedef;
+
+static inflight_typedef window[MQTT_INFLIGHT_WINDOW];
+static uint16_t next_packet_id=1;
+static mqtt_stats_typedef stats;
+
+/* Incremental decoder of the packets received from the server. Its state is kept between two reads, so that a
+ * packet may be split over several of them. The variable header is copied to rx_header, the rest is read in place.
+ */
+#define RX_TYPE 0
+#define RX_LENGTH 1
+#define RX_HEADER 2  /* variable header, copied to rx_header */
+#define RX_PAYLOAD 3 /* payload of a PUBLISH, given to the downlink handler in place */
+#define RX_SKIP 4    /* rest of a packet that is not used */
+#define RX_MSG_TYPE 5 /* MQTT-SN: message type, after the length */
+
+#define RX_HEADER_LENGTH (2+MQTT_RX_TOPIC_LENGTH+2) /* topic length, topic and packet identifier of a PUBLISH */
+
+static uint8_t rx_state=RX_TYPE;
+static uint8_t rx_type;       /* first byte of the fixed header, the message type with MQTT-SN */
+static uint32_t rx_remaining; /* bytes of the packet not yet decoded */
+static uint32_t rx_multiplier;
+static uint8_t rx_header[RX_HEADER_LENGTH];
+static uint8_t rx_header_count;
+static uint8_t rx_header_needed;
+static uint8_t rx_valid;      /* the variable header was decoded */
+static uint32_t rx_payload_offset;
+static uint32_t rx_payload_length;
+
+static mqtt_downlink_handler_typedef downlink_handler=NULL;
+static uint8_t connack_code=0;
+static uint8_t connack_accepted=FALSE;
+static uint8_t pingresp_received=FALSE;
+
+/* PUBACKs to be sent for the QoS 1 PUBLISH packets received */
+static uint16_t puback_ids[MQTT_PUBACK_QUEUE_LENGTH];
+#ifdef MQTTSN_MODE
+static uint16_t puback_topics[MQTT_PUBACK_QUEUE_LENGTH]; /* the MQTT-SN PUBACK repeats the topic identifier */
+#endif
+static uint8_t puback_count=0;
+
+
+/* 0 is not a valid packet identifier */
+static uint16_t mqtt_new_packet_id(void){
+	uint16_t packet_id;
+
+	do {
+		packet_id=next_packet_id++;
+	} while (packet_id==0);
+	return packet_id;
+}
+
+static uint8_t slot_timed_out(const inflight_typedef * slot){
+	return slot->state==SLOT_SENT && HAL_GetTick()-slot->sent_at >= MQTT_RETRY_TIMEOUT;
+}
+
+static void slot_delivered(inflight_typedef * slot){
+	uint32_t latency=HAL_GetTick()-slot->created_at;
+
+	stats.acked++;
+	stats.items+=slot->items;
+	stats.latency_total+=latency;
+	if (latency > stats.latency_max)
+		stats.latency_max=latency;
+	flash_log_release(&slot->stored);
+	slot->state=SLOT_FREE;
+}
+
+static void mqtt_puback(uint16_t packet_id){
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state!=SLOT_FREE && window[i].packet_id==packet_id){
+			slot_delivered(&window[i]);
+			return;
+		}
+	}
+	/* PUBACK of a packet acknowledged already, after a retransmission */
+}
+
+static void mqtt_puback_queue(uint16_t topic_id, uint16_t packet_id){
+	/* Without room the PUBACK is not sent, the server sends the PUBLISH again */
+	if (puback_count < MQTT_PUBACK_QUEUE_LENGTH){
+		#ifdef MQTTSN_MODE
+		puback_topics[puback_count]=topic_id;
+		#else
+		(void)topic_id;
+		#endif
+		puback_ids[puback_count++]=packet_id;
+	}
+}
+
+static uint16_t rx_uint16(uint8_t index){
+	return ((uint16_t)rx_header[index]<<8) | rx_header[index+1];
+}
+
+#ifdef MQTTSN_MODE
+/* Topic of the PUBLISH being received: its 2 bytes identifier with MQTT-SN */
+#define RX_TOPIC ((const char *)rx_header+1)
+#define RX_TOPIC_LENGTH 2
+
+/* The whole message was received */
+static void mqtt_rx_packet(void){
+	rx_state=RX_TYPE;
+	if (!rx_valid){
+		stats.rx_skipped++;
+		return;
+	}
+	switch(rx_type){
+	case MQTTSN_CONNACK:
+		connack_code=rx_header[0];
+		connack_accepted=(connack_code==0);
+		break;
+	case MQTTSN_PUBACK:
+		/* A PUBLISH rejected by the gateway, congested or with an unknown topic, is sent again at its timeout */
+		if (rx_header[4]==0)
+			mqtt_puback(rx_uint16(2));
+		break;
+	case MQTTSN_PINGRESP:
+		stats.pingresps++;
+		pingresp_received=TRUE;
+		break;
+	case MQTTSN_PUBLISH:
+		stats.downlinks++;
+		if ((rx_header[0]&MQTTSN_FLAG_QOS_MASK)==0x20)
+			mqtt_puback_queue(rx_uint16(1),rx_uint16(3));
+		else if ((rx_header[0]&MQTTSN_FLAG_QOS_MASK)==0x40)
+			stats.rx_unsupported++;
+		break;
+	}
+}
+#else
+#define RX_TOPIC ((const char *)rx_header+2)
+#define RX_TOPIC_LENGTH rx_uint16(0)
+
+/* The whole packet was received */
+static void mqtt_rx_packet(void){
+	rx_state=RX_TYPE;
+	if (!rx_valid){
+		stats.rx_skipped++;
+		return;
+	}
+	switch(rx_type>>4){
+	case MQTT_CONNACK:
+		connack_code=rx_header[1];
+		connack_accepted=(connack_code==0);
+		break;
+	case MQTT_PUBACK:
+		mqtt_puback(rx_uint16(0));
+		break;
+	case MQTT_PINGRESP:
+		stats.pingresps++;
+		pingresp_received=TRUE;
+		break;
+	case MQTT_PUBLISH:
+		stats.downlinks++;
+		/* QoS 1 is acknowledged with a PUBACK. QoS 2 needs the PUBREC, PUBREL, PUBCOMP handshake, which is not
+		 * implemented: the message is given to the handler but not acknowledged
+		 */
+		if ((rx_type&0x06)==0x02)
+			mqtt_puback_queue(0,rx_uint16(rx_header_needed-2));
+		else if ((rx_type&0x06)==0x04)
+			stats.rx_unsupported++;
+		break;
+	}
+}
+#endif
+
+/* The rest of the packet is not used */
+static void mqtt_rx_skip(void){
+	if (rx_remaining==0)
+		mqtt_rx_packet();
+	else
+		rx_state=RX_SKIP;
+}
+
+/* The payload of a PUBLISH starts */
+static void mqtt_rx_payload(void){
+	rx_payload_offset=0;
+	rx_payload_length=rx_remaining;
+	if (rx_remaining > 0){
+		rx_state=RX_PAYLOAD;
+		return;
+	}
+	/* An empty message is given too */
+	if (downlink_handler!=NULL)
+		downlink_handler(RX_TOPIC,RX_TOPIC_LENGTH,rx_header,0,0,0);
+	mqtt_rx_packet();
+}
+
+#ifdef MQTTSN_MODE
+/* The length and the type were received: size of the header to be copied */
+static void mqtt_rx_body(void){
+	rx_header_count=0;
+	rx_valid=FALSE;
+	switch(rx_type){
+	case MQTTSN_CONNACK: /* return code */
+		rx_header_needed=1;
+		break;
+	case MQTTSN_PUBACK:  /* topic identifier, message identifier and return code */
+	case MQTTSN_PUBLISH: /* flags, topic identifier and message identifier */
+		rx_header_needed=5;
+		break;
+	case MQTTSN_PINGRESP:
+		rx_header_needed=0;
+		rx_valid=TRUE;
+		break;
+	default:
+		rx_header_needed=0;
+	}
+	if (rx_header_needed > rx_remaining){
+		rx_valid=FALSE;
+		rx_header_needed=0;
+	}
+	if (rx_header_needed > 0)
+		rx_state=RX_HEADER;
+	else
+		mqtt_rx_skip();
+}
+
+/* The header was copied */
+static void mqtt_rx_header(void){
+	rx_valid=TRUE;
+	if (rx_type==MQTTSN_PUBLISH)
+		mqtt_rx_payload();
+	else
+		mqtt_rx_skip();
+}
+#else
+/* The fixed header was received: size of the variable header to be copied */
+static void mqtt_rx_body(void){
+	rx_header_count=0;
+	rx_valid=FALSE;
+	switch(rx_type>>4){
+	case MQTT_CONNACK:
+	case MQTT_PUBACK:
+	case MQTT_PUBLISH: /* topic length first, then the rest */
+		rx_header_needed=2;
+		break;
+	case MQTT_PINGRESP:
+		rx_header_needed=0;
+		rx_valid=TRUE;
+		break;
+	default:
+		rx_header_needed=0;
+	}
+	if (rx_header_needed > rx_remaining){
+		rx_valid=FALSE;
+		rx_header_needed=0;
+	}
+	if (rx_header_needed > 0)
+		rx_state=RX_HEADER;
+	else
+		mqtt_rx_skip();
+}
+
+/* The bytes of the variable header counted so far were copied */
+static void mqtt_rx_header(void){
+	uint16_t topic_length;
+
+	if ((rx_type>>4)==MQTT_PUBLISH && rx_header_count==2){
+		topic_length=rx_uint16(0);
+		/* QoS 1 and 2 have a packet identifier after the topic */
+		if (topic_length > MQTT_RX_TOPIC_LENGTH || topic_length+((rx_type&0x06)?2:0) > rx_remaining){
+			mqtt_rx_skip();
+			return;
+		}
+		rx_header_needed=2+topic_length+((rx_type&0x06)?2:0);
+		if (rx_header_count < rx_header_needed)
+			return;
+	}
+	rx_valid=TRUE;
+	if ((rx_type>>4)==MQTT_PUBLISH)
+		mqtt_rx_payload();
+	else
+		mqtt_rx_skip();
+}
+#endif
+
+/* Decodes a read of TCP data, in place */
+static uint16_t mqtt_rx_parse(const uint8_t * data, uint16_t length){
+	uint16_t i=0;
+	uint16_t count;
+
+	while (i < length){
+		switch(rx_state){
+		#ifdef MQTTSN_MODE
+		/* The length counts the whole message. 0x01: the length is in the next 2 bytes */
+		case RX_TYPE:
+			rx_remaining=data[i++];
+			if (rx_remaining==0x01){
+				rx_remaining=0;
+				rx_multiplier=2; /* bytes of the length still to come */
+				rx_state=RX_LENGTH;
+			}
+			/* Shorter than a length and a type: the stream is out of step, start again with the next byte */
+			else if (rx_remaining >= 2){
+				rx_remaining-=2;
+				rx_state=RX_MSG_TYPE;
+			}
+			break;
+		case RX_LENGTH:
+			rx_remaining=(rx_remaining<<8) | data[i++];
+			if (--rx_multiplier > 0)
+				break;
+			if (rx_remaining >= 4){
+				rx_remaining-=4;
+				rx_state=RX_MSG_TYPE;
+			}
+			else
+				rx_state=RX_TYPE;
+			break;
+		case RX_MSG_TYPE:
+			rx_type=data[i++];
+			mqtt_rx_body();
+			break;
+		#else
+		case RX_TYPE:
+			rx_type=data[i++];
+			rx_remaining=0;
+			rx_multiplier=1;
+			rx_state=RX_LENGTH;
+			break;
+		case RX_LENGTH:
+			rx_remaining+=(data[i]&0x7F)*rx_multiplier;
+			rx_multiplier*=128;
+			if (data[i++]&0x80){
+				/* At most 4 bytes of remaining length: the stream is out of step, start again */
+				if (rx_multiplier > 128UL*128*128)
+					rx_state=RX_TYPE;
+				break;
+			}
+			mqtt_rx_body();
+			break;
+		#endif
+		case RX_HEADER:
+			rx_header[rx_header_count++]=data[i++];
+			rx_remaining--;
+			if (rx_header_count==rx_header_needed)
+				mqtt_rx_header();
+			break;
+		default: /* RX_PAYLOAD, RX_SKIP */
+			count=(rx_remaining < (uint32_t)(length-i))?rx_remaining:length-i;
+			if (rx_state==RX_PAYLOAD && count > 0 && downlink_handler!=NULL)
+				downlink_handler(RX_TOPIC,RX_TOPIC_LENGTH,data+i,count,rx_payload_offset,rx_payload_length);
+			rx_payload_offset+=count;
+			rx_remaining-=count;
+			i+=count;
+			if (rx_remaining==0)
+				mqtt_rx_packet();
+		}
+	}
+	return i;
+}
+
+
+uint8_t mqtt_window_free(void){
+	uint8_t count=0;
+
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state==SLOT_FREE)
+			count++;
+	}
+	return count;
+}
+
+
+uint8_t mqtt_window_add(const mqtt_topic_template_typedef * topic, const uint8_t * payload, uint16_t payload_length, uint8_t items, uint32_t created_at, const flash_log_range_typedef * stored){
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state!=SLOT_FREE)
+			continue;
+		window[i].packet_id=mqtt_new_packet_id();
+		#ifdef MQTTSN_MODE
+		window[i].length=build_mqttsn_publish_packet(window[i].packet,MQTT_INFLIGHT_PACKET_LENGTH,MQTTSN_TOPIC_ID,window[i].packet_id,payload,payload_length);
+		#else
+		window[i].length=build_mqtt_publish_template(window[i].packet,MQTT_INFLIGHT_PACKET_LENGTH,topic,window[i].packet_id,payload,payload_length);
+		#endif
+		if (window[i].length==0)
+			return FAIL;
+		window[i].payload_offset=window[i].length-payload_length;
+		window[i].stored=*stored;
+		window[i].items=items;
+		window[i].created_at=created_at;
+		window[i].retries=0;
+		window[i].state=SLOT_PENDING;
+		return SUCCESS;
+	}
+	return FAIL;
+}
+
+
+const uint8_t * mqtt_window_payload(uint8_t index, uint16_t * length){
+	if (index >= MQTT_INFLIGHT_WINDOW || window[index].state==SLOT_FREE)
+		return NULL;
+	*length=window[index].length-window[index].payload_offset;
+	return window[index].packet+window[index].payload_offset;
+}
+
+
+uint8_t mqtt_window_append(tx_buffer_typedef * tx){
+	uint8_t count=0;
+	#ifdef MQTTSN_MODE
+	uint8_t puback[7]={7,MQTTSN_PUBACK};
+
+	/* A datagram carries a single message: a PUBACK, or a PUBLISH with the next send */
+	if (puback_count > 0 && tx->length+sizeof(puback) <= TX_BUFFER_LENGTH){
+		puback_count--;
+		puback[2]=puback_topics[puback_count]>>8;
+		puback[3]=puback_topics[puback_count]&0xFF;
+		puback[4]=puback_ids[puback_count]>>8;
+		puback[5]=puback_ids[puback_count]&0xFF;
+		puback[6]=0; /* accepted */
+		tx_buffer_append(tx,puback,sizeof(puback));
+		return 0;
+	}
+	#else
+	uint8_t puback[4]={MQTT_PUBACK<<4,0x02};
+
+	/* A PUBACK lost with the message is not sent again: the server sends the PUBLISH again */
+	while (puback_count > 0 && tx->length+sizeof(puback) <= TX_BUFFER_LENGTH){
+		puback_count--;
+		puback[2]=puback_ids[puback_count]>>8;
+		puback[3]=puback_ids[puback_count]&0xFF;
+		tx_buffer_append(tx,puback,sizeof(puback));
+	}
+	#endif
+
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state!=SLOT_PENDING && !slot_timed_out(&window[i]))
+			continue;
+		if (tx->length+window[i].length > TX_BUFFER_LENGTH)
+			continue;
+		#ifdef MQTTSN_MODE
+		if (count > 0)
+			break;
+		#endif
+		/* No PUBACK in time: same packet identifier, with the DUP flag */
+		if (window[i].state==SLOT_SENT){
+			window[i].packet[MQTT_DUP_INDEX]|=MQTT_DUP_FLAG;
+			window[i].retries++;
+			stats.retransmitted++;
+		}
+		tx_buffer_append(tx,window[i].packet,window[i].length);
+		window[i].state=SLOT_QUEUED;
+		count++;
+	}
+	return count;
+}
+
+
+void mqtt_window_sent(void){
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state==SLOT_QUEUED){
+			window[i].state=SLOT_SENT;
+			window[i].sent_at=HAL_GetTick();
+			#ifndef MQTT_ACKNOWLEDGED
+			slot_delivered(&window[i]);
+			#endif
+		}
+	}
+}
+
+
+void mqtt_window_unsent(void){
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state==SLOT_QUEUED)
+			window[i].state=SLOT_PENDING;
+	}
+}
+
+
+void mqtt_window_resend_all(void){
+	/* The rest of a packet of the lost connection will not come */
+	mqtt_rx_reset();
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state==SLOT_FREE)
+			continue;
+		/* A packet in a failed send may have reached the server */
+		if (window[i].state!=SLOT_PENDING)
+			window[i].packet[MQTT_DUP_INDEX]|=MQTT_DUP_FLAG;
+		window[i].retries=0;
+		window[i].state=SLOT_PENDING;
+	}
+}
+
+
+uint8_t mqtt_window_pending(void){
+	if (puback_count > 0)
+		return TRUE;
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state==SLOT_PENDING || slot_timed_out(&window[i]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
+uint8_t mqtt_window_stalled(void){
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state!=SLOT_FREE && window[i].retries > MQTT_MAX_RETRIES)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
+uint32_t mqtt_window_next_timeout(void){
+	uint32_t next=0xFFFFFFFF;
+	uint32_t elapsed;
+
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if (window[i].state!=SLOT_SENT)
+			continue;
+		elapsed=HAL_GetTick()-window[i].sent_at;
+		if (elapsed >= MQTT_RETRY_TIMEOUT)
+			return 0;
+		if (MQTT_RETRY_TIMEOUT-elapsed < next)
+			next=MQTT_RETRY_TIMEOUT-elapsed;
+	}
+	return next;
+}
+
+
+void mqtt_poll_rx(void){
+	const uint8_t * data;
+	uint16_t length;
+
+	while ((length=peek_tcp_data(&data)) > 0)
+		release_tcp_data(mqtt_rx_parse(data,length));
+}
+
+
+void mqtt_rx_reset(void){
+	rx_state=RX_TYPE;
+	/* The PUBACKs owed for the lost connection are not expected by the server: the session is a clean one */
+	puback_count=0;
+}
+
+
+uint8_t mqtt_connack_refused(void){
+	uint8_t code=connack_code;
+	connack_code=0;
+	return code;
+}
+
+
+uint8_t mqtt_connack_accepted(void){
+	uint8_t accepted=connack_accepted;
+	connack_accepted=FALSE;
+	return accepted;
+}
+
+
+uint8_t mqtt_pingresp_received(void){
+	uint8_t received=pingresp_received;
+	pingresp_received=FALSE;
+	return received;
+}
+
+
+void mqtt_set_downlink_handler(mqtt_downlink_handler_typedef handler){
+	downlink_handler=handler;
+}
+
+
+void mqtt_get_stats(mqtt_stats_typedef * copy){
+	*copy=stats;
+	memset(&stats,0,sizeof(stats));
+}
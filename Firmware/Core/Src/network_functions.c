@@ -336,9 +336,9 @@ uint8_t enable_gprs(){
 		 * APN_LENGTH must be adjusted when APN is changed in the header file
 		 * 18 = the length of the command AT+CSTT="","",""\r without the APN name inserted
 		 */
-		static char define_PDP_context_cmd[APN_LENGTH+18]= "AT+CSTT=\"";
-		strcat(define_PDP_context_cmd,APN); /* AT+CSTT="APN */
-		strcat(define_PDP_context_cmd,"\",\"\",\"\"\r"); /* AT+CSTT="APN","","" */
+		char define_PDP_context_cmd[APN_LENGTH+18];
+		/* Built at every call: enable_gprs() runs again after a PDP or radio recovery */
+		sprintf(define_PDP_context_cmd,"AT+CSTT=\"%s\",\"\",\"\"\r",APN); /* AT+CSTT="APN","","" */
 		
 		#ifdef DEBUG_MODE
 			send_debug("define PDP context: send AT+CSTT=\"APN\",\"\",\"\"");
@@ -445,6 +445,7 @@ uint8_t enable_gprs(){
 		#ifdef DEBUG_MODE
 		send_debug("Internet Connection: Ready");
 		#endif
+		link_state_invalidate(); /* READY or CONNECTED, the next user checks */
 		return SUCCESS;
 	}
 	else{ 
@@ -462,6 +463,112 @@ uint8_t enable_gprs(){
 
 
 
+uint8_t get_tcp_status(const char * cmd_reply){
+	if ( 
+		is_subarray_present((uint8_t*)cmd_reply,RX_BUFFER_LENGTH,(uint8_t*)"IP INITIAL",sizeof("IP INITIAL")-1)	||
+		is_subarray_present((uint8_t*)cmd_reply,RX_BUFFER_LENGTH,(uint8_t*)"IP START",sizeof("IP START")-1)	||
+		is_subarray_present((uint8_t*)cmd_reply,RX_BUFFER_LENGTH,(uint8_t*)"IP CONFIG",sizeof("IP CONFIG")-1) || 
+		is_subarray_present((uint8_t*)cmd_reply,RX_BUFFER_LENGTH,(uint8_t*)"IP GPRSACT",sizeof("IP GPRSACT")-1)	|| 
+		is_subarray_present((uint8_t*)cmd_reply,RX_BUFFER_LENGTH,(uint8_t*)"PDP DEACT",sizeof("PDP DEACT")-1)
+		)
+		return TCP_STATUS_GPRS_DOWN;
+	if ( 
+		is_subarray_present((uint8_t*)cmd_reply,RX_BUFFER_LENGTH,(uint8_t*)"TCP CONNECTING",sizeof("TCP CONNECTING")-1)	||
+		is_subarray_present((uint8_t*)cmd_reply,RX_BUFFER_LENGTH,(uint8_t*)"CONNECT OK",sizeof("CONNECT OK")-1)	||
+		is_subarray_present((uint8_t*)cmd_reply,RX_BUFFER_LENGTH,(uint8_t*)"ALREADY CONNECT",sizeof("ALREADY CONNECT")-1) 
+		)
+		return TCP_STATUS_CONNECTED;
+	return TCP_STATUS_READY;
+}
+
+
+/* Reads a decimal number and the separator that follows it */
+static uint8_t parse_number(const char * text, uint16_t * index, uint16_t length, uint32_t * value){
+	uint16_t start=*index;
+
+	*value=0;
+	while (*index < length && text[*index]>='0' && text[*index]<='9')
+		*value=*value*10+(text[(*index)++]-'0');
+	if (*index==start)
+		return FAIL;
+	(*index)++;
+	return SUCCESS;
+}
+
+
+uint8_t get_tcp_ack(const char * cmd_reply, uint32_t * acked, uint32_t * unacked){
+	static const char tag[]="+CIPACK: ";
+	uint32_t sent;
+	uint16_t i;
+
+	for(i=0; i+sizeof(tag)-1 < RX_BUFFER_LENGTH; i++){
+		if (memcmp(cmd_reply+i,tag,sizeof(tag)-1)==0)
+			break;
+	}
+	i+=sizeof(tag)-1;
+	if (i >= RX_BUFFER_LENGTH)
+		return FAIL;
+	if (!parse_number(cmd_reply,&i,RX_BUFFER_LENGTH,&sent) || !parse_number(cmd_reply,&i,RX_BUFFER_LENGTH,acked)
+			|| !parse_number(cmd_reply,&i,RX_BUFFER_LENGTH,unacked))
+		return FAIL;
+	return SUCCESS;
+}
+
+
+uint8_t get_dns_address(const char * cmd_reply, char * ip_address){
+	static const char tag[]="+CDNSGIP: 1,\"";
+	uint16_t i;
+	uint8_t length=0;
+
+	for(i=0; i+sizeof(tag)-1 < RX_BUFFER_LENGTH; i++){
+		if (memcmp(cmd_reply+i,tag,sizeof(tag)-1)==0)
+			break;
+	}
+	i+=sizeof(tag)-1;
+	/* The name, then the first address */
+	while (i < RX_BUFFER_LENGTH && cmd_reply[i]!='"')
+		i++;
+	i+=3;
+	if (i >= RX_BUFFER_LENGTH || cmd_reply[i-2]!=',' || cmd_reply[i-1]!='"')
+		return FAIL;
+	while (i < RX_BUFFER_LENGTH && ((cmd_reply[i]>='0' && cmd_reply[i]<='9') || cmd_reply[i]=='.')){
+		if (length==DNS_ADDRESS_LENGTH-1)
+			return FAIL;
+		ip_address[length++]=cmd_reply[i++];
+	}
+	if (i >= RX_BUFFER_LENGTH || cmd_reply[i]!='"' || length==0)
+		return FAIL;
+	ip_address[length]='\0';
+	return SUCCESS;
+}
+
+
+static uint8_t link_state=TCP_STATUS_UNKNOWN;
+static uint32_t link_state_time=0;
+
+uint8_t link_state_get(void){
+	uint8_t urcs=check_AT_urc(URC_CLOSED | URC_PDP_DEACT);
+
+	if (urcs & URC_PDP_DEACT)
+		link_state_set(TCP_STATUS_GPRS_DOWN);
+	else if ((urcs & URC_CLOSED) && link_state==TCP_STATUS_CONNECTED)
+		link_state_set(TCP_STATUS_READY);
+
+	if (HAL_GetTick()-link_state_time >= LINK_STATE_MAX_AGE)
+		link_state=TCP_STATUS_UNKNOWN;
+	return link_state;
+}
+
+void link_state_set(uint8_t tcp_status){
+	link_state=tcp_status;
+	link_state_time=HAL_GetTick();
+}
+
+void link_state_invalidate(void){
+	link_state=TCP_STATUS_UNKNOWN;
+}
+
+
 uint8_t open_tcp_connection(char * server_address, char * port){
 	static const char get_tcp_status_cmd[]="AT+CIPSTATUS\r";
 	char tcp_connect_cmd[128]= "AT+CIPSTART=\"TCP\",\"";
@@ -469,6 +576,7 @@ uint8_t open_tcp_connection(char * server_address, char * port){
 	static const char tcp_disconnect_cmd[]= "AT+CIPCLOSE\r";
 	
 	uint8_t tcp_ready=0;
+	uint8_t tcp_status;
 	
 	/* make sure to clear the buffer after every use */
 	char local_rx_buffer[RX_BUFFER_LENGTH]; 
@@ -487,35 +595,28 @@ uint8_t open_tcp_connection(char * server_address, char * port){
 		#endif
 	
 	
-	/*** Check TCP/GPRS Status ***/
+	/*** Check TCP/GPRS Status, AT+CIPSTATUS is only sent when the cached state is unknown ***/
+	tcp_status=link_state_get();
+	if (tcp_status==TCP_STATUS_UNKNOWN){
 		#ifdef DEBUG_MODE
 			send_debug("Check current TCP status: send AT+CIPSTATUS");
 		#endif
-	send_AT_cmd(get_tcp_status_cmd,"OK",TRUE,local_rx_buffer,RX_TIMEOUT);
+		send_AT_cmd(get_tcp_status_cmd,"OK",TRUE,local_rx_buffer,RX_TIMEOUT);
+		send_debug(local_rx_buffer);
+		tcp_status=get_tcp_status(local_rx_buffer);
+	}
 	
 	/* If the TCP/GPRS stack is not in usable status, then enable GPRS 
 	 * else if there is an open TCP connection then close it.
 	 */
-	 
-	 send_debug(local_rx_buffer);
-	if ( 
-		is_subarray_present((uint8_t*)local_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"IP INITIAL",sizeof("IP INITIAL")-1)	||
-		is_subarray_present((uint8_t*)local_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"IP START",sizeof("IP START")-1)	||
-		is_subarray_present((uint8_t*)local_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"IP CONFIG",sizeof("IP CONFIG")-1) || 
-		is_subarray_present((uint8_t*)local_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"IP GPRSACT",sizeof("IP GPRSACT")-1)	|| 
-		is_subarray_present((uint8_t*)local_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"PDP DEACT",sizeof("PDP DEACT")-1)
-		)			
+	if ( tcp_status==TCP_STATUS_GPRS_DOWN )
 	{	
 		#ifdef DEBUG_MODE
 		send_debug("TCP cannot begin because GPRS is not ready: call enable_gprs();");
 		#endif	
 		enable_gprs();
 	}
-	else if ( 
-		is_subarray_present((uint8_t*)local_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"TCP CONNECTING",sizeof("TCP CONNECTING")-1)	||
-		is_subarray_present((uint8_t*)local_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"CONNECT OK",sizeof("CONNECT OK")-1)	||
-		is_subarray_present((uint8_t*)local_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"ALREADY CONNECT",sizeof("ALREADY CONNECT")-1) 
-		)
+	else if ( tcp_status==TCP_STATUS_CONNECTED )
 	{
 		#ifdef DEBUG_MODE
 			send_debug("Open TCP connection detected, terminating it. send: AT+CIPCLOSE");
@@ -542,6 +643,7 @@ uint8_t open_tcp_connection(char * server_address, char * port){
 		#ifdef DEBUG_MODE
 			send_debug("Open TCP connection : OK");
 		#endif
+		link_state_set(TCP_STATUS_CONNECTED);
 		return SUCCESS;
 	}
 		else{
@@ -551,6 +653,7 @@ uint8_t open_tcp_connection(char * server_address, char * port){
 				send_debug(local_rx_buffer);	
 			#endif
 		}
+	link_state_invalidate();
 	/* check the reply, if CONNECT FAIL or ERROR is returned, it means the connection failed to establish. 
 	 * If TCP CONNECTING is returned, it means the module initiated TCP handshake but still waiting for handshake acknoledgement
 	 * usuallly it means the peer server is offline, so in this case, close the connection and exit */
@@ -583,15 +686,19 @@ uint8_t close_tcp_connection(){
 		#ifdef DEBUG_MODE
 			send_debug("Close TCP connection: send AT+CIPCLOSE");
 		#endif
-	if ((send_AT_cmd(tcp_disconnect_cmd,"CLOSE OK",FALSE,NULL,RX_TIMEOUT)) )
+	if ((send_AT_cmd(tcp_disconnect_cmd,"CLOSE OK",FALSE,NULL,RX_TIMEOUT)) ){
+		link_state_set(TCP_STATUS_READY);
 		return SUCCESS;
-	else 
+	}
+	else {
+		link_state_invalidate();
 		return FAIL;
+	}
 	
 }
 
 
-uint8_t send_tcp_data(uint8_t * data, uint8_t data_length){
+uint8_t send_tcp_data(uint8_t * data, uint16_t data_length){
 
 	static const char get_tcp_status_cmd[]="AT+CIPSTATUS\r";
 	char send_tcp_data_cmd[24]= "AT+CIPSEND=";
@@ -620,17 +727,87 @@ uint8_t send_tcp_data(uint8_t * data, uint8_t data_length){
 }
 
 
-uint8_t publish_mqtt_msg(char * ip_address, char *  tcp_port, char * topic, char * client_id, char * message){
-	
-	#ifdef DEBUG_MODE
-		send_debug("MQTT protocol: START");
-	#endif
-	
-	/*** Construct the Connect packet ***/
+void tx_buffer_clear(tx_buffer_typedef * tx){
+	tx->length=0;
+}
+
+
+uint8_t tx_buffer_append(tx_buffer_typedef * tx, const uint8_t * packet, uint16_t packet_length){
+	if (tx->length+packet_length > TX_BUFFER_LENGTH)
+		return FAIL;
+	memcpy(tx->data+tx->length,packet,packet_length);
+	tx->length+=packet_length;
+	return SUCCESS;
+}
+
+
+uint8_t tx_buffer_append_connect(tx_buffer_typedef * tx, const mqtt_connect_template_typedef * connect){
+	return tx_buffer_append(tx,(const uint8_t *)connect,MQTT_CONNECT_TEMPLATE_LENGTH(connect));
+}
+
+
+uint8_t tx_buffer_append_mqttsn_connect(tx_buffer_typedef * tx, const mqttsn_connect_template_typedef * connect){
+	return tx_buffer_append(tx,(const uint8_t *)connect,MQTTSN_CONNECT_TEMPLATE_LENGTH(connect));
+}
+
+
+/* The packets are built in place, in the free part of the buffer */
+uint8_t tx_buffer_append_publish(tx_buffer_typedef * tx, char * topic, uint16_t packet_id, const uint8_t * payload, uint16_t payload_length){
+	uint16_t length=build_mqtt_publish_packet(tx->data+tx->length,TX_BUFFER_LENGTH-tx->length,topic,packet_id,payload,payload_length);
+
+	if (length==0)
+		return FAIL;
+	tx->length+=length;
+	return SUCCESS;
+}
+
+
+/* Remaining length of the fixed header: 7 bits per byte, least significant first, bit 7 set when another byte
+ * follows. 127 fits one byte, 16383 two bytes.
+ */
+static uint8_t mqtt_encode_remaining_length(uint8_t * buffer, uint32_t remaining_length){
+	uint8_t count=0;
+	uint8_t digit;
+
+	do {
+		digit=remaining_length%128;
+		remaining_length/=128;
+		if (remaining_length > 0)
+			digit|=0x80;
+		buffer[count++]=digit;
+	} while (remaining_length > 0 && count < 4);
+	return count;
+}
+
+
+uint32_t mqtt_packet_length(uint32_t remaining_length){
+	uint32_t length=2; /* packet type and the first byte of the remaining length */
+
+	if (remaining_length > 127)
+		length++;
+	if (remaining_length > 16383)
+		length++;
+	if (remaining_length > 2097151)
+		length++;
+	return length+remaining_length;
+}
+
+
+uint32_t mqtt_publish_packet_length(const char * topic, uint16_t packet_id, uint16_t payload_length){
+	return mqtt_packet_length(2+strlen(topic)+(packet_id?2:0)+payload_length);
+}
+
+
+uint32_t mqtt_publish_template_length(const mqtt_topic_template_typedef * topic, uint16_t packet_id, uint16_t payload_length){
+	return mqtt_packet_length(2+topic->length[1]+(packet_id?2:0)+payload_length);
+}
+
+
+uint16_t build_mqtt_connect_packet(uint8_t * connect_packet, uint16_t size, char * client_id){
 
 	/* Connect Packet structure:  
 	 * 1 byte          : [Packet type] = 0x10
-	 * 1 byte          : [Remaining length] 
+	 * 1-4 bytes       : [Remaining length] 
 	 * 2 byte          : [Protocol name length] = 0x00, 0x04 (4 in decimal)
 	 * 4 byte          : [Protocol name] = 0x4d, 0x51, 0x54, 0x54 (MQTT is ASCII)
 	 * 1 byte          : [Protocol Version] = 0x04 (4 in decimal) 
@@ -640,119 +817,175 @@ uint8_t publish_mqtt_msg(char * ip_address, char *  tcp_port, char * topic, char
 	 * remaining bytes : [Client ID]
 	 */
 	
-	
-	uint16_t client_id_length = strlen(client_id);
-	uint8_t connect_packet_remaining_length = 12 + client_id_length;;
-	uint16_t keep_alive = MQTT_KEEP_ALIVE;
-		
-	uint8_t connect_packet[MAX_LENGTH_MQTT_PACKET]= {
-	0x10, // Packet type = CONNECT
-	0x10, // Remaining length = 16
+	static const uint8_t connect_variable_header[]= {
 	0x00, 0x04, // Protocol name length  
 	0x4d, 0x51, 0x54, 0x54, // Protocol name = MQTT
 	0x04, // Protocol Version 
 	0x02 // Connect flags
 	};
+	
+	uint16_t client_id_length = strlen(client_id);
+	uint32_t connect_packet_remaining_length = sizeof(connect_variable_header) + 2 + 2 + client_id_length;
+	uint32_t connect_packet_length = mqtt_packet_length(connect_packet_remaining_length);
+	uint16_t keep_alive = MQTT_KEEP_ALIVE;
+	uint16_t i;
 
+	/* Nothing is written when the packet does not fit */
+	if (connect_packet_length > size || connect_packet_length > MAX_LENGTH_MQTT_PACKET)
+		return 0;
 
+	connect_packet[0] = 0x10; // Packet type = CONNECT
+	i = 1 + mqtt_encode_remaining_length(connect_packet+1,connect_packet_remaining_length);
 
-	connect_packet[1]=connect_packet_remaining_length;
+	memcpy(connect_packet+i,connect_variable_header,sizeof(connect_variable_header));
+	i += sizeof(connect_variable_header);
 	
 	/* Insert Keep alive time most signinficant byte in the packet by shifting keep_alive 8 bits to the right and casting into uint8_t */
-	connect_packet[10]= (uint8_t) (keep_alive>>8);
+	connect_packet[i++]= (uint8_t) (keep_alive>>8);
 
 	/* Insert Keep alive time least significant byte in the packet by directly casting the uint16_t variable to uint8_t which will will clamp the left 8 bits */
-	connect_packet[11]= (uint8_t) keep_alive;
+	connect_packet[i++]= (uint8_t) keep_alive;
 
 	/* Insert client ID length into the packet with same way used for keep_alive */ 
-		connect_packet[12]= (uint8_t) (client_id_length>>8);
-		connect_packet[13]= (uint8_t) client_id_length;
+	connect_packet[i++]= (uint8_t) (client_id_length>>8);
+	connect_packet[i++]= (uint8_t) client_id_length;
 	
-	/* Copy the client ID char by char into the connect packet */
-	for(uint8_t i = 0; i< client_id_length ; i++)
-		connect_packet[14+i]=(uint8_t)client_id[i];
-
+	memcpy(connect_packet+i,client_id,client_id_length);
 
+	return i+client_id_length;
+}
 
 
-	/*** Construct the Publish Packet ***/
+uint16_t build_mqtt_publish_packet(uint8_t * publish_packet, uint16_t size, char * topic, uint16_t packet_id, const uint8_t * payload, uint16_t payload_length){
 
 	uint16_t topic_length = strlen(topic);
-	uint8_t publish_packet_remaining_length= 2 + topic_length + (uint8_t)strlen(message) ;
-	
+	uint32_t publish_packet_remaining_length = 2 + topic_length + (packet_id?2:0) + payload_length;
+	uint32_t publish_packet_length = mqtt_packet_length(publish_packet_remaining_length);
+	uint16_t i;
 
-	uint8_t publish_packet[MAX_LENGTH_MQTT_PACKET] ={
-		0x30, // Packet type = Publish + DUP+QOS+retain=0
-		0x1d, // Remaining length dummy example 0x1d = 29
-		0x00, 0x04 // Topic name length dummy example = 4
-	};
+	/* Nothing is written when the packet does not fit */
+	if (publish_packet_length > size || publish_packet_length > MAX_LENGTH_MQTT_PACKET)
+		return 0;
+
+	publish_packet[0] = packet_id?0x32:0x30; // Packet type = Publish, QoS 1 when there is a packet identifier, DUP+retain=0
 	
 	/*insert remaining length */
-	publish_packet[1] = publish_packet_remaining_length;
+	i = 1 + mqtt_encode_remaining_length(publish_packet+1,publish_packet_remaining_length);
 	
 	/* Insert topic name length into the packet with same way used for keep_alive */ 
-	publish_packet[2]= (uint8_t) (topic_length>>8);
-	publish_packet[3]= (uint8_t) topic_length;
+	publish_packet[i++]= (uint8_t) (topic_length>>8);
+	publish_packet[i++]= (uint8_t) topic_length;
 
+	memcpy(publish_packet+i,topic,topic_length);
+	i += topic_length;
 
-	/* Copy the topic  name char by char into the publish packet */
-	for(uint8_t i = 0; i< topic_length ; i++)
-		publish_packet[4+i]=(uint8_t)topic[i];
+	/* QoS 1: the packet identifier, echoed by the PUBACK of the server */
+	if (packet_id){
+		publish_packet[i++]= (uint8_t) (packet_id>>8);
+		publish_packet[i++]= (uint8_t) packet_id;
+	}
 
-	/* Copy the message   char by char into the publish packet */
-	for(uint8_t i = 0; i< strlen(message); i++)
-		publish_packet[4+topic_length+i]=(uint8_t)message[i];
-	
+	memcpy(publish_packet+i,payload,payload_length);
+
+	return i+payload_length;
+}
+
+
+uint16_t build_mqtt_publish_template(uint8_t * publish_packet, uint16_t size, const mqtt_topic_template_typedef * topic, uint16_t packet_id, const uint8_t * payload, uint16_t payload_length){
+	uint16_t topic_field_length = 2 + topic->length[1];
+	uint32_t publish_packet_remaining_length = topic_field_length + (packet_id?2:0) + payload_length;
+	uint32_t publish_packet_length = mqtt_packet_length(publish_packet_remaining_length);
+	uint16_t i;
+
+	/* Nothing is written when the packet does not fit */
+	if (publish_packet_length > size || publish_packet_length > MAX_LENGTH_MQTT_PACKET)
+		return 0;
+
+	publish_packet[0] = packet_id?0x32:0x30;
+	i = 1 + mqtt_encode_remaining_length(publish_packet+1,publish_packet_remaining_length);
+
+	/* Topic length and topic, copied from the template in one go */
+	memcpy(publish_packet+i,topic,topic_field_length);
+	i += topic_field_length;
 
+	if (packet_id){
+		publish_packet[i++]= (uint8_t) (packet_id>>8);
+		publish_packet[i++]= (uint8_t) packet_id;
+	}
+
+	memcpy(publish_packet+i,payload,payload_length);
+
+	return i+payload_length;
+}
+
+
+uint16_t build_mqttsn_publish_packet(uint8_t * publish_packet, uint16_t size, uint16_t topic_id, uint16_t msg_id, const uint8_t * payload, uint16_t payload_length){
+
+	/* PUBLISH message structure:
+	 * 1 byte          : [Length] of the whole message
+	 * 1 byte          : [Message type] = 0x0C
+	 * 1 byte          : [Flags] DUP, QoS (3 for -1), retain, will, clean session, topic identifier type
+	 * 2 bytes         : [Topic identifier]
+	 * 2 bytes         : [Message identifier] 0 for QoS 0 and -1
+	 * remaining bytes : [Data]
+	 */
+	uint16_t length = MQTTSN_PUBLISH_HEADER_LENGTH + payload_length;
+
+	/* Nothing is written when the message does not fit */
+	if (length > size || length > MQTTSN_MAX_LENGTH)
+		return 0;
+	#if MQTTSN_QOS < 1
+	msg_id = 0;
+	#endif
+
+	publish_packet[0] = (uint8_t) length;
+	publish_packet[1] = MQTTSN_PUBLISH;
+	publish_packet[2] = ((MQTTSN_QOS < 0)?0x60:(MQTTSN_QOS<<5)) | MQTTSN_FLAG_TOPIC_PREDEFINED;
+	publish_packet[3] = (uint8_t) (topic_id>>8);
+	publish_packet[4] = (uint8_t) topic_id;
+	publish_packet[5] = (uint8_t) (msg_id>>8);
+	publish_packet[6] = (uint8_t) msg_id;
+	memcpy(publish_packet+MQTTSN_PUBLISH_HEADER_LENGTH,payload,payload_length);
+
+	return length;
+}
+
+
+uint8_t publish_mqtt_msg(char * ip_address, char *  tcp_port, char * topic, char * client_id, char * message){
 	
-/*** Construct Disconnect Packet ***/
+	#ifdef DEBUG_MODE
+		send_debug("MQTT protocol: START");
+	#endif
 	
-	uint8_t disconnect_packet[] = {
+	/*** Construct the CONNECT, PUBLISH and DISCONNECT packets one after the other ***/
+	tx_buffer_typedef tx;
+	static const uint8_t disconnect_packet[] = {
 		0xe0, // Packet type = DISCONNECT
 		0x00 // Remaining length = 0
 	};	
 
-	
+	/* The client ID and the topic are given at run time: no template */
+	tx.length=build_mqtt_connect_packet(tx.data,TX_BUFFER_LENGTH,client_id);
+	if (tx.length==0 || !tx_buffer_append_publish(&tx,topic,0,(uint8_t*)message,strlen(message)) || !tx_buffer_append(&tx,disconnect_packet,sizeof(disconnect_packet)))
+		return FAIL;
 	
 	#ifdef DEBUG_MODE
-		send_debug("***CONNECT packet content:***");
-		send_raw_debug(connect_packet,14+client_id_length);	
-		send_debug("***PUBLISH packet content:***");
-		send_raw_debug(publish_packet,publish_packet_remaining_length+2);
-	#endif
-	
-		#ifdef DEBUG_MODE
-	//	send_debug("PUBLLISH packet content:");
-	//	send_debug(publish_packet);
-	#endif
-	
-		#ifdef DEBUG_MODE
-	//	send_debug("DISCONNECT packet content:");
-		//send_debug(disconnect_packet);
+		send_debug("***CONNECT, PUBLISH and DISCONNECT packets content:***");
+		send_raw_debug(tx.data,tx.length);
 	#endif
 	
 	/*** Sending Data ***/
 		if (open_tcp_connection(ip_address,tcp_port)){
 			
-			//send_tcp_data((uint8_t *)"hello",5);
-			#ifdef DEBUG_MODE
-				send_debug("Sending MQTT CONNECT Packet");
-			#endif
-			send_tcp_data(connect_packet,2+connect_packet_remaining_length);
-
-			#ifdef DEBUG_MODE
-				send_debug("Sending MQTT PUBLISH Packet");
-			#endif
-				send_tcp_data(publish_packet,2+publish_packet_remaining_length);
-			//send_tcp_data((uint8_t *)"hello",5);
+			/* One AT+CIPSEND for the three packets instead of one each */
 			#ifdef DEBUG_MODE
-				send_debug("Sending MQTT DISCONNECT Packet");
+				send_debug("Sending MQTT CONNECT, PUBLISH and DISCONNECT Packets");
 			#endif
-			send_tcp_data(disconnect_packet,2);
+			send_tcp_data(tx.data,tx.length);
 			
 			close_tcp_connection();
 			return SUCCESS;
 		}
 			
 	return FAIL;
-}
+}
\ No newline at end of file
@@ -0,0 +1,158 @@
+/**
+*	@file position.c
+*	@brief Binary encoding of the GPS fixes.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+
+#include "sim808.h"
+#include "position.h"
+
+
+static uint8_t * put_le(uint8_t * data, uint32_t value, uint8_t length){
+	for(uint8_t i=0; i<length; i++){
+		*data++=value&0xFF;
+		value>>=8;
+	}
+	return data;
+}
+
+/* The difference is computed modulo 2^32, so that it survives a field wrapping around */
+static uint8_t * put_delta(uint8_t * data, uint32_t value, uint32_t previous){
+	int32_t delta=(int32_t)(value-previous);
+	uint32_t zigzag=((uint32_t)delta<<1)^(uint32_t)(delta>>31);
+
+	while (zigzag >= 0x80){
+		*data++=(zigzag&0x7F)|0x80;
+		zigzag>>=7;
+	}
+	*data++=zigzag;
+	return data;
+}
+
+static uint32_t get_le(const uint8_t * data, uint8_t length){
+	uint32_t value=0;
+
+	while (length-- > 0)
+		value=(value<<8)|data[length];
+	return value;
+}
+
+/* Returns the value plus the decoded difference, FAIL in *valid if the varint is truncated */
+static uint32_t get_delta(const uint8_t * data, uint16_t length, uint16_t * offset, uint32_t previous, uint8_t * valid){
+	uint32_t zigzag=0;
+	uint8_t shift=0;
+	uint8_t byte;
+
+	do {
+		if (*offset >= length || shift > 28){
+			*valid=FAIL;
+			return previous;
+		}
+		byte=data[(*offset)++];
+		zigzag|=(uint32_t)(byte&0x7F)<<shift;
+		shift+=7;
+	} while (byte&0x80);
+	return previous+((zigzag>>1)^(0-(zigzag&1)));
+}
+
+static uint8_t encode_record(uint8_t * data, const position_typedef * position){
+	uint8_t * end=data;
+
+	end=put_le(end,position->time,4);
+	end=put_le(end,(uint32_t)position->latitude,4);
+	end=put_le(end,(uint32_t)position->longitude,4);
+	end=put_le(end,(uint16_t)position->altitude,2);
+	end=put_le(end,position->speed,2);
+	end=put_le(end,position->course,2);
+	end=put_le(end,position->satellites,1);
+	end=put_le(end,position->flags,1);
+	return end-data;
+}
+
+/* The signed fields are widened before the difference, a change from 32767 to -32768 is not a step of 1 */
+static uint8_t encode_delta(uint8_t * data, const position_typedef * position, const position_typedef * previous){
+	uint8_t * end=data;
+
+	end=put_delta(end,position->time,previous->time);
+	end=put_delta(end,(uint32_t)position->latitude,(uint32_t)previous->latitude);
+	end=put_delta(end,(uint32_t)position->longitude,(uint32_t)previous->longitude);
+	end=put_delta(end,(uint32_t)(int32_t)position->altitude,(uint32_t)(int32_t)previous->altitude);
+	end=put_delta(end,position->speed,previous->speed);
+	end=put_delta(end,position->course,previous->course);
+	end=put_delta(end,position->satellites,previous->satellites);
+	end=put_delta(end,position->flags,previous->flags);
+	return end-data;
+}
+
+
+void position_batch_clear(position_batch_typedef * batch){
+	batch->data[0]=POSITION_FORMAT_VERSION;
+	batch->length=1;
+	batch->count=0;
+}
+
+
+uint8_t position_batch_add(position_batch_typedef * batch, const position_typedef * position){
+	uint8_t record[POSITION_DELTA_MAX_LENGTH];
+	uint8_t length;
+
+	if (batch->count==0)
+		length=encode_record(record,position);
+	else
+		length=encode_delta(record,position,&batch->previous);
+	if (batch->length+length > POSITION_BATCH_LENGTH)
+		return FAIL;
+	memcpy(batch->data+batch->length,record,length);
+	batch->length+=length;
+	batch->count++;
+	batch->previous=*position;
+	return SUCCESS;
+}
+
+
+uint8_t position_batch_next(const uint8_t * data, uint16_t length, uint16_t * offset, position_typedef * position){
+	uint8_t valid=SUCCESS;
+
+	if (length==0 || data[0]!=POSITION_FORMAT_VERSION || *offset >= length)
+		return FAIL;
+	if (*offset==1){
+		if (length < 1+POSITION_RECORD_LENGTH)
+			return FAIL;
+		data+=1;
+		position->time=get_le(data,4);
+		position->latitude=(int32_t)get_le(data+4,4);
+		position->longitude=(int32_t)get_le(data+8,4);
+		position->altitude=(int16_t)get_le(data+12,2);
+		position->speed=get_le(data+14,2);
+		position->course=get_le(data+16,2);
+		position->satellites=data[18];
+		position->flags=data[19];
+		*offset+=POSITION_RECORD_LENGTH;
+		return SUCCESS;
+	}
+	position->time=get_delta(data,length,offset,position->time,&valid);
+	position->latitude=(int32_t)get_delta(data,length,offset,(uint32_t)position->latitude,&valid);
+	position->longitude=(int32_t)get_delta(data,length,offset,(uint32_t)position->longitude,&valid);
+	position->altitude=(int16_t)get_delta(data,length,offset,(uint32_t)(int32_t)position->altitude,&valid);
+	position->speed=get_delta(data,length,offset,position->speed,&valid);
+	position->course=get_delta(data,length,offset,position->course,&valid);
+	position->satellites=get_delta(data,length,offset,position->satellites,&valid);
+	position->flags=get_delta(data,length,offset,position->flags,&valid);
+	return valid;
+}
+
+
+uint32_t position_utc_seconds(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second){
+	static const uint16_t days_before_month[12]={0,31,59,90,120,151,181,212,243,273,304,334};
+	uint32_t days;
+
+	if (year < 2000 || month < 1 || month > 12 || day < 1)
+		return 0;
+	/* Every fourth year is a leap year from 2000 to 2099 */
+	days=(uint32_t)(year-2000)*365+(year-2000+3)/4+days_before_month[month-1]+day-1;
+	if (month > 2 && year%4==0)
+		days++;
+	return ((days*24+hour)*60+minute)*60+second;
+}
@@ -0,0 +1,266 @@
+/**
+*	@file power.c
+*	@brief Idle manager implementation: STOP mode with RTC alarm and USART1 wake-up.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+#include <stdio.h>
+
+#include "sim808.h"
+#include "clock.h"
+#include "power.h"
+
+extern UART_HandleTypeDef huart1;
+
+#define RTC_TICKS_PER_S_NOMINAL (RTC_PREDIV_S+1)
+#define RTC_DAY_TICKS (86400UL*RTC_TICKS_PER_S_NOMINAL)
+#define LSI_MEASURE_MS 250
+#define MAX_STOP_MS 60000
+
+static uint8_t stop_available=FALSE;
+static uint32_t rtc_ticks_per_s=RTC_TICKS_PER_S_NOMINAL; /* measured RTC ticks per real second */
+static volatile uint8_t alarm_fired=0;
+
+/* Measurement window, see power_report() */
+static uint32_t window_start=0;
+static uint64_t sleep_cycles=0;
+static uint32_t stop_ms=0;
+static uint32_t stop_count=0;
+static uint32_t usart_wakeups=0;
+static uint32_t latency_sum_us=0;
+static uint32_t latency_max_us=0;
+static uint32_t latency_count=0;
+
+
+static uint8_t bcd(uint8_t value){
+	return (uint8_t)(((value/10)<<4) | (value%10));
+}
+
+static uint8_t from_bcd(uint8_t value){
+	return (uint8_t)((value>>4)*10 + (value & 0x0F));
+}
+
+static void rtc_unlock(void){
+	RTC->WPR=0xCA;
+	RTC->WPR=0x53;
+}
+
+static void rtc_lock(void){
+	RTC->WPR=0xFF;
+}
+
+/**
+ * @brief reads the RTC time of day in RTC ticks (1/(RTC_PREDIV_S+1) s).
+ * The shadow registers are not updated in STOP mode, so they are resynchronized before every read.
+ */
+static uint32_t rtc_read(void){
+	uint32_t ssr,tr,seconds;
+
+	rtc_unlock();
+	RTC->ISR&=~RTC_ISR_RSF;
+	rtc_lock();
+	while(!(RTC->ISR & RTC_ISR_RSF));
+
+	/* Reading SSR locks TR and DR until DR is read */
+	ssr=RTC->SSR;
+	tr=RTC->TR;
+	(void)RTC->DR;
+
+	seconds=from_bcd((tr>>16) & 0x3F)*3600UL + from_bcd((tr>>8) & 0x7F)*60UL + from_bcd(tr & 0x7F);
+	return seconds*RTC_TICKS_PER_S_NOMINAL + (RTC_PREDIV_S-ssr);
+}
+
+static uint32_t rtc_elapsed(uint32_t from, uint32_t to){
+	return (to+RTC_DAY_TICKS-from)%RTC_DAY_TICKS;
+}
+
+static void rtc_set_alarm(uint32_t target){
+	uint32_t seconds=target/RTC_TICKS_PER_S_NOMINAL;
+	uint32_t sub_seconds=RTC_PREDIV_S-(target%RTC_TICKS_PER_S_NOMINAL);
+
+	alarm_fired=0;
+	rtc_unlock();
+	RTC->CR&=~RTC_CR_ALRAE;
+	while(!(RTC->ISR & RTC_ISR_ALRAWF));
+
+	/* Match hours, minutes, seconds and the 12 bits of the sub-seconds, ignore the date */
+	RTC->ALRMAR=RTC_ALRMAR_MSK4 |
+		((uint32_t)bcd(seconds/3600)<<16) |
+		((uint32_t)bcd((seconds/60)%60)<<8) |
+		(uint32_t)bcd(seconds%60);
+	RTC->ALRMASSR=(12UL<<RTC_ALRMASSR_MASKSS_Pos) | sub_seconds;
+
+	RTC->ISR=~(RTC_ISR_ALRAF | RTC_ISR_INIT) | (RTC->ISR & RTC_ISR_INIT);
+	RTC->CR|=RTC_CR_ALRAIE | RTC_CR_ALRAE;
+	rtc_lock();
+}
+
+static void rtc_disable_alarm(void){
+	rtc_unlock();
+	RTC->CR&=~(RTC_CR_ALRAIE | RTC_CR_ALRAE);
+	rtc_lock();
+}
+
+
+void power_rtc_alarm_callback(void){
+	if (RTC->ISR & RTC_ISR_ALRAF){
+		RTC->ISR=~(RTC_ISR_ALRAF | RTC_ISR_INIT) | (RTC->ISR & RTC_ISR_INIT);
+		alarm_fired=1;
+	}
+	EXTI->PR=EXTI_PR_PR17;
+}
+
+
+uint8_t power_init(void){
+	RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+	RCC_PeriphCLKInitTypeDef PeriphClkInit = {0};
+	uint32_t start,rtc_start,rtc_end;
+	char debug_msg[48];
+
+	window_start=HAL_GetTick();
+
+	/* LSI and RTC clock, the RTC is in the backup domain */
+	HAL_PWR_EnableBkUpAccess();
+	RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_LSI;
+	RCC_OscInitStruct.LSIState = RCC_LSI_ON;
+	RCC_OscInitStruct.PLL.PLLState = RCC_PLL_NONE;
+	if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+		return FAIL;
+
+	PeriphClkInit.PeriphClockSelection = RCC_PERIPHCLK_RTC;
+	PeriphClkInit.RTCClockSelection = RCC_RTCCLKSOURCE_LSI;
+	if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInit) != HAL_OK)
+		return FAIL;
+	__HAL_RCC_RTC_ENABLE();
+
+	/* RTC prescalers and time = 00:00:00, only the time of day is used */
+	rtc_unlock();
+	RTC->ISR|=RTC_ISR_INIT;
+	while(!(RTC->ISR & RTC_ISR_INITF));
+	RTC->PRER=RTC_PREDIV_S;
+	RTC->PRER|=(uint32_t)RTC_PREDIV_A<<16;
+	RTC->TR=0;
+	RTC->CR&=~RTC_CR_FMT;
+	RTC->ISR&=~RTC_ISR_INIT;
+	rtc_lock();
+
+	/* Measure the LSI against the HSE: count RTC ticks during LSI_MEASURE_MS of HAL tick */
+	start=HAL_GetTick();
+	while(HAL_GetTick()==start);
+	start=HAL_GetTick();
+	rtc_start=rtc_read();
+	while(HAL_GetTick()-start < LSI_MEASURE_MS);
+	rtc_end=rtc_read();
+	rtc_ticks_per_s=rtc_elapsed(rtc_start,rtc_end)*(1000/LSI_MEASURE_MS);
+	if (rtc_ticks_per_s==0)
+		return FAIL;
+
+	#ifdef DEBUG_MODE
+	sprintf(debug_msg,"Power: RTC runs at %lu ticks/s",(unsigned long)rtc_ticks_per_s);
+	send_debug(debug_msg);
+	#endif
+
+	/* RTC alarm interrupt through EXTI line 17 */
+	EXTI->IMR|=EXTI_IMR_MR17;
+	EXTI->RTSR|=EXTI_RTSR_TR17;
+	HAL_NVIC_SetPriority(RTC_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(RTC_IRQn);
+
+	/* USART1 keeps receiving in STOP mode (clocked by the HSI) and its receive interrupt wakes the MCU up */
+	if (HAL_UARTEx_EnableStopMode(&huart1) != HAL_OK)
+		return FAIL;
+
+	stop_available=TRUE;
+	return SUCCESS;
+}
+
+
+void power_idle(uint32_t sleep_ms){
+	uint32_t load,before,after;
+	uint32_t rtc_start,rtc_target,rtc_now,ticks,slept_ms,latency_us;
+
+	if (!stop_available || sleep_ms < STOP_MIN_SLEEP_MS){
+		/* Sleep mode until the next interrupt, SysTick wakes the core up every ms.
+		 * The time asleep is counted in SysTick cycles, SysTick counts down.
+		 */
+		load=SysTick->LOAD+1;
+		before=SysTick->VAL;
+		__WFI();
+		after=SysTick->VAL;
+		sleep_cycles+=(before>=after)?(before-after):(before+load-after);
+		return;
+	}
+
+	if (sleep_ms > MAX_STOP_MS)
+		sleep_ms=MAX_STOP_MS;
+	ticks=(uint32_t)(((uint64_t)sleep_ms*rtc_ticks_per_s)/1000);
+
+	rtc_start=rtc_read();
+	rtc_target=(rtc_start+ticks)%RTC_DAY_TICKS;
+	rtc_set_alarm(rtc_target);
+
+	/* The alarm must not be in the past, otherwise only USART1 could wake the MCU up */
+	if (rtc_elapsed(rtc_start,rtc_read()) >= ticks){
+		rtc_disable_alarm();
+		return;
+	}
+
+	HAL_SuspendTick();
+	HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+
+	/* The MCU wakes up on the HSI: restart the HSE and restore the clock setting */
+	clock_restore();
+	rtc_now=rtc_read();
+	rtc_disable_alarm();
+
+	/* SysTick did not count in STOP mode: add the time read from the RTC to the HAL tick */
+	slept_ms=(uint32_t)(((uint64_t)rtc_elapsed(rtc_start,rtc_now)*1000)/rtc_ticks_per_s);
+	uwTick+=slept_ms;
+	HAL_ResumeTick();
+
+	stop_ms+=slept_ms;
+	stop_count++;
+	if (alarm_fired){
+		/* Time from the alarm to the restored system clock, 1/rtc_ticks_per_s resolution (~250 us) */
+		latency_us=(uint32_t)(((uint64_t)rtc_elapsed(rtc_target,rtc_now)*1000000)/rtc_ticks_per_s);
+		if (latency_us > 1000000)
+			latency_us=0; /* the RTC was read just before the alarm time */
+		latency_sum_us+=latency_us;
+		latency_count++;
+		if (latency_us > latency_max_us)
+			latency_max_us=latency_us;
+	}
+	else
+		usart_wakeups++;
+}
+
+
+void power_report(void){
+	char debug_msg[96];
+	uint32_t total_ms=HAL_GetTick()-window_start;
+	uint32_t sleep_ms=(uint32_t)(sleep_cycles/(SystemCoreClock/1000));
+	uint32_t run_ms;
+	uint32_t average_ua;
+
+	if (total_ms==0)
+		return;
+	run_ms=(total_ms > sleep_ms+stop_ms)?(total_ms-sleep_ms-stop_ms):0;
+	average_ua=(uint32_t)(((uint64_t)run_ms*IDD_RUN_UA + (uint64_t)sleep_ms*IDD_SLEEP_UA + (uint64_t)stop_ms*IDD_STOP_UA)/total_ms);
+
+	sprintf(debug_msg,"Power: run %lu ms, sleep %lu ms, stop %lu ms in %lu stops (%lu USART wake-ups)",
+		(unsigned long)run_ms,(unsigned long)sleep_ms,(unsigned long)stop_ms,(unsigned long)stop_count,(unsigned long)usart_wakeups);
+	send_debug(debug_msg);
+	sprintf(debug_msg,"Power: wake-up latency avg %lu us max %lu us, estimated MCU current %lu uA",
+		(unsigned long)(latency_count?latency_sum_us/latency_count:0),(unsigned long)latency_max_us,(unsigned long)average_ua);
+	send_debug(debug_msg);
+
+	window_start=HAL_GetTick();
+	sleep_cycles=0;
+	stop_ms=0;
+	stop_count=0;
+	usart_wakeups=0;
+	latency_sum_us=0;
+	latency_max_us=0;
+	latency_count=0;
+}
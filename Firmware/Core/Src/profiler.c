@@ -0,0 +1,111 @@
+/**
+*	@file profiler.c
+*	@brief On-target profiler implementation.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+#include <stdio.h>
+
+#include "sim808.h"
+#include "profiler.h"
+
+extern UART_HandleTypeDef huart2;
+
+TIM_HandleTypeDef htim_profiler;
+
+/* Must follow the order of profile_zone_typedef */
+static const char * const zone_names[PROFILE_ZONE_COUNT]={
+	"aes128_encrypt",
+	"parse_gps_location",
+	"gps_task_query",
+	"send_AT_cmd",
+	"uplink_publish",
+	"uart_rx_isr"
+};
+
+typedef struct {
+	uint32_t start;
+	uint32_t calls;
+	uint32_t total_us;
+	uint32_t max_us;
+} profile_zone_stats_typedef;
+
+static profile_zone_stats_typedef zones[PROFILE_ZONE_COUNT];
+static uint8_t debug_rx_byte;
+static volatile uint8_t dump_requested=0;
+
+
+void profiler_init(void){
+
+	/* The timer clock is PCLK1 when the APB prescaler is 1, 2*PCLK1 otherwise */
+	uint32_t timer_clock=HAL_RCC_GetPCLK1Freq();
+	if ((RCC->CFGR & RCC_CFGR_PPRE) != RCC_HCLK_DIV1)
+		timer_clock*=2;
+
+	/* The timer is not configured in tracker.ioc, it has no MSP init */
+	PROFILER_TIM_CLK_ENABLE();
+
+	htim_profiler.Instance = PROFILER_TIM;
+	htim_profiler.Init.Prescaler = timer_clock/1000000 - 1;
+	htim_profiler.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim_profiler.Init.Period = 0xFFFFFFFF;
+	htim_profiler.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim_profiler.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+	if (HAL_TIM_Base_Init(&htim_profiler) != HAL_OK){
+		Error_Handler();
+	}
+	HAL_TIM_Base_Start(&htim_profiler);
+
+	/* Receive the dump command on the debug UART */
+	HAL_UART_Receive_IT(&huart2,&debug_rx_byte,1);
+}
+
+
+void profiler_begin(profile_zone_typedef zone){
+	zones[zone].start=PROFILER_TIM->CNT;
+}
+
+
+void profiler_end(profile_zone_typedef zone){
+	/* Unsigned subtraction handles the wrap around of the counter */
+	uint32_t elapsed=PROFILER_TIM->CNT - zones[zone].start;
+
+	zones[zone].calls++;
+	zones[zone].total_us+=elapsed;
+	if (elapsed > zones[zone].max_us)
+		zones[zone].max_us=elapsed;
+}
+
+
+void profiler_dump(void){
+	char line[96];
+
+	send_debug("Profiler zones: calls, total us, average us, max us");
+	for(uint8_t i=0; i<PROFILE_ZONE_COUNT; i++){
+		sprintf(line,"%-20s %8lu %10lu %8lu %8lu",
+			zone_names[i],
+			(unsigned long)zones[i].calls,
+			(unsigned long)zones[i].total_us,
+			(unsigned long)(zones[i].calls ? zones[i].total_us/zones[i].calls : 0),
+			(unsigned long)zones[i].max_us);
+		send_debug(line);
+	}
+}
+
+
+void profiler_debug_rx_callback(void){
+	if (debug_rx_byte==PROFILER_DUMP_CMD)
+		dump_requested=1;
+
+	/* Enable UART receive interrupt again*/
+	HAL_UART_Receive_IT(&huart2,&debug_rx_byte,1);
+}
+
+
+void profiler_poll(void){
+	if (dump_requested){
+		dump_requested=0;
+		profiler_dump();
+	}
+}
@@ -0,0 +1,143 @@
+/**
+*	@file recovery.c
+*	@brief Recovery ladder and independent watchdog implementation.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+#include <stdio.h>
+
+#include "sim808.h"
+#include "gps.h"
+#include "network_functions.h"
+#include "clock.h"
+#include "gprs.h"
+#include "recovery.h"
+
+/* Cheapest step able to fix each failure class, indexed by FAILURE_xxx */
+static const uint8_t failure_min_step[]={
+	RECOVERY_SOCKET, /* unused */
+	RECOVERY_SOCKET,
+	RECOVERY_PDP,
+	RECOVERY_RADIO
+};
+
+static const char * const step_names[]={
+	"none",
+	"reopen socket",
+	"PDP re-activation",
+	"radio reset",
+	"module power cycle",
+	"system reset"
+};
+
+static uint8_t consecutive_failures=0;
+
+
+uint8_t recovery_report_failure(uint8_t failure){
+	uint8_t step=RECOVERY_SOCKET;
+
+	if (consecutive_failures < 0xFF)
+		consecutive_failures++;
+
+	if (consecutive_failures >= RECOVERY_SYSTEM_RESET_FAILURES)
+		step=RECOVERY_SYSTEM_RESET;
+	else if (consecutive_failures >= RECOVERY_POWER_CYCLE_FAILURES)
+		step=RECOVERY_POWER_CYCLE;
+	else if (consecutive_failures >= RECOVERY_RADIO_FAILURES)
+		step=RECOVERY_RADIO;
+	else if (consecutive_failures >= RECOVERY_PDP_FAILURES)
+		step=RECOVERY_PDP;
+
+	if (failure < sizeof(failure_min_step) && failure_min_step[failure] > step)
+		step=failure_min_step[failure];
+	return step;
+}
+
+
+void recovery_report_success(void){
+	consecutive_failures=0;
+}
+
+
+static uint8_t recovery_step(SIM808_typedef * sim, uint8_t step){
+	static const char pdp_shutdown_cmd[]= "AT+CIPSHUT\r";
+	static const char radio_off_cmd[]= "AT+CFUN=0\r";
+	static const char radio_on_cmd[]= "AT+CFUN=1\r";
+	char debug_msg[64];
+
+	sprintf(debug_msg,"Recovery: %s after %u failures",step_names[step],consecutive_failures);
+	send_debug(debug_msg);
+
+	switch(step){
+
+	case RECOVERY_SOCKET:
+		/* The uplink closed the connection already */
+		return SUCCESS;
+
+	case RECOVERY_PDP:
+		/* AT+CIPSHUT brings the GPRS state back to IP INITIAL, the GPRS task then defines and activates the context */
+		if (!send_AT_cmd(pdp_shutdown_cmd,"SHUT OK",0,NULL,5*RX_TIMEOUT))
+			return recovery_step(sim,RECOVERY_RADIO);
+		gprs_restart();
+		return SUCCESS;
+
+	case RECOVERY_RADIO:
+		/* A module that does not answer AT cannot reset its radio */
+		if (!send_AT_cmd("AT\r","OK",0,NULL,RX_TIMEOUT))
+			return recovery_step(sim,RECOVERY_POWER_CYCLE);
+		send_AT_cmd(radio_off_cmd,"OK",0,NULL,10*RX_TIMEOUT);
+		if (!send_AT_cmd(radio_on_cmd,"OK",0,NULL,10*RX_TIMEOUT))
+			return recovery_step(sim,RECOVERY_POWER_CYCLE);
+		gprs_restart();
+		return SUCCESS;
+
+	case RECOVERY_POWER_CYCLE:
+		watchdog_refresh();
+		sim_power_off(sim);
+		watchdog_refresh();
+		if (sim_init(sim)==FAIL)
+			system_reset(sim);
+		watchdog_refresh();
+		enable_gps();
+		gprs_restart();
+		return SUCCESS;
+
+	default:
+		system_reset(sim);
+	}
+	return FAIL;
+}
+
+
+uint8_t recovery_run(SIM808_typedef * sim, uint8_t step){
+	clock_mode_typedef previous_mode=clock_get();
+	uint8_t result;
+
+	/* The steps mostly wait for the module: run them at the lowest clock */
+	clock_set(CLOCK_MODE_LOW);
+	result=recovery_step(sim,step);
+	clock_set(previous_mode);
+	return result;
+}
+
+
+void watchdog_start(void){
+	/* Report a reset caused by the watchdog, then clear the reset flags */
+	if (RCC->CSR & RCC_CSR_IWDGRSTF)
+		send_debug("Recovery: the last reset was caused by the watchdog");
+	RCC->CSR|=RCC_CSR_RMVF;
+
+	/* Starting the watchdog also starts the LSI */
+	IWDG->KR=0xCCCC;
+	IWDG->KR=0x5555;
+	IWDG->PR=WATCHDOG_PRESCALER;
+	IWDG->RLR=WATCHDOG_RELOAD;
+	while(IWDG->SR);
+	watchdog_refresh();
+}
+
+
+void watchdog_refresh(void){
+	IWDG->KR=0xAAAA;
+}
@@ -0,0 +1,82 @@
+/**
+*	@file scheduler.c
+*	@brief Cooperative scheduler implementation.
+*
+*	@author Mohamed Boubaker
+*/
+#include <stddef.h>
+
+#include "main.h"
+#include "scheduler.h"
+
+static volatile uint32_t pending_events=0;
+
+
+void scheduler_post_event(uint32_t events){
+	__disable_irq();
+	pending_events|=events;
+	__enable_irq();
+}
+
+
+void scheduler_run(task_typedef * tasks, uint8_t task_count, void (*idle)(uint32_t sleep_ms)){
+
+	uint32_t events,now,start,elapsed,delay,sleep_ms;
+	int32_t until_wake;
+	uint8_t task_ran;
+
+	for(uint8_t i=0; i<task_count; i++){
+		tasks[i].wake_at=HAL_GetTick();
+		tasks[i].max_run_ms=0;
+	}
+
+	while(1){
+
+		/* Take the events posted since the last pass */
+		__disable_irq();
+		events=pending_events;
+		pending_events=0;
+		__enable_irq();
+
+		task_ran=0;
+		for(uint8_t i=0; i<task_count; i++){
+			now=HAL_GetTick();
+
+			/* Signed difference handles the wrap around of the tick counter */
+			if ( (tasks[i].events & events) || (int32_t)(now - tasks[i].wake_at) >= 0 ){
+				start=now;
+				delay=tasks[i].run();
+				now=HAL_GetTick();
+
+				elapsed=now-start;
+				if (elapsed > tasks[i].max_run_ms)
+					tasks[i].max_run_ms=elapsed;
+
+				tasks[i].wake_at=now+delay;
+				task_ran=1;
+			}
+		}
+
+		if (task_ran || pending_events!=0)
+			continue;
+
+		/* Nothing to do until the earliest wake-up time */
+		now=HAL_GetTick();
+		sleep_ms=0xFFFFFFFF;
+		for(uint8_t i=0; i<task_count; i++){
+			until_wake=(int32_t)(tasks[i].wake_at - now);
+			if (until_wake <= 0){
+				sleep_ms=0;
+				break;
+			}
+			if ((uint32_t)until_wake < sleep_ms)
+				sleep_ms=until_wake;
+		}
+
+		/* Without an idle hook, sleep until the next interrupt. SysTick wakes the core up every ms */
+		if (idle!=NULL)
+			idle(sleep_ms);
+		else
+			__WFI();
+	}
+}
@@ -7,6 +7,9 @@
 #include <string.h>
 #include <stdio.h>
 #include "sim808.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "recovery.h"
 
 
 UART_HandleTypeDef huart1; 
@@ -19,17 +22,206 @@ static volatile uint8_t rx_byte; /* The receive interupt routine uses rx_byte to
 static volatile uint8_t rx_index=0; /*track the number of received bytes.*/
 static volatile char sim_rx_buffer[RX_BUFFER_LENGTH];
 
+/* Start time of the pending asynchronous AT command, see send_AT_cmd_async() */
+static uint32_t async_cmd_start=0;
+
+/* Unsolicited result codes seen in the receive buffer and not yet taken by check_AT_urc() */
+static uint8_t urc_flags=0;
+
+/* TCP data received from the server. With AT+CIPHEAD=1 the module prefixes it with "+IPD,<length>:", it is moved
+ * here from the receive buffer before the buffer is cleared, and read with read_tcp_data().
+ */
+static uint8_t tcp_rx_fifo[TCP_RX_FIFO_LENGTH];
+static uint16_t tcp_rx_head=0;
+static uint16_t tcp_rx_count=0;
+static uint16_t ipd_remaining=0; /* bytes of a +IPD block received after the receive buffer was last cleared */
+static uint32_t tcp_rx_dropped=0;
+static uint8_t at_data_mode=FALSE; /* transparent mode: the receive buffer only holds TCP data */
+
+static void tcp_rx_put(const volatile char * data, uint16_t length){
+	for(uint16_t i=0; i<length; i++){
+		if (tcp_rx_count==TCP_RX_FIFO_LENGTH){
+			tcp_rx_dropped++;
+			continue;
+		}
+		tcp_rx_fifo[(tcp_rx_head+tcp_rx_count)%TCP_RX_FIFO_LENGTH]=data[i];
+		tcp_rx_count++;
+	}
+}
+
+/* Only called right before the receive buffer is cleared, so that every +IPD block is taken once */
+static void latch_tcp_data(void){
+	static const char tag[]="+IPD,";
+	uint16_t length=rx_index;
+	uint16_t i=0;
+	uint16_t block_length;
+	uint16_t available;
+
+	if (at_data_mode){
+		tcp_rx_put(sim_rx_buffer,length);
+		return;
+	}
+
+	/* The end of a block cut by the previous clean up is at the start of the buffer */
+	if (ipd_remaining > 0){
+		available=(ipd_remaining < length)?ipd_remaining:length;
+		tcp_rx_put(sim_rx_buffer,available);
+		ipd_remaining-=available;
+		i=available;
+	}
+
+	while (i+sizeof(tag)-1 < length){
+		if (sim_rx_buffer[i]!='+' || memcmp((const char *)sim_rx_buffer+i,tag,sizeof(tag)-1)!=0){
+			i++;
+			continue;
+		}
+		i+=sizeof(tag)-1;
+		block_length=0;
+		while (i < length && sim_rx_buffer[i]>='0' && sim_rx_buffer[i]<='9')
+			block_length=block_length*10+(sim_rx_buffer[i++]-'0');
+		if (i >= length || sim_rx_buffer[i]!=':')
+			continue;
+		i++;
+		available=(block_length < length-i)?block_length:length-i;
+		tcp_rx_put(sim_rx_buffer+i,available);
+		ipd_remaining=block_length-available;
+		i+=available;
+	}
+}
+
+/* The prompt of AT+CIPSEND starts a line. The +IPD blocks are skipped: a PUBACK received with the prompt may hold
+ * the same bytes.
+ */
+static uint8_t is_prompt_present(void){
+	static const char tag[]="+IPD,";
+	uint16_t length=rx_index;
+	uint16_t i=(ipd_remaining < length)?ipd_remaining:length; /* the end of a block cut by the previous clean up */
+	uint16_t block_length;
+
+	while (i < length){
+		if (sim_rx_buffer[i]=='>' && i > 0 && sim_rx_buffer[i-1]=='\n')
+			return TRUE;
+		if (sim_rx_buffer[i]!='+' || i+sizeof(tag)-1 > length || memcmp((const char *)sim_rx_buffer+i,tag,sizeof(tag)-1)!=0){
+			i++;
+			continue;
+		}
+		i+=sizeof(tag)-1;
+		block_length=0;
+		while (i < length && sim_rx_buffer[i]>='0' && sim_rx_buffer[i]<='9')
+			block_length=block_length*10+(sim_rx_buffer[i++]-'0');
+		/* A block not received completely may still receive a '>' */
+		if (i < length && sim_rx_buffer[i]==':')
+			i+=1+block_length;
+	}
+	return FALSE;
+}
+
+static void latch_AT_urcs(void){
+	if (is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"CONNECT OK",sizeof("CONNECT OK")-1))
+		urc_flags|=URC_CONNECT_OK;
+	if (is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"CONNECT FAIL",sizeof("CONNECT FAIL")-1))
+		urc_flags|=URC_CONNECT_FAIL;
+	/* Alone on its line, or after the connection number in multi-IP mode: STATE: TCP CLOSED of AT+CIPSTATUS is no URC */
+	if (is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"\r\nCLOSED\r\n",sizeof("\r\nCLOSED\r\n")-1)
+		|| is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)", CLOSED\r\n",sizeof(", CLOSED\r\n")-1))
+		urc_flags|=URC_CLOSED;
+	if (is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"+PDP: DEACT",sizeof("+PDP: DEACT")-1))
+		urc_flags|=URC_PDP_DEACT;
+	/* Alone on its line, unlike CONNECT OK and CONNECT FAIL */
+	if (is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"\r\nCONNECT\r\n",sizeof("\r\nCONNECT\r\n")-1))
+		urc_flags|=URC_CONNECT;
+}
+
+/* Debug log queue used once debug_log_start_async() is called.
+ * log_head is only written by send_debug, log_tail and log_tx_length only by debug_log_flush and the TX complete callback.
+ */
+static char log_buffer[LOG_BUFFER_LENGTH];
+static volatile uint16_t log_head=0;
+static volatile uint16_t log_tail=0;
+static volatile uint16_t log_tx_length=0;
+static uint8_t log_async=0;
+static uint32_t log_dropped=0;
+
+static void log_enqueue(const char * text, uint16_t length){
+	uint16_t used=(log_head-log_tail+LOG_BUFFER_LENGTH)%LOG_BUFFER_LENGTH;
+
+	/* Drop the text if it does not fit, one byte is kept free to distinguish full from empty */
+	if (length > LOG_BUFFER_LENGTH-1-used){
+		log_dropped++;
+		return;
+	}
+	for(uint16_t i=0; i<length; i++){
+		log_buffer[log_head]=text[i];
+		log_head=(log_head+1)%LOG_BUFFER_LENGTH;
+	}
+	/* Wake the log task up, it does not poll the queue */
+	scheduler_post_event(EVENT_LOG_TX);
+}
+
 void  send_debug(const char * debug_msg)
 {
 	char debug_prompt[]="Debug > ";
+	if (log_async){
+		log_enqueue(debug_prompt,strlen(debug_prompt));
+		log_enqueue(debug_msg,strlen(debug_msg));
+		log_enqueue("\r\n",2);
+		return;
+	}
 	HAL_UART_Transmit(&debug_uart,(uint8_t*)debug_prompt,strlen(debug_prompt),TX_TIMEOUT);
 	HAL_UART_Transmit(&debug_uart,(uint8_t*)debug_msg,strlen(debug_msg),TX_TIMEOUT);
 	HAL_UART_Transmit(&debug_uart,(uint8_t*)"\r\n",2,TX_TIMEOUT);
 }
 
-void  send_raw_debug(uint8_t * debug_dump,uint8_t length)
+void debug_log_start_async(void){
+	log_async=1;
+}
+
+uint8_t debug_log_flush(void){
+	/* A transmission is still in progress */
+	if (log_tx_length)
+		return TRUE;
+	if (log_head==log_tail)
+		return FALSE;
+
+	/* Send the contiguous part of the queue, the rest is sent at the next call */
+	if (log_head > log_tail)
+		log_tx_length=log_head-log_tail;
+	else
+		log_tx_length=LOG_BUFFER_LENGTH-log_tail;
+
+	if (HAL_UART_Transmit_IT(&debug_uart,(uint8_t*)&log_buffer[log_tail],log_tx_length)!=HAL_OK)
+		log_tx_length=0;
+	return TRUE;
+}
+
+uint8_t debug_log_busy(void){
+	return (log_tx_length!=0 || log_head!=log_tail);
+}
+
+uint32_t debug_log_dropped(void){
+	return log_dropped;
+}
+
+/**
+ * @brief is called when a HAL_UART_Transmit_IT transfer is complete. Frees the sent part of the debug log queue.
+ */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart){
+	if (huart->Instance==USART2){
+		log_tail=(log_tail+log_tx_length)%LOG_BUFFER_LENGTH;
+		log_tx_length=0;
+		scheduler_post_event(EVENT_LOG_TX);
+	}
+}
+
+void  send_raw_debug(uint8_t * debug_dump,uint16_t length)
 {
 	char debug_prompt[]="Debug > ";
+	if (log_async){
+		log_enqueue(debug_prompt,strlen(debug_prompt));
+		log_enqueue((char*)debug_dump,length);
+		log_enqueue("\r\n",2);
+		return;
+	}
 	HAL_UART_Transmit(&debug_uart,(uint8_t*)debug_prompt,strlen(debug_prompt),TX_TIMEOUT);
 	HAL_UART_Transmit(&debug_uart,debug_dump,length,TX_TIMEOUT);
 	HAL_UART_Transmit(&debug_uart,(uint8_t*)"\r\n",2,TX_TIMEOUT);
@@ -45,13 +237,71 @@ void  send_raw_debug(uint8_t * debug_dump,uint8_t length)
  */
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart){
 	if (huart->Instance==USART1){
+		PROFILE_BEGIN(PROFILE_ZONE_UART_ISR);
 		sim_rx_buffer[rx_index++ ]=rx_byte; /*rx_index++ modulo RX_BUFFER_LENGTH to ensure it always stays smaller then RX_BUFFER_LENGTH*/
+
+		/* Wake up the tasks waiting for a reply at the end of every line and on the CIPSEND prompt */
+		if (rx_byte=='\n' || rx_byte=='>')
+			scheduler_post_event(EVENT_AT_RX);
 		
 		/* Enable UART receive interrupt again*/
 		HAL_UART_Receive_IT(&AT_uart,(uint8_t *)&rx_byte,1);
+		PROFILE_END(PROFILE_ZONE_UART_ISR);
 	}
-}	
+	#ifdef PROFILER_MODE
+	else if (huart->Instance==USART2){
+		profiler_debug_rx_callback();
+	}
+	#endif
+}
 
+/**
+ * @brief is called when a UART reports a receive error.
+ * On an overrun, when the CPU was stalled by a flash page erase for instance, the HAL ends the reception: it is started
+ * again, otherwise the AT port would not receive anything any more. The bytes lost are recovered by the timeouts of the
+ * AT commands and by the retransmissions of the MQTT window.
+ */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart){
+	if (huart->Instance==USART1 && huart->RxState==HAL_UART_STATE_READY)
+		HAL_UART_Receive_IT(&AT_uart,(uint8_t *)&rx_byte,1);
+}
+
+
+
+/**
+ * @brief sends "AT" and waits at most timeout ms for OK, without debug messages. Used to detect the module at boot.
+ */
+static uint8_t probe_AT(uint32_t timeout){
+	uint32_t start=HAL_GetTick();
+	uint8_t replied=FALSE;
+
+	/* The boot sequence is made of bounded waits: each one refreshes the watchdog, see recovery.h */
+	watchdog_refresh();
+	HAL_UART_Transmit(&AT_uart,(uint8_t *)"AT\r",3,TX_TIMEOUT);
+	while (!replied && HAL_GetTick()-start < timeout)
+		replied=is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"OK",2);
+
+	/* The buffer is only cleared on a reply: until then it may receive the RDY or Call Ready URCs */
+	if (replied){
+		memset((void *)sim_rx_buffer,0,RX_BUFFER_LENGTH);
+		rx_index=0;
+	}
+	return replied;
+}
+
+/**
+ * @brief waits at most timeout ms for the STATUS pin to reach state.
+ */
+static uint8_t wait_status_pin(SIM808_typedef * sim, GPIO_PinState state, uint32_t timeout){
+	uint32_t start=HAL_GetTick();
+
+	watchdog_refresh();
+	while (HAL_GPIO_ReadPin(sim->status_gpio,sim->status_pin)!=state){
+		if (HAL_GetTick()-start >= timeout)
+			return FAIL;
+	}
+	return SUCCESS;
+}
 
 		 
 uint8_t sim_init(SIM808_typedef * sim){
@@ -117,37 +367,45 @@ uint8_t sim_init(SIM808_typedef * sim){
 	HAL_GPIO_Init(sim->status_gpio, &GPIO_InitStruct);
 
 	/* Power on module:
-	 * Check if the module is Powered on by reading the value of STATUS pin.
-	 * If the module is powered off then pull down the power pin of sim808 for at least 1 second to power it on.
-	 * Then read the STATUS pin again. If the device is not powered on, try 2 more times.
+	 * A module that is already on (STATUS pin high) is probed with a few short AT polls and used as it is when it answers:
+	 * the autobaud of the SIM808 locks on the first "AT" it receives, so no delay is needed.
+	 * A module that is on but does not answer is powered off first.
+	 * A module that is off is powered on by pulling down its power pin for at least 1 second, then the STATUS pin is
+	 * polled instead of waiting a fixed time. If the device is not powered on, try 2 more times.
 	 */
+	uint32_t boot_start=HAL_GetTick();
+	uint32_t ready_start; /* start of the BOOT_READY_TIMEOUT window: the end of the power on */
+	uint8_t warm_boot=FALSE;
+	char debug_msg[64];
 
-	/* Count number of power on trials */
-	uint8_t trials=0;  
+	if (HAL_GPIO_ReadPin(sim->status_gpio,sim->status_pin)){
+		for(uint8_t probe=0; probe<WARM_BOOT_PROBES && !warm_boot; probe++)
+			warm_boot=probe_AT(AT_PROBE_PERIOD);
+		if (!warm_boot)
+			sim_power_off(sim);
+	}
 
-	while(!HAL_GPIO_ReadPin(sim->status_gpio,sim->status_pin) && trials<3){
-		HAL_GPIO_WritePin(sim->power_on_gpio,sim->power_on_pin,GPIO_PIN_RESET);
-		/* Keep pin down for 1.2 s */
-		HAL_Delay(1200);
-		HAL_GPIO_WritePin(sim->power_on_gpio,sim->power_on_pin,GPIO_PIN_SET);
-		HAL_Delay(100);
-		trials++;
+	if (!warm_boot){
+
+		/* Count number of power on trials */
+		uint8_t trials=0;
+
+		while(!HAL_GPIO_ReadPin(sim->status_gpio,sim->status_pin) && trials<3){
+			watchdog_refresh();
+			HAL_GPIO_WritePin(sim->power_on_gpio,sim->power_on_pin,GPIO_PIN_RESET);
+			/* Keep pin down for 1.2 s */
+			HAL_Delay(1200);
+			HAL_GPIO_WritePin(sim->power_on_gpio,sim->power_on_pin,GPIO_PIN_SET);
+			wait_status_pin(sim,GPIO_PIN_SET,STATUS_PIN_TIMEOUT);
+			trials++;
+		}
 	}
-	
+
 	#ifdef DEBUG_MODE
 		send_debug("System initialization: Started");
 	#endif
 	/* Read STATUS pin of the SIM808 to check the power on status. if the module is ON then power on indicator LED*/
-	if (HAL_GPIO_ReadPin(sim->status_gpio,sim->status_pin)){
-		HAL_GPIO_WritePin(GPIOB,GPIO_PIN_12,GPIO_PIN_SET);
-
-	/* Send the string "AT" to synchronize baude rate of the SIM808 module*/
-	HAL_UART_Transmit(&AT_uart,(uint8_t *)"AT\r",3,TX_TIMEOUT);
-
-	/*It is recommended to wait 3 to 5 seconds before sending the first AT character. */
-	HAL_Delay(3000);	
-	} 
-	else{
+	if (!HAL_GPIO_ReadPin(sim->status_gpio,sim->status_pin)){
 				#ifdef DEBUG_MODE
 					send_debug("System initialization: FAILED");
 					send_debug("Reason: SIM808 cannot be powered on");
@@ -156,12 +414,28 @@ uint8_t sim_init(SIM808_typedef * sim){
 				HAL_GPIO_WritePin(GPIOB,GPIO_PIN_12,GPIO_PIN_RESET);
 				return FAIL;
 	}
+	HAL_GPIO_WritePin(GPIOB,GPIO_PIN_12,GPIO_PIN_SET);
+	/* The power off and on pulses can take several seconds: they do not count in the time the module has to boot */
+	ready_start=HAL_GetTick();
+
+	/* After a power on, the module sends RDY (fixed baud rate) and Call Ready when it is ready for AT commands.
+	 * With autobaud, the module sends no URC before the first AT: keep probing with short polls until it answers.
+	 */
+	uint8_t is_module_replying=warm_boot;
+	while (!is_module_replying && HAL_GetTick()-ready_start < BOOT_READY_TIMEOUT){
+		if (is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"RDY",3) ||
+			is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t*)"Call Ready",10)){
+			is_module_replying=send_AT_cmd("AT\r","OK",0,NULL,RX_TIMEOUT);
+			break;
+		}
+		is_module_replying=probe_AT(AT_PROBE_PERIOD);
+	}
 
-	/*Send the First AT Command to check if the module is responding*/
-	uint8_t is_module_replying=0;
-	is_module_replying=send_AT_cmd("AT\r","OK",0,NULL,RX_TIMEOUT);
+	/*Check if the module is responding*/
 	if (is_module_replying==1){
 			#ifdef DEBUG_MODE
+				sprintf(debug_msg,"Time to first AT: %lu ms (%s boot)",(unsigned long)(HAL_GetTick()-boot_start),warm_boot?"warm":"cold");
+				send_debug(debug_msg);
 				send_debug("System initialization: SUCCESS");
 				send_debug("SIM808 module is responsive");
 			#endif
@@ -185,11 +459,12 @@ uint8_t sim_power_off(SIM808_typedef * sim){
 		uint8_t trials=0;  
 
 		while(HAL_GPIO_ReadPin(sim->status_gpio,sim->status_pin) && trials<3){
+		watchdog_refresh();
 		HAL_GPIO_WritePin(sim->power_on_gpio,sim->power_on_pin,GPIO_PIN_RESET);
 		/* Keep pin down for 1.2 s */
 		HAL_Delay(1200);
 		HAL_GPIO_WritePin(sim->power_on_gpio,sim->power_on_pin,GPIO_PIN_SET);
-		HAL_Delay(100);
+		wait_status_pin(sim,GPIO_PIN_RESET,STATUS_PIN_TIMEOUT);
 		trials++;
 	}
 		
@@ -222,6 +497,8 @@ uint8_t send_AT_cmd(const char * cmd, const char * expected_reply, uint8_t save_
 	uint8_t is_expected_reply_received=0;
 	uint32_t timer=0;
 	char  debug_msg[128];
+
+	PROFILE_BEGIN(PROFILE_ZONE_AT_CMD);
 	/* send the AT command via AT_uart */
 	HAL_UART_Transmit(&AT_uart,(uint8_t *)cmd,strlen(cmd),TX_TIMEOUT);
 
@@ -247,12 +524,20 @@ uint8_t send_AT_cmd(const char * cmd, const char * expected_reply, uint8_t save_
 	if (save_reply == 1 )
 		memcpy(cmd_reply,(const char *)sim_rx_buffer,RX_BUFFER_LENGTH);
 
+	/* URCs and TCP data received with the reply are kept for check_AT_urc() and read_tcp_data() */
+	latch_AT_urcs();
+	latch_tcp_data();
+
 	/* clear the sim_rx_buffer, reset the receive counter rx_index 
 	 * and then return 1 to acknowledge the success of the command		 
 	 */
 	memset((void *)sim_rx_buffer,NULL,RX_BUFFER_LENGTH);
 	rx_index=0;
+
+	/* The command finished within its timeout: the blocking sequences built from it are making progress */
+	watchdog_refresh();
 	
+	PROFILE_END(PROFILE_ZONE_AT_CMD);
 	return is_expected_reply_received;
 	
 }
@@ -283,7 +568,7 @@ uint8_t is_subarray_present(const uint8_t *array, size_t array_len, const uint8_
 
 
 
-uint8_t send_serial_data(uint8_t * data, uint8_t length,  char * cmd_reply, uint32_t rx_timeout){
+uint8_t send_serial_data(uint8_t * data, uint16_t length,  char * cmd_reply, uint32_t rx_timeout){
 	
 	
 	
@@ -293,11 +578,13 @@ uint8_t send_serial_data(uint8_t * data, uint8_t length,  char * cmd_reply, uint
 	uint8_t is_expected_reply_received=0;
 	uint32_t timer=0;
 	uint8_t expected_reply[]={0x53,0x45,0x4E,0x44,0x20,0x4F,0x4B}; /*SEND OK in HEX"*/
+	static const uint8_t quick_send_reply[]="DATA ACCEPT"; /* instead of SEND OK with AT+CIPQSEND=1 */
 
 	/* Wait for the module until the expected reply is received or if the timeout is breached */
 	/*strstr will not work here, because the buffer might contain raw hex data */
 	while ( (is_expected_reply_received==0) && (timer < rx_timeout)) {
-		is_expected_reply_received=is_subarray_present((uint8_t*)sim_rx_buffer,RX_BUFFER_LENGTH,expected_reply,7);
+		is_expected_reply_received=is_subarray_present((uint8_t*)sim_rx_buffer,RX_BUFFER_LENGTH,expected_reply,7)
+				|| is_subarray_present((uint8_t*)sim_rx_buffer,RX_BUFFER_LENGTH,quick_send_reply,sizeof(quick_send_reply)-1);
 		timer++;
 		HAL_Delay(1);
 	}
@@ -312,6 +599,7 @@ uint8_t send_serial_data(uint8_t * data, uint8_t length,  char * cmd_reply, uint
 	 * and then return 1 to acknowledge the success of the command
 	 */
 	memcpy(cmd_reply,(const char *)sim_rx_buffer,RX_BUFFER_LENGTH);
+	latch_tcp_data();
 	memset((void *)sim_rx_buffer,NULL,RX_BUFFER_LENGTH);
 	rx_index=0;
 	
@@ -319,3 +607,128 @@ uint8_t send_serial_data(uint8_t * data, uint8_t length,  char * cmd_reply, uint
 }
 
 
+
+void send_AT_cmd_async(const char * cmd){
+	/* Start from an empty buffer so that a late reply or URC cannot be taken for the reply of this command */
+	latch_AT_urcs();
+	latch_tcp_data();
+	memset((void *)sim_rx_buffer,0,RX_BUFFER_LENGTH);
+	rx_index=0;
+
+	HAL_UART_Transmit(&AT_uart,(uint8_t *)cmd,strlen(cmd),TX_TIMEOUT);
+	async_cmd_start=HAL_GetTick();
+}
+
+
+void send_serial_data_async(uint8_t * data, uint16_t length){
+	HAL_UART_Transmit(&AT_uart,data,length,TX_TIMEOUT);
+	async_cmd_start=HAL_GetTick();
+}
+
+
+/* The reply of the asynchronous command was received, or its timeout elapsed */
+static uint8_t end_AT_reply(uint8_t is_expected_reply_received, uint32_t elapsed, uint8_t save_reply, char * cmd_reply){
+	#ifdef DEBUG_MODE
+	char  debug_msg[48];
+	sprintf(debug_msg,"Reply %s in %lu ms",is_expected_reply_received?"OK":"timeout",(unsigned long)elapsed);
+	send_debug(debug_msg);
+	#else
+	(void)elapsed;
+	#endif
+
+	/* Same clean up as send_AT_cmd(), URCs and TCP data received with the reply are kept */
+	latch_AT_urcs();
+	latch_tcp_data();
+	if (save_reply == 1 )
+		memcpy(cmd_reply,(const char *)sim_rx_buffer,RX_BUFFER_LENGTH);
+	memset((void *)sim_rx_buffer,0,RX_BUFFER_LENGTH);
+	rx_index=0;
+
+	return is_expected_reply_received;
+}
+
+
+uint8_t poll_AT_reply(const char * expected_reply, uint8_t save_reply, char * cmd_reply, uint32_t rx_timeout){
+
+	uint8_t is_expected_reply_received;
+	uint32_t elapsed=HAL_GetTick()-async_cmd_start;
+
+	is_expected_reply_received=is_subarray_present((const uint8_t *)sim_rx_buffer,RX_BUFFER_LENGTH,(uint8_t *)expected_reply,strlen(expected_reply));
+	if (!is_expected_reply_received && elapsed < rx_timeout)
+		return AT_PENDING;
+	return end_AT_reply(is_expected_reply_received,elapsed,save_reply,cmd_reply);
+}
+
+
+uint8_t poll_AT_prompt(uint32_t rx_timeout){
+
+	uint8_t is_prompt_received;
+	uint32_t elapsed=HAL_GetTick()-async_cmd_start;
+
+	is_prompt_received=is_prompt_present();
+	if (!is_prompt_received && elapsed < rx_timeout)
+		return AT_PENDING;
+	return end_AT_reply(is_prompt_received,elapsed,0,NULL);
+}
+
+
+uint8_t check_AT_urc(uint8_t urc){
+	uint8_t seen;
+
+	latch_AT_urcs();
+	seen=urc_flags & urc;
+	urc_flags&=~urc;
+	return seen;
+}
+
+
+void flush_AT_rx(void){
+	latch_AT_urcs();
+	latch_tcp_data();
+	memset((void *)sim_rx_buffer,0,RX_BUFFER_LENGTH);
+	rx_index=0;
+}
+
+
+uint16_t read_tcp_data(uint8_t * data, uint16_t size){
+	uint16_t count=0;
+
+	while (count < size && tcp_rx_count > 0){
+		data[count++]=tcp_rx_fifo[tcp_rx_head];
+		tcp_rx_head=(tcp_rx_head+1)%TCP_RX_FIFO_LENGTH;
+		tcp_rx_count--;
+	}
+	return count;
+}
+
+
+uint16_t peek_tcp_data(const uint8_t ** data){
+	*data=tcp_rx_fifo+tcp_rx_head;
+	if (tcp_rx_head+tcp_rx_count > TCP_RX_FIFO_LENGTH)
+		return TCP_RX_FIFO_LENGTH-tcp_rx_head;
+	return tcp_rx_count;
+}
+
+
+void release_tcp_data(uint16_t length){
+	if (length > tcp_rx_count)
+		length=tcp_rx_count;
+	tcp_rx_head=(tcp_rx_head+length)%TCP_RX_FIFO_LENGTH;
+	tcp_rx_count-=length;
+}
+
+
+void set_AT_data_mode(uint8_t data_mode){
+	/* The bytes received so far belong to the previous mode */
+	latch_AT_urcs();
+	latch_tcp_data();
+	memset((void *)sim_rx_buffer,0,RX_BUFFER_LENGTH);
+	rx_index=0;
+	ipd_remaining=0;
+	at_data_mode=data_mode;
+}
+
+
+uint32_t tcp_data_dropped(void){
+	return tcp_rx_dropped;
+}
@@ -0,0 +1,1132 @@
+/**
+*	@file tasks.c
+*	@brief Application tasks run by the cooperative scheduler.
+*
+*	The GPS and uplink tasks are state machines: every AT command is sent with send_AT_cmd_async() and the task
+*	returns to the scheduler until poll_AT_reply() reports the reply or the timeout. The UART receive interrupt posts
+*	EVENT_AT_RX at the end of every line so the waiting task runs as soon as the module answers.
+*	Only one task at a time talks to the module: the AT port is taken with at_acquire() and given back with at_release().
+*
+*	GPS acquisition is pipelined with the uplink: the uplink gives the AT port back while it waits for the CONNECT OK
+*	URC of AT+CIPSTART, which usually takes seconds, and the GPS task keeps sampling in that gap. Fixes are stored in
+*	a small queue, so the sampling rate does not depend on how long a publish takes.
+*
+*	The MQTT session is kept open between fixes: the first fix opens the TCP connection and sends CONNECT, the next
+*	ones only cost a PUBLISH. A PINGREQ is sent when nothing was sent for MQTT_PING_PERIOD, so the server does not
+*	close the session. A closed connection is only reopened when the next fix is published.
+*	The packets of a message (CONNECT and the PUBLISH of every queued fix) are coalesced in one buffer and sent with a
+*	single AT+CIPSEND, one modem round trip instead of one per packet.
+*
+*	Fixes are batched: up to BATCH_MAX_FIXES positions share one PUBLISH, in the binary format of position.h. The batch is
+*	published when it is full, when its oldest fix is BATCH_MAX_AGE old, when a PINGREQ would be due, or right away
+*	for an urgent fix (the first one after the GPS lost its fix). BATCH_MAX_FIXES 1 publishes every fix on its own.
+*
+*	The batches are published with QoS 1: a batch is delivered when the server acknowledges it with a PUBACK, not
+*	at DATA ACCEPT. Up to MQTT_INFLIGHT_WINDOW batches wait for their PUBACK at the same time, see mqtt.h, so a batch is
+*	sent without waiting for the acknowledgement of the previous one. The uplink reads the PUBACKs received by the
+*	module whenever it runs, and sends again the batches that were not acknowledged in time or were in flight when
+*	the connection was lost. A batch that stays unacknowledged after MQTT_MAX_RETRIES retransmissions is a broken
+*	connection, and goes through the recovery ladder like a failed send, as is a CONNACK refusing the session or
+*	MQTT_MAX_PINGS PINGREQ packets without PINGRESP.
+*
+*	Writes complete on DATA ACCEPT (AT+CIPQSEND=1), when the module took the bytes, without waiting for the TCP
+*	acknowledgement of the server. The unacknowledged bytes are read with AT+CIPACK every TCP_ACK_CHECK_PERIOD: new
+*	writes wait while TCP_MAX_UNACKED bytes are unacknowledged, and a connection that acknowledges nothing for
+*	TCP_ACK_TIMEOUT is broken.
+*
+*	Fixes survive the periods without network: when the RAM queue is full, its oldest fix is appended to the
+*	store-and-forward log in flash instead of being dropped, see flash_log.h, and so are the whole queue and the
+*	batches of the in-flight window before a system reset of the recovery ladder. The log is drained first, oldest fix
+*	first, once a batch can be sent, and its records are only marked as uploaded at the PUBACK of their batch. The page
+*	a spill enters is erased before the fix is queried, while the module is quiet: the erase would overrun USART1.
+*
+*	With TRANSPARENT_MODE, the message is written to the connection in data mode instead of with AT+CIPSEND: ATO
+*	(or the CONNECT of AT+CIPSTART), the packets, then the +++ escape back to command mode for the GPS task. The AT
+*	port is kept while the connection is being opened, since the module enters data mode as soon as it is.
+*
+*	A server given by name is resolved with AT+CDNSGIP before the connection is opened, and its address is cached
+*	for the next connections, see dns_cache.h. A connection that cannot be opened drops the cached address of its
+*	server.
+*
+*	The connection goes to one of several servers, chosen by their health scores, see endpoint.h. A connection that
+*	cannot be opened is closed and fails over to the next server at once, the recovery ladder only climbs once every
+*	server failed.
+*
+*	With MQTTSN_MODE, the messages are MQTT-SN datagrams to a gateway over a UDP socket, see network_functions.h. A
+*	datagram carries one message: the CONNECT is sent on its own, and every AT+CIPSEND carries a single PUBLISH or
+*	PUBACK. The TCP acknowledgements are not tracked. A datagram may be lost, so the session only opens with the
+*	CONNACK of the gateway: a CONNECT without CONNACK after MQTT_RETRY_TIMEOUT reopens the connection.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+#include <stdio.h>
+
+#include "sim808.h"
+#include "gps.h"
+#include "network_functions.h"
+#include "scheduler.h"
+#include "profiler.h"
+#include "power.h"
+#include "recovery.h"
+#include "gprs.h"
+#include "mqtt.h"
+#include "flash_log.h"
+#include "position.h"
+#include "dns_cache.h"
+#include "tasks.h"
+
+#define AT_POLL_PERIOD 10 /* ms between two checks of a pending AT reply when no EVENT_AT_RX is posted */
+
+/* Owners of the AT port */
+#define AT_OWNER_NONE 0
+#define AT_OWNER_GPS 1
+#define AT_OWNER_UPLINK 2
+#define AT_OWNER_GPRS 3
+
+typedef enum {
+	GPS_IDLE,
+	GPS_WAIT_STATUS,
+	GPS_WAIT_LOCATION
+} gps_state_typedef;
+
+typedef enum {
+	UPLINK_IDLE,
+	UPLINK_STATUS,      /* waiting for the reply to AT+CIPSTATUS */
+	UPLINK_CLOSE_STALE, /* closing a connection left open */
+	UPLINK_RESOLVE,     /* waiting for the +CDNSGIP URC of AT+CDNSGIP */
+	UPLINK_CONNECT,     /* waiting for the OK of AT+CIPSTART */
+	UPLINK_WAIT_CONNECT,/* waiting for the CONNECT OK URC, the AT port is free for the GPS task */
+	UPLINK_SEND_CMD,    /* waiting for the > prompt of AT+CIPSEND */
+	UPLINK_SEND_DATA,   /* waiting for DATA ACCEPT */
+	UPLINK_ACK,         /* waiting for the reply to AT+CIPACK */
+	#ifdef TRANSPARENT_MODE
+	UPLINK_DATA_MODE,   /* waiting for the CONNECT of ATO */
+	UPLINK_ESCAPE_GUARD,/* the message was written, silence before +++ */
+	UPLINK_ESCAPE,      /* waiting for the OK of +++ */
+	#endif
+	UPLINK_CLOSE        /* waiting for CLOSE OK */
+} uplink_state_typedef;
+
+static SIM808_typedef * tasks_sim;
+
+static uint8_t at_owner=AT_OWNER_NONE;
+static char task_rx_buffer[RX_BUFFER_LENGTH];
+
+static gps_state_typedef gps_state=GPS_IDLE;
+
+typedef struct {
+	position_typedef position;
+	uint32_t time; /* HAL_GetTick() when the fix was queued */
+} fix_typedef;
+
+/* Fixes waiting to be published, the oldest one goes to the flash log when the queue is full */
+static fix_typedef fix_queue[FIX_QUEUE_LENGTH];
+static uint8_t fix_queue_head=0; /* index of the oldest fix */
+static uint8_t fix_queue_count=0;
+static uint8_t fix_queue_urgent=FALSE; /* the queued fixes are published without waiting for the batch to fill */
+static uint32_t fixes_dropped=0;
+static uint32_t reported_fixes_dropped=0;
+static uint32_t reported_tcp_dropped=0;
+static uint32_t reported_flash_dropped=0;
+static uint32_t flash_erase_wait_start; /* time the queue became full with a flash log page to erase */
+
+static uplink_state_typedef uplink_state=UPLINK_IDLE;
+static uint32_t uplink_connect_start;
+static uint8_t uplink_connect_urc;
+static uint32_t uplink_connect_latency; /* ms from AT+CIPSTART to the CONNECT OK URC */
+static uint8_t uplink_failover=FALSE; /* the connection is closed to try the next server */
+static uint8_t uplink_failure; /* class of the failure, FAILURE_xxx */
+static uint8_t uplink_fix_count; /* fixes of the new batch of the message, 0 if none */
+static uint8_t uplink_publish_count; /* PUBLISH packets of the message, new or sent again */
+static uint8_t uplink_pingreq; /* the message ends with a PINGREQ */
+static position_batch_typedef uplink_batch; /* payload of the new batch */
+static uint8_t uplink_session=FALSE; /* the MQTT CONNECT was sent on the open connection */
+static uint8_t uplink_connack_wait=FALSE; /* MQTT-SN: the CONNECT was sent, the session opens with its CONNACK */
+static uint8_t uplink_pings_unanswered=0; /* PINGREQ packets sent since the last PINGRESP */
+static uint32_t uplink_last_sent; /* time of the last packet sent to the server */
+/* TCP acknowledgement of the writes, counted from the opening of the connection */
+static uint32_t tcp_unacked;         /* bytes unacknowledged at the last AT+CIPACK, plus the ones written since */
+static uint32_t tcp_acked;           /* bytes acknowledged at the last AT+CIPACK */
+static uint32_t tcp_ack_checked_at;  /* time of the last AT+CIPACK */
+static uint32_t tcp_ack_progress_at; /* last time bytes were acknowledged, or nothing was left to acknowledge */
+#ifdef TRANSPARENT_MODE
+static uint32_t uplink_written_at; /* time the message was written in data mode, start of the escape guard time */
+#endif
+
+/* Counters reported by the health task every UPLINK_REPORT_PERIOD */
+static struct {
+	uint32_t publishes;     /* PUBLISH packets sent, retransmissions included */
+	uint32_t connects;
+	uint32_t pings;
+	uint32_t pubacks;       /* messages carrying only PUBACKs to the server */
+	uint32_t bytes;         /* MQTT bytes given to AT+CIPSEND, including CONNECT and PINGREQ */
+	uint32_t sends;         /* messages written to the connection, with AT+CIPSEND or in data mode */
+} uplink_stats;
+
+/* Packets of the message being sent, with a single AT+CIPSEND: CONNECT when the session is not open, then the
+ * PUBLISH packets of the in-flight window to be sent, or a PINGREQ alone.
+ */
+static tx_buffer_typedef uplink_tx;
+#ifdef MQTTSN_MODE
+static const uint8_t pingreq_packet[]={0x02,MQTTSN_PINGREQ};
+#define UPLINK_TRANSPORT "UDP"
+#else
+static const uint8_t pingreq_packet[]={0xc0,0x00};
+#define UPLINK_TRANSPORT "TCP"
+#endif
+
+/* The CONNECT packet and the PUBLISH topic of the device, built at compile time */
+#ifdef MQTTSN_MODE
+static const mqttsn_connect_template_typedef connect_template=MQTTSN_CONNECT_TEMPLATE(MQTT_CLIENT_ID);
+#else
+static const mqtt_connect_template_typedef connect_template=MQTT_CONNECT_TEMPLATE(MQTT_CLIENT_ID);
+#endif
+static const mqtt_topic_template_typedef topic_template=MQTT_TOPIC_TEMPLATE(MQTT_TOPIC);
+
+static uint32_t gps_task(void);
+static uint32_t gprs_task(void);
+static uint32_t uplink_task(void);
+static uint32_t log_task(void);
+static uint32_t health_task(void);
+
+/* In priority order */
+static task_typedef tasks[]={
+	{"uplink", uplink_task, EVENT_AT_RX | EVENT_FIX_READY | EVENT_LINK_UP},
+	{"gprs",   gprs_task,   EVENT_AT_RX},
+	{"gps",    gps_task,    EVENT_AT_RX},
+	{"log",    log_task,    EVENT_LOG_TX},
+	{"health", health_task, 0},
+};
+#define TASK_COUNT (sizeof(tasks)/sizeof(tasks[0]))
+static uint32_t reported_run_ms[TASK_COUNT];
+
+
+static uint8_t at_acquire(uint8_t owner){
+	if (at_owner!=AT_OWNER_NONE && at_owner!=owner)
+		return FALSE;
+	at_owner=owner;
+	return TRUE;
+}
+
+static void at_release(void){
+	at_owner=AT_OWNER_NONE;
+}
+
+/* No reply nor URC is expected from the module: the CPU can be stalled by a flash page erase without overrunning the
+ * AT port. The batches of the window wait for a PUBACK only while the session is open. A URC received anyway is lost
+ * at worst, see HAL_UART_ErrorCallback().
+ */
+static uint8_t uplink_quiet(void){
+	return at_owner==AT_OWNER_NONE && uplink_state==UPLINK_IDLE && !uplink_connack_wait
+			&& (!uplink_session || mqtt_window_free()==MQTT_INFLIGHT_WINDOW);
+}
+
+
+/* The next fix spills the oldest queued one to a flash log page not erased yet. The page is erased ahead once the module
+ * is quiet: the new batches are held meanwhile so that the in-flight window empties, for FLASH_ERASE_MAX_WAIT at most.
+ * The spill erases the page after that.
+ */
+static uint8_t flash_erase_waiting(void){
+	return fix_queue_count==FIX_QUEUE_LENGTH && flash_log_erase_pending() && HAL_GetTick()-flash_erase_wait_start < FLASH_ERASE_MAX_WAIT;
+}
+
+/* An urgent fix, the first one after the GPS lost its fix, flushes the batch it belongs to */
+static void fix_queue_push(const position_typedef * position){
+	fix_typedef * fix;
+
+	if (fix_queue_count==FIX_QUEUE_LENGTH){
+		if (flash_log_append(&fix_queue[fix_queue_head].position)==FAIL)
+			fixes_dropped++;
+		fix_queue_head=(fix_queue_head+1)%FIX_QUEUE_LENGTH;
+		fix_queue_count--;
+	}
+	fix=&fix_queue[(fix_queue_head+fix_queue_count)%FIX_QUEUE_LENGTH];
+	fix->position=*position;
+	fix->time=HAL_GetTick();
+	fix_queue_count++;
+	if (position->flags&POSITION_FLAG_REGAINED)
+		fix_queue_urgent=TRUE;
+	if (fix_queue_count==FIX_QUEUE_LENGTH && flash_log_erase_pending())
+		flash_erase_wait_start=HAL_GetTick();
+}
+
+static uint8_t fix_queue_pop(fix_typedef * fix){
+	if (fix_queue_count==0)
+		return FALSE;
+	*fix=fix_queue[fix_queue_head];
+	fix_queue_head=(fix_queue_head+1)%FIX_QUEUE_LENGTH;
+	fix_queue_count--;
+	return TRUE;
+}
+
+static uint32_t fix_queue_age(void){
+	return (fix_queue_count > 0)?HAL_GetTick()-fix_queue[fix_queue_head].time:0;
+}
+
+/* Before a system reset: the fixes of the window not yet acknowledged and the queued ones would be lost with the
+ * RAM. The fixes of the window read from the flash log are still pending in the log.
+ */
+static void fix_queue_save(void){
+	fix_typedef fix;
+	position_typedef position;
+	const uint8_t * payload;
+	uint16_t length,offset;
+
+	for(uint8_t i=0; i<MQTT_INFLIGHT_WINDOW; i++){
+		if ((payload=mqtt_window_payload(i,&length))==NULL)
+			continue;
+		offset=1;
+		while (position_batch_next(payload,length,&offset,&position)==SUCCESS){
+			if (!(position.flags&POSITION_FLAG_STORED) && flash_log_append(&position)==FAIL)
+				fixes_dropped++;
+		}
+	}
+	while (fix_queue_pop(&fix)){
+		if (flash_log_append(&fix.position)==FAIL)
+			fixes_dropped++;
+	}
+}
+
+
+
+/*** GPS task ***/
+
+static uint32_t gps_task(void){
+	static const char gps_get_status_cmd[]= "AT+CGPSSTATUS?\r";
+	static const char gps_get_location_cmd[]= "AT+CGPSINF=0\r";
+	static uint8_t gps_fix_lost=TRUE; /* no fix since boot or since the last query */
+	position_typedef position;
+	uint8_t reply;
+
+	switch(gps_state){
+
+	case GPS_IDLE:
+		/* The next fix spills the oldest one to a new page of the flash log: the page is erased first, the fix is
+		 * only queried once the module is quiet or after FLASH_ERASE_MAX_WAIT.
+		 */
+		if (fix_queue_count==FIX_QUEUE_LENGTH && flash_log_erase_pending()){
+			if (uplink_quiet()){
+				flash_log_prepare();
+				/* The batches held for the erase can go */
+				scheduler_post_event(EVENT_FIX_READY);
+			}
+			else if (flash_erase_waiting())
+				return AT_POLL_PERIOD;
+		}
+		if (!at_acquire(AT_OWNER_GPS))
+			return AT_POLL_PERIOD;
+		PROFILE_BEGIN(PROFILE_ZONE_GPS_QUERY);
+		send_AT_cmd_async(gps_get_status_cmd);
+		gps_state=GPS_WAIT_STATUS;
+		return AT_POLL_PERIOD;
+
+	case GPS_WAIT_STATUS:
+		reply=poll_AT_reply("Location 3D Fix",0,NULL,RX_WAIT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		if (reply==FAIL){
+			/* GPS has no fix, try again later */
+			gps_fix_lost=TRUE;
+			PROFILE_END(PROFILE_ZONE_GPS_QUERY);
+			at_release();
+			gps_state=GPS_IDLE;
+			return GPS_SAMPLE_PERIOD;
+		}
+		send_AT_cmd_async(gps_get_location_cmd);
+		gps_state=GPS_WAIT_LOCATION;
+		return AT_POLL_PERIOD;
+
+	case GPS_WAIT_LOCATION:
+		/* "\r\nOK" and not "OK": a CONNECT OK URC of the uplink may be received at the same time */
+		reply=poll_AT_reply("\r\nOK",1,task_rx_buffer,RX_WAIT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		PROFILE_END(PROFILE_ZONE_GPS_QUERY);
+		at_release();
+		gps_state=GPS_IDLE;
+		if (reply==SUCCESS && parse_gps_location(task_rx_buffer,&position)==SUCCESS){
+			position.flags=POSITION_FLAG_3D;
+			/* The first fix after the position was lost is published without waiting for the batch */
+			if (gps_fix_lost)
+				position.flags|=POSITION_FLAG_REGAINED;
+			fix_queue_push(&position);
+			gps_fix_lost=FALSE;
+			HAL_GPIO_TogglePin(GPIOB,GPIO_PIN_13);
+			scheduler_post_event(EVENT_FIX_READY);
+		}
+		return GPS_SAMPLE_PERIOD;
+	}
+	return GPS_SAMPLE_PERIOD;
+}
+
+
+
+/*** GPRS task ***/
+
+static uint32_t gprs_task(void){
+	uint32_t delay;
+
+	/* A locked SIM stops the bring-up, the GPS task keeps running */
+	if (gprs_get_state()==GPRS_STATE_UP || gprs_get_state()==GPRS_STATE_LOCKED)
+		return GPRS_UP_PERIOD;
+	if (!at_acquire(AT_OWNER_GPRS))
+		return AT_POLL_PERIOD;
+
+	delay=gprs_step();
+
+	/* The port is kept only while a reply is pending, the GPS task can use it during the backoff */
+	if (!gprs_at_pending())
+		at_release();
+	if (gprs_get_state()==GPRS_STATE_UP)
+		scheduler_post_event(EVENT_LINK_UP);
+	return delay;
+}
+
+
+
+/*** Uplink task ***/
+
+#ifdef TRANSPARENT_MODE
+/* The module is in data mode: the message is written as it is */
+static void uplink_write(void){
+	set_AT_data_mode(TRUE);
+	send_serial_data_async(uplink_tx.data,uplink_tx.length);
+	uplink_written_at=HAL_GetTick();
+	uplink_state=UPLINK_ESCAPE_GUARD;
+}
+
+static void uplink_send(void){
+	static const char data_mode_cmd[]="ATO\r";
+	send_AT_cmd_async(data_mode_cmd);
+	uplink_state=UPLINK_DATA_MODE;
+}
+#else
+static void uplink_send(void){
+	char send_tcp_data_cmd[24];
+	sprintf(send_tcp_data_cmd,"AT+CIPSEND=%d\r",(int)uplink_tx.length);
+	send_AT_cmd_async(send_tcp_data_cmd);
+	uplink_state=UPLINK_SEND_CMD;
+}
+#endif
+
+/* Encodes up to BATCH_MAX_FIXES fixes into a new PUBLISH of the in-flight window: the fixes of the flash log first,
+ * they are the oldest, then the queued ones. The batch is closed early when the next fix does not fit its payload,
+ * the fix stays for the next batch. The fixes only leave the queue and the log once the batch is in the window.
+ */
+static void uplink_queue_batch(void){
+	const position_typedef * logged;
+	flash_log_range_typedef stored={0};
+	uint8_t queued=0;
+	uint32_t oldest=HAL_GetTick(); /* the HAL_GetTick() time a logged fix was taken is not kept */
+
+	position_batch_clear(&uplink_batch);
+	while (uplink_batch.count < BATCH_MAX_FIXES && (logged=flash_log_peek())!=NULL){
+		if (position_batch_add(&uplink_batch,logged)==FAIL)
+			break;
+		flash_log_take(&stored);
+	}
+
+	while (queued < fix_queue_count && uplink_batch.count < BATCH_MAX_FIXES){
+		if (position_batch_add(&uplink_batch,&fix_queue[(fix_queue_head+queued)%FIX_QUEUE_LENGTH].position)==FAIL)
+			break;
+		if (uplink_batch.count==1)
+			oldest=fix_queue[fix_queue_head].time;
+		queued++;
+	}
+	if (mqtt_window_add(&topic_template,uplink_batch.data,uplink_batch.length,uplink_batch.count,oldest,&stored)==FAIL){
+		flash_log_rewind(&stored);
+		return;
+	}
+	uplink_fix_count=uplink_batch.count;
+	fix_queue_urgent=FALSE;
+	fix_queue_head=(fix_queue_head+queued)%FIX_QUEUE_LENGTH;
+	fix_queue_count-=queued;
+}
+
+/* Flush triggers of the batch: number of fixes, age of the oldest one, urgent fix, fixes in the flash log. A PINGREQ
+ * that is due is replaced by the fixes already queued. The batch waits while the in-flight window is full, and while
+ * the GPS task waits for the window to empty to erase a flash log page.
+ */
+static uint8_t uplink_batch_ready(void){
+	if ((fix_queue_count==0 && flash_log_unread()==0) || mqtt_window_free()==0 || flash_erase_waiting())
+		return FALSE;
+	return flash_log_unread() > 0 || fix_queue_count >= BATCH_MAX_FIXES || fix_queue_age() >= BATCH_MAX_AGE || fix_queue_urgent
+			|| (uplink_session && HAL_GetTick()-uplink_last_sent >= MQTT_PING_PERIOD);
+}
+
+/* Fills the TX buffer: CONNECT if the session is not open, then the PUBACKs to the server, the new batch and the
+ * packets of the window to be sent again, or a PINGREQ when there is nothing to send. With MQTT-SN, the CONNECT is a
+ * datagram of its own, and so is a PUBACK.
+ */
+static void uplink_build_message(void){
+	uint16_t length;
+
+	tx_buffer_clear(&uplink_tx);
+	uplink_fix_count=0;
+	uplink_publish_count=0;
+	uplink_pingreq=FALSE;
+	#ifdef MQTTSN_MODE
+	#if MQTTSN_QOS >= 0
+	if (!uplink_session){
+		tx_buffer_append_mqttsn_connect(&uplink_tx,&connect_template);
+		return;
+	}
+	#endif
+	#else
+	if (!uplink_session)
+		tx_buffer_append_connect(&uplink_tx,&connect_template);
+	#endif
+	if (uplink_batch_ready())
+		uplink_queue_batch();
+	length=uplink_tx.length;
+	uplink_publish_count=mqtt_window_append(&uplink_tx);
+	if (uplink_publish_count==0 && uplink_tx.length==length){
+		tx_buffer_append(&uplink_tx,pingreq_packet,sizeof(pingreq_packet));
+		uplink_pingreq=TRUE;
+	}
+}
+
+/* The connection was lost: the packets in flight are sent again on the next one */
+static void uplink_session_lost(void){
+	uplink_session=FALSE;
+	uplink_connack_wait=FALSE;
+	uplink_pings_unanswered=0;
+	mqtt_window_resend_all();
+}
+
+/* The server does not answer: no CONNACK to the MQTT-SN CONNECT, or no PINGRESP to the last PINGREQ packets. A
+ * PINGREQ or a CONNECT is given MQTT_RETRY_TIMEOUT for its answer, like a PUBLISH.
+ */
+static uint8_t uplink_unanswered(void){
+	if (HAL_GetTick()-uplink_last_sent < MQTT_RETRY_TIMEOUT)
+		return FALSE;
+	return uplink_connack_wait || uplink_pings_unanswered >= MQTT_MAX_PINGS;
+}
+
+static void uplink_open(const char * address){
+	char tcp_connect_cmd[128];
+	sprintf(tcp_connect_cmd,"AT+CIPSTART=\""UPLINK_TRANSPORT"\",\"%s\",\"%s\"\r",address,endpoint_current()->port);
+	#ifdef DEBUG_MODE
+		send_debug("Uplink: open "UPLINK_TRANSPORT" connection");
+	#endif
+	/* Forget the CONNECT OK and the CLOSED of an earlier connection or of the AT+CIPSTATUS reply */
+	check_AT_urc(URC_CONNECT_OK | URC_CONNECT_FAIL | URC_CONNECT | URC_CLOSED);
+	send_AT_cmd_async(tcp_connect_cmd);
+	uplink_connect_start=HAL_GetTick();
+	uplink_connect_urc=0;
+	uplink_state=UPLINK_CONNECT;
+}
+
+/* Opens the connection to the cached address of the server, or resolves its name first */
+static void uplink_connect(void){
+	char dns_resolve_cmd[96];
+	const char * host=endpoint_select()->host;
+	const char * address=dns_cache_lookup(host);
+
+	if (address!=NULL || dns_is_address(host)){
+		uplink_open((address!=NULL)?address:host);
+		return;
+	}
+	#ifdef DEBUG_MODE
+		send_debug("Uplink: resolve the server name");
+	#endif
+	snprintf(dns_resolve_cmd,sizeof(dns_resolve_cmd),"AT+CDNSGIP=\"%s\"\r",host);
+	send_AT_cmd_async(dns_resolve_cmd);
+	uplink_state=UPLINK_RESOLVE;
+}
+
+/* Reply of AT+CDNSGIP: OK, then the URC with the address, a URC with an error code, or ERROR. The address is the
+ * last field of its line, so the line is complete once its closing quote is followed by the line end.
+ */
+static uint8_t uplink_resolve_reply(char * ip_address){
+	uint8_t reply=poll_AT_reply("\"\r\n",1,task_rx_buffer,DNS_TIMEOUT);
+
+	if (reply==AT_PENDING){
+		if (poll_AT_reply("+CDNSGIP: 0",0,NULL,DNS_TIMEOUT)!=AT_PENDING || poll_AT_reply("ERROR",0,NULL,DNS_TIMEOUT)!=AT_PENDING)
+			return FAIL;
+		return AT_PENDING;
+	}
+	if (reply==FAIL)
+		return FAIL;
+	return get_dns_address(task_rx_buffer,ip_address);
+}
+
+/* The session is lost with the connection: AT+CIPCLOSE, then the recovery step once CLOSE OK is received.
+ * In transparent mode, a module left in data mode takes AT+CIPCLOSE for data: without CLOSE OK, the ladder climbs.
+ */
+static void uplink_fail(uint8_t failure){
+	static const char tcp_disconnect_cmd[]= "AT+CIPCLOSE\r";
+	uplink_failure=failure;
+	uplink_session_lost();
+	send_AT_cmd_async(tcp_disconnect_cmd);
+	uplink_state=UPLINK_CLOSE;
+}
+
+/* Continues the publish from the link state, cached or read with AT+CIPSTATUS. Returns the delay of the task */
+static uint32_t uplink_link_state(uint8_t tcp_status){
+	static const char tcp_disconnect_cmd[]= "AT+CIPCLOSE\r";
+
+	switch(tcp_status){
+	case TCP_STATUS_GPRS_DOWN:
+		/* Hand over to the GPRS task, the packets stay in the window for later */
+		#ifdef DEBUG_MODE
+			send_debug("Uplink: GPRS is down, restart the bring-up");
+		#endif
+		PROFILE_END(PROFILE_ZONE_MQTT_PUBLISH);
+		gprs_restart();
+		mqtt_window_unsent();
+		at_release();
+		uplink_state=UPLINK_IDLE;
+		return TASK_RUN_NOW;
+	case TCP_STATUS_CONNECTED:
+		/* A connection without session, left open by an earlier run: the server may have dropped the session */
+		send_AT_cmd_async(tcp_disconnect_cmd);
+		uplink_state=UPLINK_CLOSE_STALE;
+		break;
+	default:
+		uplink_connect();
+	}
+	return AT_POLL_PERIOD;
+}
+
+/* All the packets of the message were sent at sent_at, the connection stays open for the next one. The PUBLISH
+ * packets wait for their PUBACK in the window.
+ */
+static uint32_t uplink_done(uint32_t sent_at){
+	PROFILE_END(PROFILE_ZONE_MQTT_PUBLISH);
+	/* Every packet sent restarts the keep alive period of the server */
+	link_state_set(TCP_STATUS_CONNECTED);
+	uplink_last_sent=sent_at;
+	uplink_stats.bytes+=uplink_tx.length;
+	uplink_stats.sends++;
+	#if !defined(TRANSPARENT_MODE) && !defined(MQTTSN_MODE)
+	if (tcp_unacked==0)
+		tcp_ack_progress_at=sent_at;
+	tcp_unacked+=uplink_tx.length;
+	#endif
+	mqtt_window_sent();
+	if (uplink_publish_count > 0){
+		uplink_stats.publishes+=uplink_publish_count;
+		#ifdef DEBUG_MODE
+			send_debug("Uplink: message sent");
+		#endif
+		if (uplink_fix_count > 0)
+			HAL_GPIO_TogglePin(GPIOB,GPIO_PIN_12);
+	}
+	/* The CONNECT of a new session is neither a ping nor a PUBACK */
+	else if (uplink_session && uplink_pingreq){
+		uplink_stats.pings++;
+		uplink_pings_unanswered++;
+	}
+	else if (uplink_session)
+		uplink_stats.pubacks++;
+	#if defined(MQTTSN_MODE) && MQTTSN_QOS >= 0
+	/* The CONNECT datagram may be lost, or the gateway restarted: the session opens with the CONNACK. A CONNACK of
+	 * an earlier CONNECT does not count
+	 */
+	if (!uplink_session){
+		mqtt_connack_accepted();
+		uplink_connack_wait=TRUE;
+	}
+	else
+		recovery_report_success();
+	#else
+	uplink_session=TRUE;
+	recovery_report_success();
+	#endif
+	at_release();
+	uplink_state=UPLINK_IDLE;
+	return TASK_RUN_NOW;
+}
+
+/* AT+CIPACK is sent more often while the writes wait for the server */
+static uint32_t uplink_ack_period(void){
+	return (tcp_unacked >= TCP_MAX_UNACKED)?TCP_ACK_FAST_PERIOD:TCP_ACK_CHECK_PERIOD;
+}
+
+/* Delay of the idle task: the next GPS sample, or the next PINGREQ, batch, PUBACK or AT+CIPACK deadline if it
+ * comes first
+ */
+static uint32_t uplink_idle_delay(void){
+	uint32_t delay=GPS_SAMPLE_PERIOD;
+	uint32_t elapsed;
+	uint32_t timeout=mqtt_window_next_timeout();
+
+	/* Nothing is sent before the CONNACK, or its timeout */
+	if (uplink_connack_wait){
+		elapsed=HAL_GetTick()-uplink_last_sent;
+		return (elapsed >= MQTT_RETRY_TIMEOUT)?AT_POLL_PERIOD:MQTT_RETRY_TIMEOUT-elapsed;
+	}
+	/* With the writes blocked only the next ACK check can free them */
+	if (uplink_session && tcp_unacked >= TCP_MAX_UNACKED){
+		elapsed=HAL_GetTick()-tcp_ack_checked_at;
+		return (elapsed >= uplink_ack_period())?AT_POLL_PERIOD:uplink_ack_period()-elapsed;
+	}
+	if (uplink_session){
+		elapsed=HAL_GetTick()-uplink_last_sent;
+		if (elapsed >= MQTT_PING_PERIOD)
+			return AT_POLL_PERIOD;
+		if (MQTT_PING_PERIOD-elapsed < delay)
+			delay=MQTT_PING_PERIOD-elapsed;
+	}
+	if (uplink_session && tcp_unacked > 0){
+		elapsed=HAL_GetTick()-tcp_ack_checked_at;
+		if (elapsed >= uplink_ack_period())
+			return AT_POLL_PERIOD;
+		if (uplink_ack_period()-elapsed < delay)
+			delay=uplink_ack_period()-elapsed;
+	}
+	/* A full window is waited for with the PUBACK deadline, the batches held for a flash erase with its wait */
+	if (flash_erase_waiting()){
+		elapsed=HAL_GetTick()-flash_erase_wait_start;
+		if (FLASH_ERASE_MAX_WAIT-elapsed < delay)
+			delay=FLASH_ERASE_MAX_WAIT-elapsed;
+	}
+	else {
+		if (flash_log_unread() > 0 && mqtt_window_free() > 0)
+			return AT_POLL_PERIOD;
+		if (fix_queue_count > 0 && mqtt_window_free() > 0){
+			elapsed=fix_queue_age();
+			if (elapsed >= BATCH_MAX_AGE)
+				return AT_POLL_PERIOD;
+			if (BATCH_MAX_AGE-elapsed < delay)
+				delay=BATCH_MAX_AGE-elapsed;
+		}
+	}
+	if (timeout==0)
+		return AT_POLL_PERIOD;
+	if (timeout < delay)
+		delay=timeout;
+	return delay;
+}
+
+static uint32_t uplink_task(void){
+	static const char get_tcp_status_cmd[]="AT+CIPSTATUS\r";
+	static const char get_tcp_ack_cmd[]="AT+CIPACK\r";
+	static uint32_t status_sent_at;
+	static uint8_t uplink_refused=0; /* return code of a refused CONNACK, until the connection is closed */
+	uint8_t reply,tcp_status,connack_code,recovery_step;
+	char ip_address[DNS_ADDRESS_LENGTH];
+	uint32_t acked,unacked;
+
+	switch(uplink_state){
+
+	case UPLINK_IDLE:
+		/* Fixes stay in the queue while GPRS is being brought up, EVENT_LINK_UP wakes the task up */
+		if (gprs_get_state()!=GPRS_STATE_UP){
+			if (uplink_session || uplink_connack_wait)
+				uplink_session_lost();
+			return GPS_SAMPLE_PERIOD;
+		}
+		/* CLOSED URC: the server or the network dropped the connection, a new one is opened with the next fix */
+		if (uplink_session && link_state_get()!=TCP_STATUS_CONNECTED){
+			#ifdef DEBUG_MODE
+				send_debug("Uplink: connection closed, the session is reopened with the next fix");
+			#endif
+			uplink_session_lost();
+		}
+		/* PUBACKs received since the last run. The receive buffer is only flushed when no command is pending */
+		if (at_owner==AT_OWNER_NONE)
+			flush_AT_rx();
+		mqtt_poll_rx();
+		if (mqtt_pingresp_received())
+			uplink_pings_unanswered=0;
+		if (uplink_connack_wait && mqtt_connack_accepted()){
+			uplink_connack_wait=FALSE;
+			uplink_session=TRUE;
+			recovery_report_success();
+		}
+		/* The server refused the CONNECT, or does not acknowledge the packets any more */
+		connack_code=mqtt_connack_refused();
+		if (connack_code!=0)
+			uplink_refused=connack_code;
+		if (uplink_refused!=0 || mqtt_window_stalled() || uplink_unanswered()){
+			if (!at_acquire(AT_OWNER_UPLINK))
+				return AT_POLL_PERIOD;
+			#ifdef DEBUG_MODE
+				char debug_msg[64];
+				if (uplink_refused!=0)
+					sprintf(debug_msg,"Uplink: CONNACK refused with code %u",uplink_refused);
+				else if (uplink_connack_wait)
+					sprintf(debug_msg,"Uplink: no CONNACK, the connection is reopened");
+				else if (uplink_pings_unanswered >= MQTT_MAX_PINGS)
+					sprintf(debug_msg,"Uplink: no PINGRESP, the connection is reopened");
+				else
+					sprintf(debug_msg,"Uplink: no PUBACK, the connection is reopened");
+				send_debug(debug_msg);
+			#endif
+			uplink_refused=0;
+			endpoint_report_failure();
+			PROFILE_BEGIN(PROFILE_ZONE_MQTT_PUBLISH);
+			uplink_fail(FAILURE_SOCKET);
+			return AT_POLL_PERIOD;
+		}
+		if (uplink_connack_wait)
+			return uplink_idle_delay();
+		/* How many of the bytes written were acknowledged by the server */
+		if (uplink_session && tcp_unacked > 0 && HAL_GetTick()-tcp_ack_checked_at >= uplink_ack_period()){
+			if (!at_acquire(AT_OWNER_UPLINK))
+				return AT_POLL_PERIOD;
+			PROFILE_BEGIN(PROFILE_ZONE_MQTT_PUBLISH);
+			send_AT_cmd_async(get_tcp_ack_cmd);
+			uplink_state=UPLINK_ACK;
+			return AT_POLL_PERIOD;
+		}
+		if (uplink_session && tcp_unacked >= TCP_MAX_UNACKED)
+			return uplink_idle_delay();
+		if (!uplink_batch_ready() && !mqtt_window_pending() && (!uplink_session || HAL_GetTick()-uplink_last_sent < MQTT_PING_PERIOD))
+			return uplink_idle_delay();
+		if (!at_acquire(AT_OWNER_UPLINK))
+			return AT_POLL_PERIOD;
+
+		uplink_build_message();
+
+		PROFILE_BEGIN(PROFILE_ZONE_MQTT_PUBLISH);
+
+		/* The connection is known to be open while the session is */
+		if (uplink_session){
+			uplink_send();
+			return AT_POLL_PERIOD;
+		}
+
+		/* The link state is only read from the module when the cache is stale or inconsistent */
+		tcp_status=link_state_get();
+		if (tcp_status!=TCP_STATUS_UNKNOWN)
+			return uplink_link_state(tcp_status);
+		send_AT_cmd_async(get_tcp_status_cmd);
+		status_sent_at=HAL_GetTick();
+		uplink_state=UPLINK_STATUS;
+		return AT_POLL_PERIOD;
+
+	case UPLINK_STATUS:
+		if (HAL_GetTick()-status_sent_at < CIPSTATUS_SETTLE)
+			return AT_POLL_PERIOD;
+		reply=poll_AT_reply("STATE:",1,task_rx_buffer,RX_TIMEOUT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		if (reply==FAIL){
+			uplink_fail(FAILURE_MODULE);
+			return AT_POLL_PERIOD;
+		}
+		tcp_status=get_tcp_status(task_rx_buffer);
+		link_state_set(tcp_status);
+		return uplink_link_state(tcp_status);
+
+	case UPLINK_CLOSE_STALE:
+		if (poll_AT_reply("OK",0,NULL,RX_TIMEOUT)==AT_PENDING)
+			return AT_POLL_PERIOD;
+		uplink_connect();
+		return AT_POLL_PERIOD;
+
+	case UPLINK_RESOLVE:
+		reply=uplink_resolve_reply(ip_address);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		/* Without an address, the module resolves the name itself at AT+CIPSTART */
+		if (reply==SUCCESS){
+			dns_cache_store(endpoint_current()->host,ip_address);
+			uplink_open(ip_address);
+		}
+		else
+			uplink_open(endpoint_current()->host);
+		return AT_POLL_PERIOD;
+
+	case UPLINK_CONNECT:
+		/* "OK" is also found in CONNECT OK when the connection opens immediately, the URC is latched anyway */
+		reply=poll_AT_reply("OK",0,NULL,RX_TIMEOUT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		if (reply==FAIL){
+			dns_cache_invalidate(endpoint_current()->host);
+			uplink_fail(FAILURE_NETWORK);
+			return AT_POLL_PERIOD;
+		}
+		/* The handshake with the server takes a network round trip or more: let the GPS task use the port, unless
+		 * the module enters data mode once connected
+		 */
+		#ifndef TRANSPARENT_MODE
+		at_release();
+		#endif
+		uplink_state=UPLINK_WAIT_CONNECT;
+		return AT_POLL_PERIOD;
+
+	case UPLINK_WAIT_CONNECT:
+		if (uplink_connect_urc==0){
+			uplink_connect_urc=check_AT_urc(URC_CONNECT_OK | URC_CONNECT_FAIL | URC_CONNECT);
+			uplink_connect_latency=HAL_GetTick()-uplink_connect_start;
+		}
+		if (uplink_connect_urc==0 && HAL_GetTick()-uplink_connect_start < TCP_CONNECT_TIMEOUT*1000)
+			return AT_POLL_PERIOD;
+		/* The GPS task finishes its query first */
+		if (!at_acquire(AT_OWNER_UPLINK))
+			return AT_POLL_PERIOD;
+		if (uplink_connect_urc & (URC_CONNECT_OK | URC_CONNECT)){
+			endpoint_report_success(uplink_connect_latency);
+			link_state_set(TCP_STATUS_CONNECTED);
+			uplink_stats.connects++;
+			tcp_unacked=0;
+			tcp_acked=0;
+			tcp_ack_checked_at=HAL_GetTick();
+			#ifdef TRANSPARENT_MODE
+			uplink_write();
+			#else
+			uplink_send();
+			#endif
+		}
+		else {
+			/* The server may have moved to another address */
+			dns_cache_invalidate(endpoint_current()->host);
+			endpoint_report_failure();
+			uplink_failover=endpoint_failover();
+			uplink_fail(FAILURE_SOCKET);
+		}
+		return AT_POLL_PERIOD;
+
+	case UPLINK_SEND_CMD:
+		reply=poll_AT_prompt(RX_TIMEOUT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		if (reply==SUCCESS){
+			send_serial_data_async(uplink_tx.data,uplink_tx.length);
+			uplink_state=UPLINK_SEND_DATA;
+		}
+		else
+			uplink_fail(FAILURE_SOCKET);
+		return AT_POLL_PERIOD;
+
+	case UPLINK_SEND_DATA:
+		reply=poll_AT_reply("DATA ACCEPT",0,NULL,RX_TIMEOUT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		if (reply==FAIL){
+			uplink_fail(FAILURE_SOCKET);
+			return AT_POLL_PERIOD;
+		}
+		return uplink_done(HAL_GetTick());
+
+	case UPLINK_ACK:
+		/* ERROR when the connection is closed */
+		reply=poll_AT_reply("\r\nOK",1,task_rx_buffer,RX_TIMEOUT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		if (reply==FAIL || !get_tcp_ack(task_rx_buffer,&acked,&unacked)){
+			uplink_fail(FAILURE_SOCKET);
+			return AT_POLL_PERIOD;
+		}
+		if (acked!=tcp_acked || unacked==0)
+			tcp_ack_progress_at=HAL_GetTick();
+		tcp_acked=acked;
+		tcp_unacked=unacked;
+		tcp_ack_checked_at=HAL_GetTick();
+		if (unacked > 0 && HAL_GetTick()-tcp_ack_progress_at >= TCP_ACK_TIMEOUT){
+			#ifdef DEBUG_MODE
+				send_debug("Uplink: no TCP acknowledgement, the connection is reopened");
+			#endif
+			uplink_fail(FAILURE_SOCKET);
+			return AT_POLL_PERIOD;
+		}
+		PROFILE_END(PROFILE_ZONE_MQTT_PUBLISH);
+		at_release();
+		uplink_state=UPLINK_IDLE;
+		return TASK_RUN_NOW;
+
+	#ifdef TRANSPARENT_MODE
+	case UPLINK_DATA_MODE:
+		reply=poll_AT_reply("CONNECT",0,NULL,RX_TIMEOUT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		if (reply==SUCCESS)
+			uplink_write();
+		else
+			uplink_fail(FAILURE_SOCKET);
+		return AT_POLL_PERIOD;
+
+	case UPLINK_ESCAPE_GUARD:
+		/* The PUBACKs received meanwhile are TCP data, taken out of the receive buffer by set_AT_data_mode() */
+		if (HAL_GetTick()-uplink_written_at < ESCAPE_GUARD_TIME)
+			return ESCAPE_GUARD_TIME-(HAL_GetTick()-uplink_written_at);
+		set_AT_data_mode(FALSE);
+		send_AT_cmd_async("+++");
+		uplink_state=UPLINK_ESCAPE;
+		return ESCAPE_GUARD_TIME;
+
+	case UPLINK_ESCAPE:
+		/* OK comes after the second guard time */
+		reply=poll_AT_reply("OK",0,NULL,ESCAPE_GUARD_TIME+RX_TIMEOUT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		if (reply==FAIL){
+			uplink_fail(FAILURE_SOCKET);
+			return AT_POLL_PERIOD;
+		}
+		return uplink_done(uplink_written_at);
+	#endif
+
+	case UPLINK_CLOSE:
+		reply=poll_AT_reply("CLOSE OK",0,NULL,RX_TIMEOUT);
+		if (reply==AT_PENDING)
+			return AT_POLL_PERIOD;
+		/* Without CLOSE OK, the state of the connection is not known */
+		if (reply==SUCCESS)
+			link_state_set(TCP_STATUS_READY);
+		else
+			link_state_invalidate();
+		/* Another server is tried at once, the ladder does not climb */
+		if (uplink_failover){
+			uplink_failover=FALSE;
+			#ifdef DEBUG_MODE
+				send_debug("Uplink: connection failed, fail over to the next server");
+			#endif
+			uplink_connect();
+			return AT_POLL_PERIOD;
+		}
+		PROFILE_END(PROFILE_ZONE_MQTT_PUBLISH);
+		#ifdef DEBUG_MODE
+			send_debug("Uplink: FAIL");
+		#endif
+		/* Blocking, the GPS task waits for the AT port meanwhile */
+		recovery_step=recovery_report_failure(uplink_failure);
+		if (recovery_step==RECOVERY_SYSTEM_RESET){
+			fix_queue_save();
+			dns_cache_save();
+		}
+		recovery_run(tasks_sim,recovery_step);
+		at_release();
+		uplink_state=UPLINK_IDLE;
+		return TASK_RUN_NOW;
+	}
+	return GPS_SAMPLE_PERIOD;
+}
+
+/* Cost of the uplink since the last report: bytes of MQTT packets per acknowledged fix, and latency from the oldest
+ * fix of a batch to its PUBACK
+ */
+static void uplink_report(void){
+	char debug_msg[264];
+	mqtt_stats_typedef mqtt;
+
+	mqtt_get_stats(&mqtt);
+	snprintf(debug_msg,sizeof(debug_msg),"Uplink: %lu fixes acked in %lu publishes, %lu sent, %lu resent, %lu sends, %lu connects, %lu pings (%lu answered), %lu PUBACK sends, %lu B/fix, latency avg %lu ms max %lu ms",
+			(unsigned long)mqtt.items,(unsigned long)mqtt.acked,(unsigned long)uplink_stats.publishes,
+			(unsigned long)mqtt.retransmitted,(unsigned long)uplink_stats.sends,
+			(unsigned long)uplink_stats.connects,(unsigned long)uplink_stats.pings,(unsigned long)mqtt.pingresps,
+			(unsigned long)uplink_stats.pubacks,
+			(unsigned long)(mqtt.items?uplink_stats.bytes/mqtt.items:0),
+			(unsigned long)(mqtt.acked?mqtt.latency_total/mqtt.acked:0),(unsigned long)mqtt.latency_max);
+	send_debug(debug_msg);
+	endpoint_report();
+	memset(&uplink_stats,0,sizeof(uplink_stats));
+}
+
+
+
+#ifdef DEBUG_MODE
+/* Nothing is subscribed yet: a PUBLISH from the server is only reported */
+static void uplink_downlink(const char * topic, uint16_t topic_length, const uint8_t * data, uint16_t length, uint32_t offset, uint32_t total){
+	char debug_msg[40+MQTT_RX_TOPIC_LENGTH];
+
+	if (offset+length < total)
+		return;
+	snprintf(debug_msg,sizeof(debug_msg),"Uplink: downlink of %lu bytes on %.*s",(unsigned long)total,(int)topic_length,topic);
+	send_debug(debug_msg);
+}
+#endif
+
+
+
+/*** Log task ***/
+
+static uint32_t log_task(void){
+	#ifdef PROFILER_MODE
+	profiler_poll();
+	#endif
+	debug_log_flush();
+	return LOG_PERIOD;
+}
+
+
+
+/*** Health task ***/
+
+static uint32_t health_task(void){
+	static uint32_t last_power_report=0;
+	static uint32_t last_uplink_report=0;
+	char debug_msg[64];
+
+	/* The watchdog resets the MCU if the scheduler stops running this task */
+	watchdog_refresh();
+
+	if (fixes_dropped!=reported_fixes_dropped){
+		reported_fixes_dropped=fixes_dropped;
+		sprintf(debug_msg,"Health: fix queue full, %lu fixes dropped",(unsigned long)fixes_dropped);
+		send_debug(debug_msg);
+	}
+
+	if (flash_log_dropped()!=reported_flash_dropped){
+		reported_flash_dropped=flash_log_dropped();
+		sprintf(debug_msg,"Health: flash log full, %lu fixes dropped",(unsigned long)reported_flash_dropped);
+		send_debug(debug_msg);
+	}
+
+	if (tcp_data_dropped()!=reported_tcp_dropped){
+		reported_tcp_dropped=tcp_data_dropped();
+		sprintf(debug_msg,"Health: TCP receive FIFO full, %lu bytes dropped",(unsigned long)reported_tcp_dropped);
+		send_debug(debug_msg);
+	}
+
+	/* Report every new worst case run time above MAX_TASK_RUN_MS */
+	for(uint8_t i=0; i<TASK_COUNT; i++){
+		if (tasks[i].max_run_ms > MAX_TASK_RUN_MS && tasks[i].max_run_ms > reported_run_ms[i]){
+			reported_run_ms[i]=tasks[i].max_run_ms;
+			sprintf(debug_msg,"Health: task %s ran for %lu ms",tasks[i].name,(unsigned long)tasks[i].max_run_ms);
+			send_debug(debug_msg);
+		}
+	}
+
+	if (HAL_GetTick()-last_power_report >= POWER_REPORT_PERIOD){
+		last_power_report=HAL_GetTick();
+		power_report();
+	}
+
+	if (HAL_GetTick()-last_uplink_report >= UPLINK_REPORT_PERIOD){
+		last_uplink_report=HAL_GetTick();
+		uplink_report();
+	}
+	return HEALTH_PERIOD;
+}
+
+
+
+/*** Idle ***/
+
+static void tasks_idle(uint32_t sleep_ms){
+	/* USART2 is stopped in STOP mode: only sleep while debug messages are being sent */
+	if (debug_log_busy())
+		sleep_ms=0;
+	power_idle(sleep_ms);
+}
+
+
+
+void tasks_run(SIM808_typedef * sim, const endpoint_typedef * endpoints, uint8_t endpoint_count){
+	tasks_sim=sim;
+	endpoint_init(endpoints,endpoint_count);
+
+	/* From now on, debug messages are sent in the background by the log task */
+	debug_log_start_async();
+	flash_log_init();
+	dns_cache_init();
+	#ifdef DEBUG_MODE
+	if (flash_log_count() > 0){
+		char debug_msg[48];
+		sprintf(debug_msg,"Flash log: %u fixes to upload",flash_log_count());
+		send_debug(debug_msg);
+	}
+	mqtt_set_downlink_handler(uplink_downlink);
+	#endif
+	watchdog_start();
+	gprs_restart();
+
+	scheduler_run(tasks,TASK_COUNT,tasks_idle);
+}
@@ -0,0 +1,133 @@
+# ctypes binding of the packet builders of the firmware, used by load_generator.py so that the virtual trackers send
+# the bytes the firmware itself builds instead of a Python copy of the builders.
+#
+# Firmware/Core/Src/network_functions.c and position.c are built for the host as a shared library, together with
+# firmware_stubs.c which stubs the HAL and SIM808 functions they reference. the library is built with gcc at the first
+# use, and again when one of its sources changed. MQTTSN_QOS is chosen at compile time in the firmware: there is one
+# library per QoS given, and libtracker.so with the one of network_functions.h.
+
+import ctypes
+import os
+import subprocess
+
+SERVER = os.path.dirname(os.path.abspath(__file__))
+FIRMWARE = os.path.join(SERVER, os.pardir, "Firmware")
+SOURCES = [
+    os.path.join(FIRMWARE, "Core", "Src", "network_functions.c"),
+    os.path.join(FIRMWARE, "Core", "Src", "position.c"),
+    os.path.join(SERVER, "firmware_stubs.c"),
+]
+INCLUDES = [
+    os.path.join(FIRMWARE, "Core", "Inc"),
+    os.path.join(FIRMWARE, "Drivers", "STM32F0xx_HAL_Driver", "Inc"),
+    os.path.join(FIRMWARE, "Drivers", "CMSIS", "Device", "ST", "STM32F0xx", "Include"),
+    os.path.join(FIRMWARE, "Drivers", "CMSIS", "Include"),
+]
+BUILD_DIR = os.path.join(SERVER, "build")
+CC = os.environ.get("CC", "gcc")
+
+SUCCESS = 1
+
+
+class Position(ctypes.Structure):
+    # position_typedef of position.h
+    _fields_ = [("time", ctypes.c_uint32), ("latitude", ctypes.c_int32), ("longitude", ctypes.c_int32),
+                ("altitude", ctypes.c_int16), ("speed", ctypes.c_uint16), ("course", ctypes.c_uint16),
+                ("satellites", ctypes.c_uint8), ("flags", ctypes.c_uint8)]
+
+
+def _build(path, qos):
+    # the headers are not listed one by one: any change in Core/Inc rebuilds the library
+    inputs = SOURCES + [os.path.join(INCLUDES[0], name) for name in os.listdir(INCLUDES[0])]
+    if os.path.exists(path) and os.path.getmtime(path) >= max(os.path.getmtime(name) for name in inputs):
+        return
+    os.makedirs(BUILD_DIR, exist_ok=True)
+    command = [CC, "-shared", "-fPIC", "-O2", "-w", "-DUSE_HAL_DRIVER", "-DSTM32F051x8"]
+    if qos is not None:
+        command.append("-DMQTTSN_QOS=%d" % qos)
+    command += ["-I" + include for include in INCLUDES] + SOURCES + ["-o", path]
+    subprocess.run(command, check=True)
+
+
+class Firmware:
+    def __init__(self, mqttsn_qos=None):
+        # mqttsn_qos overrides MQTTSN_QOS, -1, 0 or 1
+        if mqttsn_qos is None:
+            path = os.path.join(BUILD_DIR, "libtracker.so")
+        else:
+            path = os.path.join(BUILD_DIR, "libtracker_qos%d.so" % (mqttsn_qos + 1))
+        _build(path, mqttsn_qos)
+        lib = ctypes.CDLL(path)
+
+        self.tx_buffer_length = ctypes.c_uint16.in_dll(lib, "host_tx_buffer_length").value
+        self.batch_length = ctypes.c_uint16.in_dll(lib, "host_position_batch_length").value
+        self.keep_alive = ctypes.c_uint16.in_dll(lib, "host_mqtt_keep_alive").value
+        self.mqttsn_topic_id = ctypes.c_uint16.in_dll(lib, "host_mqttsn_topic_id").value
+        self.mqttsn_qos = ctypes.c_int8.in_dll(lib, "host_mqttsn_qos").value
+
+        # tx_buffer_typedef and position_batch_typedef, sized from the firmware
+        class TxBuffer(ctypes.Structure):
+            _fields_ = [("data", ctypes.c_uint8 * self.tx_buffer_length), ("length", ctypes.c_uint16)]
+
+        class PositionBatch(ctypes.Structure):
+            _fields_ = [("data", ctypes.c_uint8 * self.batch_length), ("length", ctypes.c_uint16),
+                        ("count", ctypes.c_uint8), ("previous", Position)]
+
+        self._TxBuffer = TxBuffer
+        self._PositionBatch = PositionBatch
+
+        u8p = ctypes.POINTER(ctypes.c_uint8)
+        lib.build_mqtt_connect_packet.argtypes = [u8p, ctypes.c_uint16, ctypes.c_char_p]
+        lib.build_mqtt_connect_packet.restype = ctypes.c_uint16
+        lib.build_mqtt_publish_packet.argtypes = [u8p, ctypes.c_uint16, ctypes.c_char_p, ctypes.c_uint16,
+                                                  ctypes.c_char_p, ctypes.c_uint16]
+        lib.build_mqtt_publish_packet.restype = ctypes.c_uint16
+        lib.build_mqttsn_publish_packet.argtypes = [u8p, ctypes.c_uint16, ctypes.c_uint16, ctypes.c_uint16,
+                                                    ctypes.c_char_p, ctypes.c_uint16]
+        lib.build_mqttsn_publish_packet.restype = ctypes.c_uint16
+        lib.host_append_mqttsn_connect.argtypes = [ctypes.POINTER(TxBuffer), ctypes.c_char_p]
+        lib.host_append_mqttsn_connect.restype = ctypes.c_uint8
+        lib.position_batch_clear.argtypes = [ctypes.POINTER(PositionBatch)]
+        lib.position_batch_clear.restype = None
+        lib.position_batch_add.argtypes = [ctypes.POINTER(PositionBatch), ctypes.POINTER(Position)]
+        lib.position_batch_add.restype = ctypes.c_uint8
+        self._lib = lib
+
+    def _packet(self, builder, *args):
+        buffer = (ctypes.c_uint8 * self.tx_buffer_length)()
+        length = builder(buffer, self.tx_buffer_length, *args)
+        if length == 0:
+            raise ValueError("the packet does not fit TX_BUFFER_LENGTH")
+        return bytes(buffer[:length])
+
+    def connect_packet(self, client_id):
+        # build_mqtt_connect_packet(): protocol level 4, clean session, keep alive MQTT_KEEP_ALIVE
+        return self._packet(self._lib.build_mqtt_connect_packet, client_id.encode())
+
+    def publish_packet(self, topic, message, packet_id=0):
+        # build_mqtt_publish_packet(): QoS 0 without a packet identifier, QoS 1 otherwise
+        return self._packet(self._lib.build_mqtt_publish_packet, topic.encode(), packet_id, message, len(message))
+
+    def mqttsn_connect_packet(self, client_id):
+        # header of MQTTSN_CONNECT_TEMPLATE()
+        tx = self._TxBuffer()
+        if self._lib.host_append_mqttsn_connect(ctypes.byref(tx), client_id.encode()) != SUCCESS:
+            raise ValueError("client ID too long")
+        return bytes(tx.data[:tx.length])
+
+    def mqttsn_publish_packet(self, message, msg_id=0):
+        # build_mqttsn_publish_packet(): predefined MQTTSN_TOPIC_ID, QoS MQTTSN_QOS of the library
+        return self._packet(self._lib.build_mqttsn_publish_packet, self.mqttsn_topic_id, msg_id, message, len(message))
+
+    def encode_batch(self, positions):
+        # position_batch_add(): returns the payload and the number of fixes it holds, the first ones of positions.
+        # like the uplink, the fixes that do not fit POSITION_BATCH_LENGTH are left for the next batch
+        batch = self._PositionBatch()
+        self._lib.position_batch_clear(ctypes.byref(batch))
+        count = 0
+        for position in positions:
+            if self._lib.position_batch_add(ctypes.byref(batch), ctypes.byref(Position(*position))) != SUCCESS:
+                break
+            count += 1
+        return bytes(batch.data[:batch.length]), count
+
@@ -0,0 +1,90 @@
+/**
+*	@file firmware_stubs.c
+*	@brief Host build of the packet builders of the firmware, loaded by firmware.py.
+*
+*	network_functions.c and position.c are built for the host with this file, as a shared library. The HAL and SIM808
+*	functions they reference are only called by the AT functions, which are not used on the host: they are stubbed
+*	here and do nothing. The constants the caller needs are exported, so that they are not copied into Python.
+*
+*	@author Mohamed Boubaker
+*/
+#include <string.h>
+
+#include "sim808.h"
+#include "network_functions.h"
+#include "position.h"
+
+const uint16_t host_tx_buffer_length=TX_BUFFER_LENGTH;
+const uint16_t host_position_batch_length=POSITION_BATCH_LENGTH;
+const uint16_t host_mqtt_keep_alive=MQTT_KEEP_ALIVE;
+const uint16_t host_mqttsn_topic_id=MQTTSN_TOPIC_ID;
+const int8_t host_mqttsn_qos=MQTTSN_QOS;
+
+
+/**
+ * @brief builds the MQTT-SN CONNECT message of a client ID given at run time, with the header of
+ * MQTTSN_CONNECT_TEMPLATE(), which only takes a string literal.
+ * @param tx is the TX buffer the message is appended to.
+ * @param client_id is the client ID, at most MQTT_CLIENT_ID_MAX_LENGTH characters.
+ * @return SUCCESS if the message was appended, FAIL otherwise.
+ */
+uint8_t host_append_mqttsn_connect(tx_buffer_typedef * tx, const char * client_id){
+	mqttsn_connect_template_typedef connect=MQTTSN_CONNECT_TEMPLATE("");
+	size_t length=strlen(client_id);
+
+	if (length > MQTT_CLIENT_ID_MAX_LENGTH)
+		return FAIL;
+	memcpy(connect.client_id,client_id,length);
+	connect.header[0]+=length;
+	return tx_buffer_append_mqttsn_connect(tx,&connect);
+}
+
+
+/* Only called by the AT functions */
+
+void HAL_Delay(uint32_t delay){
+	(void)delay;
+}
+
+uint32_t HAL_GetTick(void){
+	return 0;
+}
+
+void send_debug(const char * debug_msg){
+	(void)debug_msg;
+}
+
+void send_raw_debug(uint8_t * debug_dump, uint16_t length){
+	(void)debug_dump;
+	(void)length;
+}
+
+uint8_t send_AT_cmd(const char * cmd, const char * expected_reply, uint8_t save_reply, char * cmd_reply, uint32_t rx_timeout){
+	(void)cmd;
+	(void)expected_reply;
+	(void)save_reply;
+	(void)cmd_reply;
+	(void)rx_timeout;
+	return FAIL;
+}
+
+uint8_t send_serial_data(uint8_t * data, uint16_t length, char * cmd_reply, uint32_t rx_wait){
+	(void)data;
+	(void)length;
+	(void)cmd_reply;
+	(void)rx_wait;
+	return FAIL;
+}
+
+uint8_t check_AT_urc(uint8_t urc){
+	(void)urc;
+	return 0;
+}
+
+uint8_t is_subarray_present(const uint8_t * array, size_t array_len, const uint8_t * subarray, size_t subarray_len){
+	(void)array;
+	(void)array_len;
+	(void)subarray;
+	(void)subarray_len;
+	return FALSE;
+}
@@ -0,0 +1,438 @@
+#this script simulates a fleet of GPS trackers publishing to a local MQTT server on the topic "P"
+# it is used to size the server side before adding more trackers to the fleet.
+
+# every virtual tracker follows a synthetic trajectory and reports its position the same way the firmware does:
+# one long-lived TCP connection, CONNECT once, then one PUBLISH per batch of positions and a PINGREQ when nothing was sent
+# for MQTT_PING_PERIOD. the packets and the binary batches are built by the code of the firmware itself,
+# Firmware/Core/Src/network_functions.c and position.c built for the host and called through ctypes, see firmware.py.
+# fixes are batched like in the firmware: up to --batch positions per PUBLISH, flushed when the batch is full, when
+# its oldest fix is BATCH_MAX_AGE old or when a PINGREQ would be due.
+# the batches are published with QoS 1 and a packet identifier, like the in-flight window of the firmware (mqtt.c),
+# so that the server does the same PUBACK work. the PUBACKs are not checked and nothing is sent again.
+# with --per-fix-connection the trackers use the former scheme instead: one TCP connection per position carrying
+# the CONNECT, PUBLISH and DISCONNECT packets, to compare both.
+# the payload is the binary batch of position_batch_add(), the fixes that do not fit POSITION_BATCH_LENGTH are left
+# for the next PUBLISH like in the firmware. with --ascii the trackers send the former payload instead, the substring
+# copied from the +CGPSINF reply: ddmm.mmmmmm,dddmm.mmmmmm separated by ";", to compare the bytes sent per position.
+# with --mqtt-sn the trackers send MQTT-SN datagrams to mqttsn_gateway.py instead, like a firmware built with
+# MQTTSN_MODE: CONNECT in a datagram of its own (none with --qos -1), then one datagram per PUBLISH or PINGREQ.
+# --qos builds the firmware with this MQTTSN_QOS, the one of network_functions.h by default.
+
+# a subscriber listens on the same topic and matches every received payload with the time it was sent.
+# at the end the script reports the sustained messages/sec, the ingestion lag, the loss, and the cost of a report
+# on the tracker side: MQTT bytes sent per position, TCP connections opened and publish latency (from the fix to the
+# packets handed to the network, including the TCP handshake when there is one). the bytes on the air also count
+# the IP headers: 20 + 20 B per TCP segment and 20 + 8 B per UDP datagram, the TCP handshake and close are counted
+# as 2 more segments sent by the tracker per connection (SYN, then the FIN of the close) and the TCP ACKs are left out.
+#
+# usage example: python3 load_generator.py --trackers 2000 --interval 2 --duration 60
+#                python3 load_generator.py --trackers 2000 --interval 2 --duration 60 --per-fix-connection
+#                python3 load_generator.py --trackers 2000 --interval 2 --duration 60 --mqtt-sn --qos 1
+
+import argparse
+import asyncio
+import math
+import random
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+import firmware
+import position_record
+
+# same values as MQTT_PING_MARGIN and the topic in tasks.h, a PINGREQ is sent MQTT_PING_MARGIN s before MQTT_KEEP_ALIVE
+# expires
+MQTT_PING_MARGIN = 3
+TOPIC = "P"
+# same values as BATCH_MAX_FIXES and BATCH_MAX_AGE in tasks.h
+BATCH_MAX_FIXES = 8
+BATCH_MAX_AGE = 10
+# between the fixes of an ASCII payload
+BATCH_SEPARATOR = b";"
+# IP and transport headers of a packet sent by the tracker
+TCP_OVERHEAD = 40
+UDP_OVERHEAD = 28
+
+
+def next_packet_id(packet_id):
+    # like mqtt_new_packet_id(): 0 is skipped
+    packet_id = (packet_id + 1) & 0xffff
+    return packet_id or 1
+
+
+DISCONNECT_PACKET = bytes([0xe0, 0x00])
+PINGREQ_PACKET = bytes([0xc0, 0x00])
+
+
+MQTTSN_PINGREQ_PACKET = bytes([0x02, 0x16])
+
+
+def to_ddmm(value):
+    # converts decimal degrees to the ddmm.mmmmmm format returned by the SIM808
+    degrees = math.floor(value)
+    minutes = (value - degrees) * 60
+    return "%d%09.6f" % (degrees, minutes)
+
+
+class Trajectory:
+    # a random walk with smooth heading changes, roughly a vehicle driving at 30-90 km/h
+    def __init__(self, rnd):
+        self.lat = rnd.uniform(36.0, 37.5)
+        self.lon = rnd.uniform(10.0, 11.0)
+        self.heading = rnd.uniform(0, 2 * math.pi)
+        self.speed = rnd.uniform(8.0, 25.0)  # m/s
+        self.altitude = rnd.randint(0, 500)  # m
+        self.rnd = rnd
+
+    def step(self, dt):
+        self.heading += self.rnd.gauss(0, 0.2)
+        d = self.speed * dt / 111320.0
+        self.lat += d * math.cos(self.heading)
+        self.lon += d * math.sin(self.heading) / math.cos(math.radians(self.lat))
+        self.altitude += self.rnd.randint(-2, 2)
+        return position_record.Position(
+            time=int(time.time()) - position_record.EPOCH,
+            latitude=round(self.lat * 1e7),
+            longitude=round(self.lon * 1e7),
+            altitude=self.altitude,
+            speed=round(self.speed * 100),
+            course=round(math.degrees(self.heading) * 100) % 36000,
+            satellites=self.rnd.randint(6, 12),
+            flags=position_record.FLAG_3D)
+
+
+def ascii_fix(position):
+    # 11 + 1 + 11 = 23 bytes = GPS_COORDINATES_LENGTH
+    return (to_ddmm(position.latitude / 1e7) + "," + to_ddmm(position.longitude / 1e7)).encode()
+
+
+def batch_payload(fw, fixes, ascii_payload):
+    # returns the payload and the number of fixes it holds, the first ones of fixes
+    if ascii_payload:
+        return BATCH_SEPARATOR.join(ascii_fix(fix) for fix in fixes), len(fixes)
+    return fw.encode_batch(fixes)
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.pending = {}  # fix (a Position, or its ASCII text with --ascii) -> list of send timestamps
+        self.sent = 0
+        self.failed = 0
+        self.received = 0
+        self.unknown = 0
+        self.lags = []
+        self.bytes = 0
+        self.writes = 0  # TCP segments or UDP datagrams, one per write
+        self.connections = 0
+        self.pings = 0
+        self.publish_latencies = []
+
+    def on_sent(self, payload, t):
+        with self.lock:
+            self.sent += 1
+            self.pending.setdefault(payload, []).append(t)
+
+    def on_received(self, payload, t):
+        # a batched payload carries several fixes, each one is matched on its own
+        if payload[:1] == bytes([position_record.FORMAT_VERSION]):
+            try:
+                fixes = position_record.decode_batch(payload)
+            except position_record.FormatError:
+                fixes = [payload]
+        else:
+            fixes = payload.split(BATCH_SEPARATOR)
+        with self.lock:
+            for fix in fixes:
+                stamps = self.pending.get(fix)
+                if not stamps:
+                    self.unknown += 1
+                    continue
+                self.received += 1
+                self.lags.append(t - stamps.pop(0))
+                if not stamps:
+                    del self.pending[fix]
+
+    def on_written(self, length, connected=False, ping=False):
+        with self.lock:
+            self.bytes += length
+            self.writes += 1
+            self.connections += 1 if connected else 0
+            self.pings += 1 if ping else 0
+
+
+async def per_fix_tracker(index, args, fw, stats, stop_at):
+    rnd = random.Random(args.seed + index)
+    trajectory = Trajectory(rnd)
+    client_id = "V%d" % index
+    connect = fw.connect_packet(client_id)
+
+    # spread the first reports over one interval so that the trackers do not publish in lockstep
+    await asyncio.sleep(rnd.uniform(0, args.interval))
+    while time.monotonic() < stop_at:
+        started = time.monotonic()
+        fix = trajectory.step(args.interval)
+        key = ascii_fix(fix) if args.ascii else fix
+        try:
+            reader, writer = await asyncio.wait_for(asyncio.open_connection(args.host, args.port), 5)
+            # the three packets in one write, like the single AT+CIPSEND of publish_mqtt_msg()
+            publish = fw.publish_packet(TOPIC, batch_payload(fw, [fix], args.ascii)[0])
+            writer.write(connect + publish + DISCONNECT_PACKET)
+            stats.on_sent(key, time.monotonic())
+            await writer.drain()
+            stats.publish_latencies.append(time.monotonic() - started)
+            stats.on_written(len(connect) + len(publish) + len(DISCONNECT_PACKET), connected=True)
+            writer.close()
+            await writer.wait_closed()
+        except (OSError, asyncio.TimeoutError):
+            stats.failed += 1
+        await asyncio.sleep(max(0.0, args.interval - (time.monotonic() - started)))
+
+
+async def discard(reader):
+    # CONNACK, PUBACK and PINGRESP are not checked
+    try:
+        while await reader.read(256):
+            pass
+    except OSError:
+        pass
+
+
+async def persistent_tracker(index, args, fw, stats, stop_at):
+    rnd = random.Random(args.seed + index)
+    trajectory = Trajectory(rnd)
+    client_id = "V%d" % index
+    connect = fw.connect_packet(client_id)
+    ping_period = fw.keep_alive - MQTT_PING_MARGIN
+    writer = None
+    last_sent = 0.0
+    batch = []  # (fix, time it was taken)
+    urgent = True  # like the firmware, the first fix after boot is published right away
+    packet_id = 0
+
+    await asyncio.sleep(rnd.uniform(0, args.interval))
+    next_report = time.monotonic()
+    while time.monotonic() < stop_at:
+        now = time.monotonic()
+        if now >= next_report:
+            next_report += args.interval
+            batch.append((trajectory.step(args.interval), now))
+        # same flush triggers as uplink_batch_ready() in tasks.c
+        ping_due = writer is not None and now - last_sent >= ping_period
+        flush = batch and (urgent or len(batch) >= args.batch or now - batch[0][1] >= BATCH_MAX_AGE or ping_due)
+        try:
+            if flush:
+                packets = b""
+                connected = writer is None
+                # the session is reopened lazily, with the next position
+                if connected:
+                    reader, writer = await asyncio.wait_for(asyncio.open_connection(args.host, args.port), 5)
+                    asyncio.ensure_future(discard(reader))
+                    packets += connect
+                packet_id = next_packet_id(packet_id)
+                payload, count = batch_payload(fw, [fix for fix, taken in batch], args.ascii)
+                packets += fw.publish_packet(TOPIC, payload, packet_id)
+                writer.write(packets)
+                for fix, taken in batch[:count]:
+                    stats.on_sent(ascii_fix(fix) if args.ascii else fix, time.monotonic())
+                await writer.drain()
+                for fix, taken in batch[:count]:
+                    stats.publish_latencies.append(time.monotonic() - taken)
+                stats.on_written(len(packets), connected=connected)
+                last_sent = time.monotonic()
+                batch = batch[count:]
+                urgent = False
+            elif ping_due:
+                writer.write(PINGREQ_PACKET)
+                await writer.drain()
+                stats.on_written(len(PINGREQ_PACKET), ping=True)
+                last_sent = time.monotonic()
+        except (OSError, asyncio.TimeoutError):
+            # the batch is kept for the next attempt, like the fixes put back in the queue by the firmware
+            stats.failed += 1
+            if writer is not None:
+                writer.close()
+            writer = None
+        wake_at = next_report
+        if writer is not None:
+            wake_at = min(wake_at, last_sent + ping_period)
+        if batch:
+            wake_at = min(wake_at, batch[0][1] + BATCH_MAX_AGE)
+        await asyncio.sleep(max(0.0, wake_at - time.monotonic()))
+
+    if writer is not None:
+        writer.write(DISCONNECT_PACKET)
+        writer.close()
+
+
+class Datagrams(asyncio.DatagramProtocol):
+    # CONNACK, PUBACK and PINGRESP are not checked
+    def datagram_received(self, data, address):
+        pass
+
+
+async def mqttsn_tracker(index, args, fw, stats, stop_at):
+    # same batching as persistent_tracker(), the session is opened once since UDP has no connection to lose
+    rnd = random.Random(args.seed + index)
+    trajectory = Trajectory(rnd)
+    connect = fw.mqttsn_connect_packet("V%d" % index)
+    ping_period = fw.keep_alive - MQTT_PING_MARGIN
+    loop = asyncio.get_running_loop()
+    transport = None
+    last_sent = 0.0
+    batch = []
+    urgent = True
+    msg_id = 0
+
+    await asyncio.sleep(rnd.uniform(0, args.interval))
+    next_report = time.monotonic()
+    while time.monotonic() < stop_at:
+        now = time.monotonic()
+        if now >= next_report:
+            next_report += args.interval
+            batch.append((trajectory.step(args.interval), now))
+        ping_due = transport is not None and now - last_sent >= ping_period
+        flush = batch and (urgent or len(batch) >= args.batch or now - batch[0][1] >= BATCH_MAX_AGE or ping_due)
+        try:
+            if flush:
+                if transport is None:
+                    transport, protocol = await loop.create_datagram_endpoint(
+                        Datagrams, remote_addr=(args.gateway or args.host, args.gateway_port))
+                    if fw.mqttsn_qos >= 0:
+                        transport.sendto(connect)
+                        stats.on_written(len(connect), connected=True)
+                msg_id = next_packet_id(msg_id)
+                payload, count = batch_payload(fw, [fix for fix, taken in batch], args.ascii)
+                publish = fw.mqttsn_publish_packet(payload, msg_id)
+                # the datagram may reach the subscriber before sendto() returns
+                for fix, taken in batch[:count]:
+                    stats.on_sent(ascii_fix(fix) if args.ascii else fix, time.monotonic())
+                transport.sendto(publish)
+                for fix, taken in batch[:count]:
+                    stats.publish_latencies.append(time.monotonic() - taken)
+                stats.on_written(len(publish))
+                last_sent = time.monotonic()
+                batch = batch[count:]
+                urgent = False
+            elif ping_due:
+                transport.sendto(MQTTSN_PINGREQ_PACKET)
+                stats.on_written(len(MQTTSN_PINGREQ_PACKET), ping=True)
+                last_sent = time.monotonic()
+        except OSError:
+            stats.failed += 1
+            if transport is not None:
+                transport.close()
+            transport = None
+        wake_at = next_report
+        if transport is not None:
+            wake_at = min(wake_at, last_sent + ping_period)
+        if batch:
+            wake_at = min(wake_at, batch[0][1] + BATCH_MAX_AGE)
+        await asyncio.sleep(max(0.0, wake_at - time.monotonic()))
+
+    if transport is not None:
+        transport.close()
+
+
+async def run_fleet(args, fw, stats):
+    stop_at = time.monotonic() + args.duration
+    if args.mqtt_sn:
+        tracker = mqttsn_tracker
+    else:
+        tracker = per_fix_tracker if args.per_fix_connection else persistent_tracker
+    await asyncio.gather(*(tracker(i, args, fw, stats, stop_at) for i in range(args.trackers)))
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Virtual GPS tracker fleet for load testing the MQTT server")
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--trackers", type=int, default=1000, help="number of virtual trackers")
+    parser.add_argument("--interval", type=float, default=2.0, help="seconds between two reports of a tracker")
+    parser.add_argument("--duration", type=float, default=60.0, help="length of the test in seconds")
+    parser.add_argument("--drain", type=float, default=5.0, help="seconds to wait for late messages at the end")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--batch", type=int, default=BATCH_MAX_FIXES,
+                        help="fixes per PUBLISH with a persistent session, 1 to publish every fix on its own")
+    parser.add_argument("--ascii", action="store_true",
+                        help="send the former ASCII payload instead of the binary records")
+    parser.add_argument("--per-fix-connection", action="store_true",
+                        help="one TCP connection and MQTT session per report instead of a persistent session")
+    parser.add_argument("--mqtt-sn", action="store_true",
+                        help="send MQTT-SN datagrams to mqttsn_gateway.py instead of MQTT over TCP")
+    parser.add_argument("--gateway", default=None, help="host of the MQTT-SN gateway, --host by default")
+    parser.add_argument("--gateway-port", type=int, default=1884)
+    parser.add_argument("--qos", type=int, choices=(-1, 0, 1), default=None,
+                        help="QoS of the MQTT-SN PUBLISH, MQTTSN_QOS of the firmware by default")
+    args = parser.parse_args()
+
+    # built before the fleet starts, the first build takes a few seconds
+    fw = firmware.Firmware(args.qos if args.mqtt_sn else None)
+
+    stats = Stats()
+
+    def on_connect(client, userdata, flags, rc):
+        client.subscribe(TOPIC)
+
+    def on_message(client, userdata, msg):
+        stats.on_received(bytes(msg.payload), time.monotonic())
+
+    subscriber = mqtt.Client()
+    subscriber.on_connect = on_connect
+    subscriber.on_message = on_message
+    subscriber.connect(args.host, args.port, 60)
+    subscriber.loop_start()
+    time.sleep(1)
+
+    started = time.monotonic()
+    asyncio.run(run_fleet(args, fw, stats))
+    elapsed = time.monotonic() - started
+    time.sleep(args.drain)
+    subscriber.loop_stop()
+    subscriber.disconnect()
+
+    with stats.lock:
+        lost = stats.sent - stats.received
+        if args.mqtt_sn:
+            mode = "MQTT-SN over UDP, QoS %d" % fw.mqttsn_qos
+        else:
+            mode = "per-fix connection" if args.per_fix_connection else "persistent session"
+        print("mode              : %s" % mode)
+        print("trackers          : %d" % args.trackers)
+        print("batch             : %d fixes" % (1 if args.per_fix_connection and not args.mqtt_sn else args.batch))
+        print("payload           : %s" % ("ASCII" if args.ascii else "binary, format %d" % position_record.FORMAT_VERSION))
+        print("duration          : %.1f s" % elapsed)
+        print("published         : %d (%d connection failures)" % (stats.sent, stats.failed))
+        print("received          : %d (%d unmatched)" % (stats.received, stats.unknown))
+        print("offered rate      : %.1f msg/s" % (args.trackers / args.interval))
+        print("sustained rate    : %.1f msg/s" % (stats.received / elapsed))
+        print("loss              : %d (%.2f %%)" % (lost, 100.0 * lost / stats.sent if stats.sent else 0.0))
+        print("ingestion lag p50 : %.1f ms" % (1000 * percentile(stats.lags, 50)))
+        print("ingestion lag p99 : %.1f ms" % (1000 * percentile(stats.lags, 99)))
+        print("ingestion lag max : %.1f ms" % (1000 * max(stats.lags, default=0.0)))
+        print("MQTT bytes sent   : %d (%.1f B/report, %d pings)"
+              % (stats.bytes, stats.bytes / stats.sent if stats.sent else 0.0, stats.pings))
+        if args.mqtt_sn:
+            on_air = stats.bytes + UDP_OVERHEAD * stats.writes
+            print("UDP sessions      : %d (%.3f per report)"
+                  % (stats.connections, stats.connections / stats.sent if stats.sent else 0.0))
+        else:
+            on_air = stats.bytes + TCP_OVERHEAD * (stats.writes + 2 * stats.connections)
+            print("TCP connections   : %d (%.3f per report)"
+                  % (stats.connections, stats.connections / stats.sent if stats.sent else 0.0))
+        print("IP bytes sent     : %d (%.1f B/report, %d packets)"
+              % (on_air, on_air / stats.sent if stats.sent else 0.0, stats.writes))
+        print("publish latency   : p50 %.1f ms, p99 %.1f ms"
+              % (1000 * percentile(stats.publish_latencies, 50), 1000 * percentile(stats.publish_latencies, 99)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,144 @@
+#this script is a minimal MQTT-SN gateway for the trackers built with MQTTSN_MODE (see network_functions.h): it
+# receives the MQTT-SN messages on a UDP port and publishes them to the local MQTT server, where subscribe.py
+# reads them as usual.
+#
+# only what the firmware sends is supported: CONNECT, PUBLISH to a predefined topic identifier, PINGREQ and
+# DISCONNECT, with QoS -1, 0 or 1. a QoS 1 PUBLISH is acknowledged once the MQTT server acknowledged it, so that the
+# PUBACK received by the tracker means the same thing as with MQTT over TCP. one MQTT connection is shared by all
+# the trackers: the gateway is an aggregating one.
+#
+# usage example: python3 mqttsn_gateway.py --port 1884
+
+import argparse
+import asyncio
+import struct
+import threading
+
+import paho.mqtt.client as mqtt
+
+# predefined topic identifiers, same value as MQTTSN_TOPIC_ID in network_functions.h
+TOPICS = {1: "P"}
+
+CONNECT = 0x04
+CONNACK = 0x05
+PUBLISH = 0x0c
+PUBACK = 0x0d
+PINGREQ = 0x16
+PINGRESP = 0x17
+DISCONNECT = 0x18
+
+FLAG_QOS_MASK = 0x60
+FLAG_TOPIC_TYPE_MASK = 0x03
+TOPIC_PREDEFINED = 0x01
+
+RC_ACCEPTED = 0x00
+RC_INVALID_TOPIC = 0x02
+RC_NOT_SUPPORTED = 0x03
+
+
+def message(msg_type, body=b""):
+    # the length counts the whole message, a 3 bytes length is only needed above 255 bytes
+    if len(body) + 2 <= 255:
+        return bytes([len(body) + 2, msg_type]) + body
+    return struct.pack(">BHB", 0x01, len(body) + 4, msg_type) + body
+
+
+def parse(datagram):
+    # returns the message type and the body, None if the datagram is malformed
+    if len(datagram) >= 4 and datagram[0] == 0x01:
+        length = struct.unpack_from(">H", datagram, 1)[0]
+        header = 3
+    elif len(datagram) >= 2:
+        length = datagram[0]
+        header = 1
+    else:
+        return None
+    if length != len(datagram) or length < header + 1:
+        return None
+    return datagram[header], datagram[header + 1:]
+
+
+class Gateway(asyncio.DatagramProtocol):
+    def __init__(self, broker, loop):
+        self.broker = broker
+        self.loop = loop
+        self.transport = None
+        self.clients = {}  # address -> client identifier
+        self.lock = threading.Lock()
+        self.pending = {}  # mid of the MQTT PUBLISH -> (address, topic id, msg id) of the PUBACK owed
+        broker.on_publish = self.on_publish
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def on_publish(self, client, userdata, mid):
+        # paho thread: the PUBACK is sent from the event loop
+        with self.lock:
+            owed = self.pending.pop(mid, None)
+        if owed is not None:
+            self.loop.call_soon_threadsafe(self.puback, *owed, RC_ACCEPTED)
+
+    def puback(self, address, topic_id, msg_id, rc):
+        self.transport.sendto(message(PUBACK, struct.pack(">HHB", topic_id, msg_id, rc)), address)
+
+    def datagram_received(self, datagram, address):
+        parsed = parse(datagram)
+        if parsed is None:
+            return
+        msg_type, body = parsed
+        if msg_type == CONNECT and len(body) >= 4:
+            self.clients[address] = body[4:].decode(errors="replace")
+            self.transport.sendto(message(CONNACK, bytes([RC_ACCEPTED])), address)
+        elif msg_type == PUBLISH and len(body) >= 5:
+            self.publish(address, body)
+        elif msg_type == PINGREQ:
+            self.transport.sendto(message(PINGRESP), address)
+        elif msg_type == DISCONNECT:
+            self.clients.pop(address, None)
+            self.transport.sendto(message(DISCONNECT), address)
+
+    def publish(self, address, body):
+        flags, topic_id, msg_id = struct.unpack_from(">BHH", body)
+        payload = body[5:]
+        qos = (flags & FLAG_QOS_MASK) >> 5
+        if qos == 3:
+            qos = -1
+        if qos == 2:
+            self.puback(address, topic_id, msg_id, RC_NOT_SUPPORTED)
+            return
+        topic = TOPICS.get(topic_id) if flags & FLAG_TOPIC_TYPE_MASK == TOPIC_PREDEFINED else None
+        # QoS 0 and 1 need a session, QoS -1 does not
+        if topic is None or (qos >= 0 and address not in self.clients):
+            if qos == 1:
+                self.puback(address, topic_id, msg_id, RC_INVALID_TOPIC)
+            return
+        # the lock is held until the mid is stored, on_publish may run before publish() returns
+        with self.lock:
+            info = self.broker.publish(topic, payload, qos=max(qos, 0))
+            if qos == 1:
+                self.pending[info.mid] = (address, topic_id, msg_id)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MQTT-SN gateway of the GPS trackers")
+    parser.add_argument("--port", type=int, default=1884, help="UDP port of the gateway")
+    parser.add_argument("--broker", default="localhost")
+    parser.add_argument("--broker-port", type=int, default=1883)
+    args = parser.parse_args()
+
+    broker = mqtt.Client()
+    broker.connect(args.broker, args.broker_port, 60)
+    broker.loop_start()
+
+    loop = asyncio.new_event_loop()
+    asyncio.set_event_loop(loop)
+    loop.run_until_complete(loop.create_datagram_endpoint(lambda: Gateway(broker, loop), local_addr=("0.0.0.0", args.port)))
+    try:
+        loop.run_forever()
+    finally:
+        broker.loop_stop()
+        broker.disconnect()
+
+
+if __name__ == "__main__":
+    main()
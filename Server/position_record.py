@@ -0,0 +1,110 @@
+# encoder and decoder of the binary batch payload sent by the GPS tracker, same layout as
+# Firmware/Core/Inc/position.h and position_batch_add() in Firmware/Core/Src/position.c
+#
+# a payload is the format version (1 byte) followed by the fixes in the order they were taken. the first fix is a
+# fixed 20 bytes little-endian record: time (uint32, s since 2000-01-01 UTC, 0 if not known), latitude and longitude
+# (int32, 1e-7 degree), altitude (int16, m), speed (uint16, cm/s), course (uint16, 0.01 degree), satellites (uint8)
+# and flags (uint8). every next fix is the difference with the previous one, field by field, zigzag-encoded then
+# written as a varint: 7 bits per byte, least significant first, bit 7 set when another byte follows.
+#
+# the former payloads of ASCII fixes ("ddmm.mmmmmm,dddmm.mmmmmm" separated by ";") start with a digit and are told
+# apart from the binary ones by their first byte.
+
+import calendar
+import collections
+import struct
+
+FORMAT_VERSION = 1
+EPOCH = calendar.timegm((2000, 1, 1, 0, 0, 0))
+
+FLAG_3D = 0x01        # 3D fix, the altitude is valid
+FLAG_REGAINED = 0x02  # first fix after the GPS lost its fix
+FLAG_STORED = 0x04    # the fix went through the store-and-forward log of the tracker
+
+RECORD = struct.Struct("<IiihHHBB")
+FIELDS = ("time", "latitude", "longitude", "altitude", "speed", "course", "satellites", "flags")
+# bits of every field, the differences are taken modulo 2^bits like the firmware does for the 32 bits fields
+BITS = (32, 32, 32, 16, 16, 16, 8, 8)
+SIGNED = (False, True, True, True, False, False, False, False)
+
+Position = collections.namedtuple("Position", FIELDS)
+
+
+class FormatError(ValueError):
+    pass
+
+
+def _wrap(value, bits, signed):
+    value &= (1 << bits) - 1
+    if signed and value >> (bits - 1):
+        value -= 1 << bits
+    return value
+
+
+def _delta(value, previous):
+    # modulo 2^32, as a signed 32 bits difference
+    return _wrap(value - previous, 32, True)
+
+
+def _put_varint(out, delta):
+    zigzag = ((delta << 1) ^ (delta >> 31)) & 0xffffffff
+    while zigzag >= 0x80:
+        out.append((zigzag & 0x7f) | 0x80)
+        zigzag >>= 7
+    out.append(zigzag)
+
+
+def _get_varint(payload, offset):
+    value = 0
+    shift = 0
+    while True:
+        if offset >= len(payload) or shift > 28:
+            raise FormatError("truncated varint at byte %d" % offset)
+        byte = payload[offset]
+        offset += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return (value >> 1) ^ -(value & 1), offset
+
+
+def encode_batch(positions):
+    # the signed fields are differenced as signed values, like encode_delta() in the firmware
+    out = bytearray([FORMAT_VERSION])
+    previous = None
+    for position in positions:
+        if previous is None:
+            out += RECORD.pack(*position)
+        else:
+            for value, last in zip(position, previous):
+                _put_varint(out, _delta(value, last))
+        previous = position
+    return bytes(out)
+
+
+def decode_batch(payload):
+    if not payload or payload[0] != FORMAT_VERSION:
+        raise FormatError("unknown format version %r" % payload[:1])
+    if len(payload) < 1 + RECORD.size:
+        raise FormatError("truncated first record")
+    position = Position(*RECORD.unpack_from(payload, 1))
+    positions = [position]
+    offset = 1 + RECORD.size
+    while offset < len(payload):
+        values = []
+        for value, bits, signed in zip(position, BITS, SIGNED):
+            delta, offset = _get_varint(payload, offset)
+            values.append(_wrap(value + delta, bits, signed))
+        position = Position(*values)
+        positions.append(position)
+    return positions
+
+
+def degrees(value):
+    # 1e-7 degree to decimal degrees
+    return value / 1e7
+
+
+def unix_time(position):
+    # None when the tracker did not know the time
+    return EPOCH + position.time if position.time else None
@@ -1,13 +1,17 @@
 #this script subscribes to the lcoal MQTT server on the topic "P" and saves all incoming messages to
 # /var/log/gpstrace
 
-# a transformation on the format of the GPS coordinates takes place before the values are stored
-# the prefered format used on the server is the decimal degrees dd. The transformation dd = d + mm.mm/60 
-# the values sent by the GPS tracker  follow this format ddmm.mm 
+# a message carries a batch of fixes in the binary format of position_record.py: the coordinates are in 1e-7 degree
+# and the fix also carries the time, altitude, speed, course and satellites.
+# the prefered format used on the server is the decimal degrees dd.
+# the former trackers send ASCII fixes separated by ";": ddmm.mm,dddmm.mm;ddmm.mm,dddmm.mm;...
+# the transformation dd = d + mm.mm/60 takes place before these values are stored
 
 import paho.mqtt.client as mqtt
 import math
 import os
+
+import position_record
 # The callback for when the client receives a CONNACK response from the server.
 def on_connect(client, userdata, flags, rc):
     print("Connected with result code "+str(rc))
@@ -15,15 +19,17 @@ def on_connect(client, userdata, flags, rc):
     # reconnect then subscriptions will be renewed.
     client.subscribe("P")
 
-# The callback for when a PUBLISH message is received from the server.
-def on_message(client, userdata, msg):
-    S = msg.payload.split(",")
+def store_ascii_fix(fix):
+    S = fix.split(",")
     A = [0.0,0.0]
     A[0] = float(S[0])
     A[1] = float(S[1])
     A[0]=math.floor(A[0]/100)+(A[0]/100-math.floor(A[0]/100))*5/3
     A[1]=math.floor(A[1]/100)+(A[1]/100-math.floor(A[1]/100))*5/3
-    
+    store_fix(A)
+
+def store_fix(A):
+    # A is [latitude, longitude] in decimal degrees
     if os.path.exists("/var/log/gpstrace"):
         #print("file exist\n")
         f = open("/var/log/gpstrace", 'rb+')
@@ -38,6 +44,22 @@ def on_message(client, userdata, msg):
         f = open("/var/log/gpstrace", 'a')
         f.write("[\n[%.8f,%.8f]\n]" % (A[1],A[0]))
         f.close()
+
+# The callback for when a PUBLISH message is received from the server.
+def on_message(client, userdata, msg):
+    # the fixes of a batch are stored in the order they were taken
+    if msg.payload[:1] == bytes([position_record.FORMAT_VERSION]):
+        try:
+            fixes = position_record.decode_batch(msg.payload)
+        except position_record.FormatError as error:
+            print("dropped payload: %s" % error)
+            return
+        for fix in fixes:
+            store_fix([position_record.degrees(fix.latitude), position_record.degrees(fix.longitude)])
+        return
+    for fix in msg.payload.decode().split(";"):
+        if fix:
+            store_ascii_fix(fix)
     
 
 client = mqtt.Client()